@@ -0,0 +1,881 @@
+/*
+ * Copyright (c) https://github.com/kaapomoi 2023.
+ */
+
+#include "direct_sum.h"
+#include "distributed.h"
+#include "initial_conditions.h"
+#include "lod.h"
+#include "out_of_core.h"
+#include "simulation.h"
+#include "snapshot.h"
+
+#include "fmt/core.h"
+
+#include <algorithm>
+#include <chrono>
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <random>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+///
+/// Headless benchmark of the n-body simulation.
+///
+/// Builds the same clusters as the demo from a fixed seed and steps them without a window. Every
+/// step and a final summary are written to stdout as one JSON object per line. With --compare the
+/// tree forces of the last step are checked against direct summation for an evenly spaced sample
+/// of the bodies.
+///
+/// --record writes the starting state and every Nth step to a snapshot file, --load starts from the
+/// last frame of one instead of the clusters. --replay plays a recording back without simulating
+/// and reports the same checksum for its last frame as the run that recorded it.
+///
+/// --check-precision evaluates the interaction lists of a sample of the bodies with every
+/// kernels::Precision and with the all-double kernels, reports the error and throughput of each and
+/// exits with 2 if an error is over its bound.
+///
+/// --neighbours runs k-nearest-neighbour and radius queries around a sample of the bodies on the
+/// tree and by brute force, reports the time of both and exits with 2 if their answers differ.
+///
+/// --out-of-core steps the bodies from memory-mapped files at the given path instead, see
+/// Out_of_core. The clusters are generated a chunk at a time, so they never all have to fit in
+/// memory, and only --compare reads them back.
+///
+/// --ranks splits the bodies over the given number of worker processes instead, see
+/// distributed::Coordinator, with --threads shared between them. Every step reports the work
+/// and waiting of every rank, and how evenly the work was spread.
+///
+/// --lod picks what the demo would draw at the given pixel threshold from a camera looking at the
+/// center of mass from one root width away, and reports the counts and the time it took.
+///
+namespace {
+
+/// Bodies generated at a time for --out-of-core.
+constexpr std::size_t generate_chunk{std::size_t{1} << 20};
+
+struct Options {
+    std::size_t bodies{50000};
+    std::size_t steps{10};
+    std::uint32_t seed{1};
+    std::size_t threads{std::max(std::thread::hardware_concurrency(), 1u)};
+    float dt{10.f};
+    /// Bodies checked against direct summation, 0 skips the check.
+    std::size_t compare{0};
+    Simulation::Walk_mode walk{Simulation::Walk_mode::group};
+    Oct::Multipole_order multipole{Oct::Multipole_order::quadrupole};
+    std::size_t mesh{Particle_mesh::default_mesh_size};
+    std::uint32_t leaf_size{Oct::default_leaf_size};
+    std::optional<float> opening_angle;
+    kernels::Precision precision{kernels::Precision::single};
+    /// Bodies whose lists are checked in every precision, 0 skips the check.
+    std::size_t check_precision{0};
+    std::string record;
+    std::size_t record_every{1};
+    std::string load;
+    std::string replay;
+    /// Bodies whose neighbours are queried, 0 skips the check.
+    std::size_t neighbours{0};
+    std::uint32_t k{32};
+    /// Pixel threshold of the level of detail report, 0 skips it.
+    float lod{0.f};
+    /// Path of the out-of-core store, empty runs in memory.
+    std::string out_of_core;
+    std::size_t block_size{Out_of_core::default_block_size};
+    /// Worker processes of a distributed run, 0 runs in this process.
+    std::size_t ranks{0};
+};
+
+template<class T>
+bool parse(std::string_view const text, T& value) noexcept
+{
+    auto const [end, error]{std::from_chars(text.data(), text.data() + text.size(), value)};
+    return (error == std::errc{}) && (end == text.data() + text.size());
+}
+
+bool parse_options(int const argc, char const* const* const argv, Options& options) noexcept
+{
+    for (int i{1}; i < argc; i += 2) {
+        std::string_view const name{argv[i]};
+        if (i + 1 >= argc) {
+            return false;
+        }
+        std::string_view const value{argv[i + 1]};
+
+        bool ok{false};
+        if (name == "--bodies") {
+            ok = parse(value, options.bodies);
+        }
+        else if (name == "--steps") {
+            ok = parse(value, options.steps);
+        }
+        else if (name == "--seed") {
+            ok = parse(value, options.seed);
+        }
+        else if (name == "--threads") {
+            ok = parse(value, options.threads) && (options.threads > 0);
+        }
+        else if (name == "--dt") {
+            ok = parse(value, options.dt);
+        }
+        else if (name == "--compare") {
+            ok = parse(value, options.compare);
+        }
+        else if (name == "--walk") {
+            ok = false;
+            for (Simulation::Walk_mode const walk :
+                 {Simulation::Walk_mode::per_body, Simulation::Walk_mode::group,
+                  Simulation::Walk_mode::dual_tree, Simulation::Walk_mode::tree_pm}) {
+                if (value == Simulation::str(walk)) {
+                    options.walk = walk;
+                    ok = true;
+                }
+            }
+        }
+        else if (name == "--mesh") {
+            ok = parse(value, options.mesh) && (options.mesh > 0);
+        }
+        else if (name == "--leaf-size") {
+            ok = parse(value, options.leaf_size) && (options.leaf_size > 0);
+        }
+        else if (name == "--multipole") {
+            ok = true;
+            if (value == Oct::str(Oct::Multipole_order::monopole)) {
+                options.multipole = Oct::Multipole_order::monopole;
+            }
+            else if (value == Oct::str(Oct::Multipole_order::quadrupole)) {
+                options.multipole = Oct::Multipole_order::quadrupole;
+            }
+            else {
+                ok = false;
+            }
+        }
+        else if (name == "--opening-angle") {
+            float angle{0.f};
+            ok = parse(value, angle);
+            options.opening_angle = angle;
+        }
+        else if (name == "--precision") {
+            ok = false;
+            for (kernels::Precision const precision :
+                 {kernels::Precision::single, kernels::Precision::double_sum,
+                  kernels::Precision::compensated}) {
+                if (value == kernels::str(precision)) {
+                    options.precision = precision;
+                    ok = true;
+                }
+            }
+        }
+        else if (name == "--check-precision") {
+            ok = parse(value, options.check_precision);
+        }
+        else if (name == "--record") {
+            options.record = value;
+            ok = !value.empty();
+        }
+        else if (name == "--record-every") {
+            ok = parse(value, options.record_every) && (options.record_every > 0);
+        }
+        else if (name == "--load") {
+            options.load = value;
+            ok = !value.empty();
+        }
+        else if (name == "--replay") {
+            options.replay = value;
+            ok = !value.empty();
+        }
+        else if (name == "--neighbours") {
+            ok = parse(value, options.neighbours);
+        }
+        else if (name == "--k") {
+            ok = parse(value, options.k) && (options.k > 0);
+        }
+        else if (name == "--lod") {
+            ok = parse(value, options.lod) && (options.lod >= 0.f);
+        }
+        else if (name == "--out-of-core") {
+            options.out_of_core = value;
+            ok = !value.empty();
+        }
+        else if (name == "--block-size") {
+            ok = parse(value, options.block_size) && (options.block_size > 0);
+        }
+        else if (name == "--ranks") {
+            ok = parse(value, options.ranks);
+        }
+
+        if (!ok) {
+            fmt::print(stderr, "Invalid option: {} {}\n", name, value);
+            return false;
+        }
+    }
+    return true;
+}
+
+void print_usage(char const* const program) noexcept
+{
+    fmt::print(stderr,
+               "Usage: {} [--bodies N] [--steps N] [--seed N] [--threads N] [--dt SECONDS]\n"
+               "       [--walk per_body|group|dual_tree|tree_pm] [--mesh N] [--leaf-size N]\n"
+               "       [--multipole monopole|quadrupole] [--opening-angle THETA] [--compare N]\n"
+               "       [--precision single|double|compensated] [--check-precision N]\n"
+               "       [--record FILE] [--record-every N] [--load FILE] [--lod PIXELS]\n"
+               "       [--neighbours N] [--k N] [--out-of-core FILE] [--block-size N]\n"
+               "       [--ranks N]\n"
+               "       {} --replay FILE\n",
+               program, program);
+}
+
+///
+/// \brief Warns when the thread pool got fewer threads than --threads asked for.
+///
+/// sal::Thread_pool caps its size at the hardware threads, so on a small machine a run asking for
+/// more silently runs on fewer. The config event reports both.
+///
+void warn_thread_count(std::size_t const requested, std::size_t const effective) noexcept
+{
+    if (effective < requested) {
+        fmt::print(stderr, "Asked for {} threads, the hardware runs {}\n", requested, effective);
+    }
+}
+
+/// Sum of every coordinate, equal between two runs only if they produced the same bodies.
+double checksum(Particles const& particles) noexcept
+{
+    double sum{0.0};
+    for (std::size_t i{0}; i < particles.size(); i++) {
+        sum += static_cast<double>(particles.x[i]) + particles.y[i] + particles.z[i];
+    }
+    return sum;
+}
+
+/// \return false if the tree and brute force disagree
+bool check_neighbours(Simulation const& simulation,
+                      std::size_t const sample_size,
+                      std::uint32_t const k) noexcept
+{
+    Particles const& particles{simulation.particles()};
+    Oct const& tree{simulation.tree()};
+    std::size_t const n{particles.size()};
+    std::size_t const stride{std::max<std::size_t>(1, n / std::max<std::size_t>(sample_size, 1))};
+
+    std::vector<glm::vec3> points;
+    for (std::size_t i{0}; i < n && points.size() < sample_size; i += stride) {
+        points.push_back(particles.position(i));
+    }
+
+    sal::Job_pool pool{simulation.thread_count()};
+    auto const seconds{[](std::chrono::high_resolution_clock::time_point const start) {
+        return std::chrono::duration_cast<std::chrono::duration<float>>(
+                   std::chrono::high_resolution_clock::now() - start)
+            .count();
+    }};
+
+    auto const distance_squared{[&](std::size_t const body, glm::vec3 const& point) {
+        glm::vec3 const d{particles.position(body) - point};
+        return glm::dot(d, d);
+    }};
+
+    std::chrono::high_resolution_clock::time_point sw_start{
+        std::chrono::high_resolution_clock::now()};
+    std::vector<std::vector<Oct::Neighbour>> tree_nearest;
+    tree.nearest(pool, points, k, tree_nearest);
+    float const tree_nearest_time{seconds(sw_start)};
+
+    sw_start = std::chrono::high_resolution_clock::now();
+    std::vector<std::vector<Oct::Neighbour>> brute_nearest(points.size());
+    sal::parallel_for(pool, points.size(), [&](std::size_t const begin, std::size_t const end) {
+        std::vector<Oct::Neighbour> all(n);
+        for (std::size_t i{begin}; i < end; i++) {
+            for (std::size_t b{0}; b < n; b++) {
+                all[b] = {static_cast<std::uint32_t>(b), distance_squared(b, points[i])};
+            }
+            std::size_t const count{std::min<std::size_t>(k, n)};
+            std::partial_sort(all.begin(), all.begin() + count, all.end(),
+                              [](Oct::Neighbour const& a, Oct::Neighbour const& b) {
+                                  return a.distance_squared < b.distance_squared;
+                              });
+            brute_nearest[i].assign(all.begin(), all.begin() + count);
+        }
+    });
+    float const brute_nearest_time{seconds(sw_start)};
+
+    /// Ties may pick different bodies, the distances must match.
+    std::size_t mismatches{0};
+    std::vector<float> kth_distances;
+    for (std::size_t i{0}; i < points.size(); i++) {
+        bool const same{std::equal(tree_nearest[i].begin(), tree_nearest[i].end(),
+                                   brute_nearest[i].begin(), brute_nearest[i].end(),
+                                   [](Oct::Neighbour const& a, Oct::Neighbour const& b) {
+                                       return a.distance_squared == b.distance_squared;
+                                   })};
+        mismatches += same ? 0 : 1;
+        if (!brute_nearest[i].empty()) {
+            kth_distances.push_back(std::sqrt(brute_nearest[i].back().distance_squared));
+        }
+    }
+
+    /// A radius that holds about k bodies around the median point.
+    std::nth_element(kth_distances.begin(), kth_distances.begin() + kth_distances.size() / 2,
+                     kth_distances.end());
+    float const radius{kth_distances.empty() ? 0.f : kth_distances[kth_distances.size() / 2]};
+
+    sw_start = std::chrono::high_resolution_clock::now();
+    std::vector<std::vector<std::uint32_t>> tree_within;
+    tree.within_radius(pool, points, radius, tree_within);
+    float const tree_within_time{seconds(sw_start)};
+
+    sw_start = std::chrono::high_resolution_clock::now();
+    std::vector<std::vector<std::uint32_t>> brute_within(points.size());
+    sal::parallel_for(pool, points.size(), [&](std::size_t const begin, std::size_t const end) {
+        for (std::size_t i{begin}; i < end; i++) {
+            for (std::size_t b{0}; b < n; b++) {
+                if (distance_squared(b, points[i]) <= radius * radius) {
+                    brute_within[i].push_back(static_cast<std::uint32_t>(b));
+                }
+            }
+        }
+    });
+    float const brute_within_time{seconds(sw_start)};
+
+    std::size_t found{0};
+    for (std::size_t i{0}; i < points.size(); i++) {
+        std::sort(tree_within[i].begin(), tree_within[i].end());
+        mismatches += (tree_within[i] == brute_within[i]) ? 0 : 1;
+        found += tree_within[i].size();
+    }
+
+    fmt::print("{{\"event\":\"neighbours\",\"queries\":{},\"k\":{},\"radius\":{:.6g},"
+               "\"mean_within_radius\":{:.2f},\"tree_nearest_s\":{:.6f},"
+               "\"brute_nearest_s\":{:.6f},\"tree_radius_s\":{:.6f},\"brute_radius_s\":{:.6f},"
+               "\"mismatches\":{}}}\n",
+               points.size(), k, radius,
+               static_cast<double>(found) / std::max<std::size_t>(points.size(), 1),
+               tree_nearest_time, brute_nearest_time, tree_within_time, brute_within_time,
+               mismatches);
+    return mismatches == 0;
+}
+
+/// Level of detail of a 1080 pixel high view like the demo's.
+void report_lod(Oct const& tree, float const pixel_threshold) noexcept
+{
+    float const fov_y{glm::radians(45.f)};
+    constexpr float viewport_height{1080.f};
+
+    float const distance{std::max(tree.stats().root_width, 1.f)};
+    lod::View const view{tree.center_of_mass() - glm::vec3{0.f, 0.f, distance},
+                         glm::vec3{0.f, 0.f, 1.f}, lod::focal_length(fov_y, viewport_height),
+                         pixel_threshold};
+
+    lod::Scene scene;
+    lod::Selection selection;
+    std::chrono::high_resolution_clock::time_point const sw_start{
+        std::chrono::high_resolution_clock::now()};
+
+    scene.capture(tree);
+
+    std::chrono::high_resolution_clock::time_point const capture_end{
+        std::chrono::high_resolution_clock::now()};
+
+    lod::select(scene, view, selection);
+
+    std::chrono::high_resolution_clock::time_point const select_end{
+        std::chrono::high_resolution_clock::now()};
+
+    auto const seconds{[](auto const duration) {
+        return std::chrono::duration_cast<std::chrono::duration<float>>(duration).count();
+    }};
+
+    fmt::print("{{\"event\":\"lod\",\"pixel_threshold\":{},\"cells\":{},\"impostors\":{},"
+               "\"bodies\":{},\"culled_cells\":{},\"capture_s\":{:.6f},\"select_s\":{:.6f}}}\n",
+               pixel_threshold, tree.cell_count(), selection.impostors.size(),
+               selection.bodies.size(), selection.culled_cells, seconds(capture_end - sw_start),
+               seconds(select_end - capture_end));
+}
+
+/// Compares the accelerations of the last step against direct summation.
+void compare(Particles const& particles,
+             std::size_t const thread_count,
+             kernels::Isa const isa,
+             std::size_t const sample_size) noexcept
+{
+    std::size_t const n{particles.size()};
+    std::size_t const stride{std::max<std::size_t>(1, n / std::max<std::size_t>(sample_size, 1))};
+
+    std::vector<std::uint32_t> targets;
+    for (std::size_t i{0}; i < n && targets.size() < sample_size; i += stride) {
+        targets.push_back(static_cast<std::uint32_t>(i));
+    }
+
+    std::vector<glm::dvec3> reference(targets.size());
+
+    std::chrono::high_resolution_clock::time_point const sw_start{
+        std::chrono::high_resolution_clock::now()};
+
+    sal::Job_pool pool{thread_count};
+    direct_sum::accelerations(pool, particles, kernels::select(isa), targets, reference);
+
+    float const direct_time{std::chrono::duration_cast<std::chrono::duration<float>>(
+                                std::chrono::high_resolution_clock::now() - sw_start)
+                                .count()};
+
+    direct_sum::Error_stats const error{
+        direct_sum::relative_error(particles, targets, reference)};
+
+    fmt::print("{{\"event\":\"compare\",\"targets\":{},\"direct_s\":{:.6f},"
+               "\"interactions_per_s\":{:.4e},\"error_mean\":{:.4e},\"error_p50\":{:.4e},"
+               "\"error_p90\":{:.4e},\"error_p99\":{:.4e},\"error_max\":{:.4e}}}\n",
+               error.count, direct_time,
+               static_cast<double>(targets.size()) * n / std::max(direct_time, 1e-9f),
+               error.mean, error.p50, error.p90, error.p99, error.max);
+}
+
+///
+/// \brief Error bound of every precision against the all-double kernels.
+///
+/// Interactions stay in float, so even the double sums keep the ~2^-22 error of the refined
+/// rsqrt and rcp. Float sums of a few thousand terms lose a few more bits on top of that.
+///
+double precision_error_bound(kernels::Precision const precision) noexcept
+{
+    switch (precision) {
+    case kernels::Precision::single:
+        return 1e-5;
+    case kernels::Precision::double_sum:
+    case kernels::Precision::compensated:
+        return 5e-6;
+    }
+    return 0.0;
+}
+
+/// \return false if the error of a precision is over its bound
+bool check_precision(Simulation const& simulation, std::size_t const sample_size) noexcept
+{
+    /// Lists of evenly spaced groups, every body of a group is a target of its list like in the
+    /// group walk.
+    Oct const& tree{simulation.tree()};
+    std::span<Oct::Group const> const groups{tree.groups()};
+    std::size_t const group_sample{
+        std::max<std::size_t>(1, sample_size / Oct::default_group_size)};
+    std::size_t const stride{std::max<std::size_t>(1, groups.size() / group_sample)};
+
+    std::vector<kernels::Interaction_list> lists;
+    std::vector<kernels::Quadrupole_list> fars;
+    std::vector<glm::vec3> targets;
+    std::vector<std::size_t> target_lists;
+    std::vector<glm::dvec3> reference;
+    std::uint64_t interactions{0};
+    for (std::size_t g{0}; g < groups.size() && targets.size() < sample_size; g += stride) {
+        Oct::Group const& group{groups[g]};
+        lists.emplace_back();
+        fars.emplace_back();
+        tree.interactions(group, lists.back(), fars.back());
+
+        for (std::uint32_t body{group.first_body}; body < group.first_body + group.body_count;
+             body++) {
+            targets.push_back(tree.position(body));
+            target_lists.push_back(lists.size() - 1);
+            reference.push_back(kernels::reference(targets.back(), lists.back())
+                                + kernels::reference_quadrupole(targets.back(), fars.back()));
+            interactions += lists.back().size() + fars.back().size();
+        }
+    }
+
+    /// The lists are evaluated a few times over, the fastest pass is reported.
+    static constexpr std::size_t passes{5};
+
+    bool passed{true};
+    for (kernels::Precision const precision :
+         {kernels::Precision::single, kernels::Precision::double_sum,
+          kernels::Precision::compensated}) {
+        kernels::Kernel const kernel{kernels::select(simulation.kernel_isa(), precision)};
+        kernels::Quadrupole_kernel const quadrupole_kernel{
+            kernels::select_quadrupole(simulation.kernel_isa(), precision)};
+
+        std::vector<glm::vec3> accelerations(targets.size());
+        float best_time{std::numeric_limits<float>::max()};
+        for (std::size_t pass{0}; pass < passes; pass++) {
+            std::chrono::high_resolution_clock::time_point const sw_start{
+                std::chrono::high_resolution_clock::now()};
+
+            for (std::size_t i{0}; i < targets.size(); i++) {
+                std::size_t const list{target_lists[i]};
+                accelerations[i] =
+                    kernel(targets[i], lists[list]) + quadrupole_kernel(targets[i], fars[list]);
+            }
+
+            best_time = std::min(best_time,
+                                 std::chrono::duration_cast<std::chrono::duration<float>>(
+                                     std::chrono::high_resolution_clock::now() - sw_start)
+                                     .count());
+        }
+
+        double error_sum{0.0};
+        double error_max{0.0};
+        for (std::size_t i{0}; i < targets.size(); i++) {
+            double const magnitude{glm::length(reference[i])};
+            if (magnitude > 0.0) {
+                double const error{glm::length(glm::dvec3{accelerations[i]} - reference[i])
+                                   / magnitude};
+                error_sum += error;
+                error_max = std::max(error_max, error);
+            }
+        }
+
+        bool const within_bound{error_max <= precision_error_bound(precision)};
+        passed = passed && within_bound;
+
+        fmt::print("{{\"event\":\"precision\",\"precision\":\"{}\",\"targets\":{},"
+                   "\"interactions\":{},\"time_s\":{:.6f},\"interactions_per_s\":{:.4e},"
+                   "\"error_mean\":{:.4e},\"error_max\":{:.4e},\"error_bound\":{:.1e},"
+                   "\"passed\":{}}}\n",
+                   kernels::str(precision), targets.size(), interactions, best_time,
+                   static_cast<double>(interactions) / std::max(best_time, 1e-9f),
+                   error_sum / static_cast<double>(std::max<std::size_t>(targets.size(), 1)),
+                   error_max, precision_error_bound(precision), within_bound);
+    }
+    return passed;
+}
+
+/// Streams every frame of a recording straight from the mapping.
+int replay(std::string const& file) noexcept
+{
+    snapshot::Reader reader;
+    if (!reader.open(file)) {
+        fmt::print(stderr, "Can't read snapshot: {}\n", file);
+        return 1;
+    }
+
+    std::chrono::high_resolution_clock::time_point const sw_start{
+        std::chrono::high_resolution_clock::now()};
+
+    double sum{0.0};
+    for (std::size_t i{0}; i < reader.frame_count(); i++) {
+        snapshot::Frame const frame{reader.frame(i)};
+
+        sum = 0.0;
+        for (std::size_t body{0}; body < reader.body_count(); body++) {
+            sum += static_cast<double>(frame.x[body]) + frame.y[body] + frame.z[body];
+        }
+        fmt::print("{{\"event\":\"frame\",\"frame\":{},\"step\":{},\"time\":{},"
+                   "\"checksum\":{:.17g}}}\n",
+                   i, frame.step, frame.time, sum);
+    }
+
+    float const replay_time{std::chrono::duration_cast<std::chrono::duration<float>>(
+                                std::chrono::high_resolution_clock::now() - sw_start)
+                                .count()};
+
+    fmt::print("{{\"event\":\"replay\",\"bodies\":{},\"frames\":{},\"replay_s\":{:.6f},"
+               "\"checksum\":{:.17g}}}\n",
+               reader.body_count(), reader.frame_count(), replay_time, sum);
+    return 0;
+}
+
+/// Runs the steps on an Out_of_core store instead of a Simulation.
+int run_out_of_core(Options const& options) noexcept
+{
+    Out_of_core store{options.threads};
+    if (!store.create(options.out_of_core, options.bodies, options.block_size)) {
+        fmt::print(stderr, "Can't create the out-of-core store: {}\n", options.out_of_core);
+        return 1;
+    }
+
+    std::mt19937 engine{options.seed};
+    Particles chunk;
+    for (std::size_t first{0}; first < options.bodies; first += generate_chunk) {
+        chunk.clear();
+        initial_conditions::clusters(chunk, std::min(generate_chunk, options.bodies - first),
+                                     engine);
+        store.write(first, chunk);
+    }
+
+    warn_thread_count(options.threads, store.thread_count());
+    fmt::print("{{\"event\":\"config\",\"mode\":\"out_of_core\",\"bodies\":{},\"steps\":{},"
+               "\"seed\":{},\"threads\":{},\"threads_requested\":{},\"dt\":{},\"isa\":\"{}\","
+               "\"block_size\":{}}}\n",
+               store.size(), options.steps, options.seed, store.thread_count(), options.threads,
+               options.dt, kernels::str(store.kernel_isa()), store.block_size());
+
+    Out_of_core::Step_stats total{};
+    for (std::size_t i{0}; i < options.steps; i++) {
+        store.step(options.dt);
+
+        Out_of_core::Step_stats const& step{store.last_step()};
+        fmt::print("{{\"event\":\"step\",\"step\":{},\"sort_s\":{:.6f},\"tree_s\":{:.6f},"
+                   "\"force_s\":{:.6f},\"integrate_s\":{:.6f},\"scattered\":{},"
+                   "\"interactions\":{},\"interactions_per_s\":{:.4e},\"resident_cells\":{}}}\n",
+                   i, step.sort_time, step.tree_time, step.force_time, step.integrate_time,
+                   step.scattered, step.interactions,
+                   static_cast<double>(step.interactions) / std::max(step.force_time, 1e-9f),
+                   store.resident_cell_count());
+
+        total.sort_time += step.sort_time;
+        total.tree_time += step.tree_time;
+        total.force_time += step.force_time;
+        total.integrate_time += step.integrate_time;
+        total.scattered += step.scattered;
+        total.interactions += step.interactions;
+    }
+
+    fmt::print("{{\"event\":\"summary\",\"sort_s\":{:.6f},\"tree_s\":{:.6f},\"force_s\":{:.6f},"
+               "\"integrate_s\":{:.6f},\"scattered\":{},\"interactions\":{},"
+               "\"interactions_per_s\":{:.4e}}}\n",
+               total.sort_time, total.tree_time, total.force_time, total.integrate_time,
+               total.scattered, total.interactions,
+               static_cast<double>(total.interactions) / std::max(total.force_time, 1e-9f));
+
+    if (options.compare > 0) {
+        if (options.steps == 0) {
+            store.step(0.f);
+        }
+
+        Particles particles;
+        store.read(0, store.size(), particles);
+        compare(particles, store.thread_count(), store.kernel_isa(), options.compare);
+    }
+
+    return 0;
+}
+
+/// Runs the steps on ranks of a distributed::Coordinator instead of a Simulation.
+int run_distributed(Options const& options) noexcept
+{
+    distributed::Coordinator coordinator;
+    std::size_t const threads_per_rank{std::max<std::size_t>(1, options.threads / options.ranks)};
+    if (!coordinator.start(options.ranks, threads_per_rank)) {
+        fmt::print(stderr, "Can't start {} ranks\n", options.ranks);
+        return 1;
+    }
+
+    Particles particles;
+    std::mt19937 engine{options.seed};
+    initial_conditions::clusters(particles, options.bodies, engine);
+    if (!coordinator.scatter(particles)) {
+        fmt::print(stderr, "Lost a rank\n");
+        return 1;
+    }
+
+    fmt::print("{{\"event\":\"config\",\"mode\":\"distributed\",\"bodies\":{},\"steps\":{},"
+               "\"seed\":{},\"ranks\":{},\"threads_per_rank\":{},\"dt\":{}}}\n",
+               particles.size(), options.steps, options.seed, coordinator.rank_count(),
+               threads_per_rank, options.dt);
+
+    std::vector<distributed::Rank_stats> total(coordinator.rank_count());
+    float total_time{0.f};
+    for (std::size_t i{0}; i < options.steps; i++) {
+        if (!coordinator.step(options.dt)) {
+            fmt::print(stderr, "Lost a rank\n");
+            return 1;
+        }
+
+        std::span<distributed::Rank_stats const> const ranks{coordinator.last_step()};
+        float const step_time{coordinator.last_step_time()};
+        std::uint64_t interactions{0};
+        float max_busy{0.f};
+        float busy_sum{0.f};
+        std::string rank_json;
+        for (std::size_t r{0}; r < ranks.size(); r++) {
+            distributed::Rank_stats const& rank{ranks[r]};
+            interactions += rank.interactions;
+            max_busy = std::max(max_busy, rank.busy_time());
+            busy_sum += rank.busy_time();
+            rank_json += fmt::format("{}{{\"bodies\":{},\"migrated\":{},\"imported\":{},"
+                                     "\"interactions\":{},\"busy_s\":{:.6f},"
+                                     "\"exchange_s\":{:.6f},\"efficiency\":{:.4f}}}",
+                                     (r == 0) ? "" : ",", rank.body_count, rank.migrated,
+                                     rank.imported, rank.interactions, rank.busy_time(),
+                                     rank.exchange_time,
+                                     rank.busy_time() / std::max(step_time, 1e-9f));
+
+            distributed::add(total[r], rank);
+        }
+        total_time += step_time;
+
+        /// Imbalance is the slowest rank against the mean, efficiency the share of the step the
+        /// mean rank spent computing.
+        float const mean_busy{busy_sum / static_cast<float>(ranks.size())};
+        fmt::print("{{\"event\":\"step\",\"step\":{},\"step_s\":{:.6f},\"interactions\":{},"
+                   "\"imbalance\":{:.4f},\"efficiency\":{:.4f},\"ranks\":[{}]}}\n",
+                   i, step_time, interactions, max_busy / std::max(mean_busy, 1e-9f),
+                   mean_busy / std::max(step_time, 1e-9f), rank_json);
+    }
+
+    std::uint64_t interactions{0};
+    float max_busy{0.f};
+    float busy_sum{0.f};
+    for (distributed::Rank_stats const& rank : total) {
+        interactions += rank.interactions;
+        max_busy = std::max(max_busy, rank.busy_time());
+        busy_sum += rank.busy_time();
+    }
+    float const mean_busy{busy_sum / static_cast<float>(total.size())};
+    fmt::print("{{\"event\":\"summary\",\"step_s\":{:.6f},\"interactions\":{},"
+               "\"interactions_per_s\":{:.4e},\"imbalance\":{:.4f},\"efficiency\":{:.4f}}}\n",
+               total_time, interactions,
+               static_cast<double>(interactions) / std::max(total_time, 1e-9f),
+               max_busy / std::max(mean_busy, 1e-9f), mean_busy / std::max(total_time, 1e-9f));
+
+    if (options.compare > 0) {
+        if (options.steps == 0 && !coordinator.step(0.f)) {
+            fmt::print(stderr, "Lost a rank\n");
+            return 1;
+        }
+        if (!coordinator.gather(particles)) {
+            fmt::print(stderr, "Lost a rank\n");
+            return 1;
+        }
+        compare(particles, options.threads, kernels::detect(), options.compare);
+    }
+
+    return 0;
+}
+
+} // namespace
+
+
+int main(int argc, char** argv)
+{
+    Options options{};
+    if (!parse_options(argc, argv, options)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    if (!options.replay.empty()) {
+        return replay(options.replay);
+    }
+
+    if (!options.out_of_core.empty()) {
+        return run_out_of_core(options);
+    }
+
+    /// Before anything starts a thread, the ranks are forked from this process.
+    if (options.ranks > 0) {
+        return run_distributed(options);
+    }
+
+    Simulation simulation{options.threads};
+    simulation.set_walk_mode(options.walk);
+    simulation.set_mesh_size(options.mesh);
+    simulation.set_leaf_size(options.leaf_size);
+    simulation.set_multipole_order(options.multipole);
+    simulation.set_precision(options.precision);
+    if (options.opening_angle) {
+        simulation.set_opening_angle(*options.opening_angle);
+    }
+
+    if (!options.load.empty()) {
+        snapshot::Reader reader;
+        if (!reader.open(options.load) || (reader.frame_count() == 0)) {
+            fmt::print(stderr, "Can't read snapshot: {}\n", options.load);
+            return 1;
+        }
+        reader.load(reader.frame_count() - 1, simulation.particles());
+    }
+    else {
+        std::mt19937 engine{options.seed};
+        initial_conditions::clusters(simulation.particles(), options.bodies, engine);
+    }
+
+    snapshot::Writer writer;
+    if (!options.record.empty()) {
+        if (!writer.open(options.record, simulation.particles().size())) {
+            fmt::print(stderr, "Can't write snapshot: {}\n", options.record);
+            return 1;
+        }
+        writer.write(simulation.particles(), 0, 0.0);
+    }
+
+    Oct const& tree{simulation.tree()};
+    warn_thread_count(options.threads, simulation.thread_count());
+    fmt::print("{{\"event\":\"config\",\"bodies\":{},\"steps\":{},\"seed\":{},\"threads\":{},"
+               "\"threads_requested\":{},\"dt\":{},\"isa\":\"{}\",\"precision\":\"{}\","
+               "\"build\":\"{}\",\"update\":\"{}\",\"walk\":\"{}\",\"mesh\":{},\"leaf_size\":{},"
+               "\"multipole\":\"{}\",\"opening_angle\":{}}}\n",
+               simulation.particles().size(), options.steps, options.seed,
+               simulation.thread_count(), options.threads, options.dt,
+               kernels::str(simulation.kernel_isa()), kernels::str(simulation.precision()),
+               Oct::str(simulation.build_mode()), Simulation::str(simulation.tree_update()),
+               Simulation::str(simulation.walk_mode()), simulation.mesh_size(),
+               simulation.leaf_size(), Oct::str(tree.multipole_order()), tree.opening_angle());
+
+    Simulation::Step_stats total{};
+    for (std::size_t i{0}; i < options.steps; i++) {
+        simulation.step(options.dt);
+        if (writer.is_open() && ((i + 1) % options.record_every == 0)) {
+            writer.write(simulation.particles(), i + 1, static_cast<double>(i + 1) * options.dt);
+        }
+
+        Simulation::Step_stats const& step{simulation.last_step()};
+        Oct::Stats const stats{tree.stats()};
+        fmt::print("{{\"event\":\"step\",\"step\":{},\"tree_s\":{:.6f},\"force_s\":{:.6f},"
+                   "\"integrate_s\":{:.6f},\"tree_builds\":{},\"tree_refits\":{},"
+                   "\"sub_steps\":{},\"force_evaluations\":{},\"interactions\":{},"
+                   "\"interactions_per_s\":{:.4e},\"root_width\":{:.6g},\"cell_count\":{},"
+                   "\"max_depth\":{},\"mean_leaf_depth\":{:.2f},\"mean_leaf_size\":{:.2f}}}\n",
+                   i, step.tree_time, step.force_time, step.integrate_time, step.tree_builds,
+                   step.tree_refits, step.sub_steps, step.force_evaluations, step.interactions,
+                   static_cast<double>(step.interactions) / std::max(step.force_time, 1e-9f),
+                   stats.root_width, stats.cell_count, stats.max_depth, stats.mean_leaf_depth,
+                   stats.mean_leaf_size);
+
+        total.tree_time += step.tree_time;
+        total.force_time += step.force_time;
+        total.integrate_time += step.integrate_time;
+        total.tree_builds += step.tree_builds;
+        total.tree_refits += step.tree_refits;
+        total.sub_steps += step.sub_steps;
+        total.force_evaluations += step.force_evaluations;
+        total.interactions += step.interactions;
+    }
+
+    fmt::print("{{\"event\":\"summary\",\"tree_s\":{:.6f},\"force_s\":{:.6f},"
+               "\"integrate_s\":{:.6f},\"tree_builds\":{},\"tree_refits\":{},\"sub_steps\":{},"
+               "\"force_evaluations\":{},\"interactions\":{},\"interactions_per_s\":{:.4e},"
+               "\"checksum\":{:.17g}}}\n",
+               total.tree_time, total.force_time, total.integrate_time, total.tree_builds,
+               total.tree_refits, total.sub_steps, total.force_evaluations, total.interactions,
+               static_cast<double>(total.interactions) / std::max(total.force_time, 1e-9f),
+               checksum(simulation.particles()));
+
+    if (writer.is_open()) {
+        writer.close();
+        fmt::print("{{\"event\":\"record\",\"file\":\"{}\",\"frames\":{}}}\n", options.record,
+                   writer.frames_written());
+    }
+
+    /// Accelerations and the tree are only there once a step has evaluated them.
+    if ((options.steps == 0)
+        && ((options.compare > 0) || (options.check_precision > 0) || (options.neighbours > 0)
+            || (options.lod > 0.f))) {
+        simulation.step(0.f);
+    }
+
+    if (options.compare > 0) {
+        compare(simulation.particles(), simulation.thread_count(), simulation.kernel_isa(),
+                options.compare);
+    }
+
+    if (options.lod > 0.f) {
+        report_lod(tree, options.lod);
+    }
+
+    if ((options.neighbours > 0)
+        && !check_neighbours(simulation, options.neighbours, options.k)) {
+        return 2;
+    }
+
+    if ((options.check_precision > 0) && !check_precision(simulation, options.check_precision)) {
+        return 2;
+    }
+
+    return 0;
+}
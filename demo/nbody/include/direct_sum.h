@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) https://github.com/kaapomoi 2023.
+ */
+
+#ifndef DIRECT_SUM_H
+#define DIRECT_SUM_H
+
+#include "force_kernels.h"
+#include "parallel_for.h"
+#include "particles.h"
+
+#include <cstdint>
+#include <span>
+
+///
+/// Exact O(N^2) forces, the ground truth the tree is measured against.
+///
+namespace direct_sum {
+
+/// Sources per tile. The four arrays of a tile take 32 KiB, so the tile stays in cache while a
+/// whole block of targets runs over it.
+constexpr std::size_t tile_size{2048};
+
+///
+/// \brief Acceleration of every target caused by every body, with the same force law and kernel
+/// as the tree walks.
+///
+/// Targets are split between the workers, each worker runs its block of targets over one source
+/// tile at a time. Tiles are summed in double.
+///
+/// \note out must hold one element per target.
+///
+void accelerations(sal::Job_pool& pool,
+                   Particles const& particles,
+                   kernels::Kernel const kernel,
+                   std::span<std::uint32_t const> const targets,
+                   std::span<glm::dvec3> const out) noexcept;
+
+struct Error_stats {
+    std::size_t count{0};
+    double mean{0.0};
+    double p50{0.0};
+    double p90{0.0};
+    double p99{0.0};
+    double max{0.0};
+};
+
+///
+/// \brief Distribution of |a - reference| / |reference| over the targets, where a is the
+/// acceleration currently stored in particles.
+///
+Error_stats relative_error(Particles const& particles,
+                           std::span<std::uint32_t const> const targets,
+                           std::span<glm::dvec3 const> const reference) noexcept;
+
+} // namespace direct_sum
+
+#endif
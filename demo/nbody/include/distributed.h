@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) https://github.com/kaapomoi 2023.
+ */
+
+#ifndef DISTRIBUTED_H
+#define DISTRIBUTED_H
+
+#include "particles.h"
+
+#include <cstdint>
+#include <span>
+#include <vector>
+
+///
+/// Barnes-Hut runs split over several worker processes, ranks, on one machine.
+///
+/// Every rank owns the bodies of one contiguous range of Morton keys, taken over the bounds of
+/// all bodies. Each step the ranks send the coordinator their bounds and a histogram of their
+/// measured work, the interactions of every body in the last step, over the leading key digits.
+/// The coordinator cuts the keys where the work is even, and bodies that left their rank's range
+/// migrate to the new owner.
+///
+/// Every rank then sends every other rank its locally essential tree: the cells of its own tree
+/// that the other rank's whole domain accepts, and the bodies of the leaves it would open. The
+/// imported cells join the rank's own bodies in one tree, whose group walk sees the whole system
+/// at the accuracy of a single tree.
+///
+/// The coordinator and every rank talk over a Unix domain socket pair made before the ranks are
+/// forked, and every two ranks over a pair of their own. Exchanges between ranks poll all of
+/// their sockets at once, so two ranks never wait on each other's full buffers.
+///
+/// Every body steps with the same dt in kick-drift-kick leapfrog, accepted cells are monopoles at
+/// Oct::default_opening_angle.
+///
+/// \note Needs fork() and Unix domain sockets, start() fails on Windows.
+///
+namespace distributed {
+
+/// What one rank did during the last step.
+struct Rank_stats {
+    std::uint64_t body_count{0};
+    /// Bodies that moved to the rank from the others.
+    std::uint64_t migrated{0};
+    /// Cells and bodies of the other ranks' essential trees.
+    std::uint64_t imported{0};
+    std::uint64_t interactions{0};
+    float integrate_time{0.f};
+    float tree_time{0.f};
+    float force_time{0.f};
+    /// Sending, receiving and waiting for the coordinator and the other ranks.
+    float exchange_time{0.f};
+
+    /// Time the rank spent computing instead of waiting.
+    float busy_time() const noexcept { return integrate_time + tree_time + force_time; }
+};
+
+/// Adds the counts and times of a later phase or step to total, the body count is the later one.
+void add(Rank_stats& total, Rank_stats const& later) noexcept;
+
+///
+/// \brief Starts the ranks, hands out the bodies and runs the steps.
+///
+class Coordinator {
+public:
+    Coordinator() = default;
+    ~Coordinator() noexcept;
+
+    Coordinator(Coordinator const&) = delete;
+    Coordinator& operator=(Coordinator const&) = delete;
+
+    ///
+    /// \brief Forks rank_count worker processes with threads_per_rank threads each.
+    ///
+    /// \note Call it before the process starts threads of its own, a forked child only keeps the
+    /// thread that forked it.
+    ///
+    /// \return false if the sockets or processes can't be made, nothing is left running then.
+    ///
+    bool start(std::size_t const rank_count, std::size_t const threads_per_rank) noexcept;
+
+    /// Tells the ranks to exit and waits for them.
+    void stop() noexcept;
+
+    bool is_running() const noexcept;
+
+    std::size_t rank_count() const noexcept;
+
+    ///
+    /// \brief Replaces the bodies of the ranks with the given ones, an even range for each.
+    ///
+    /// \return false if a rank is gone, the run can't continue then.
+    ///
+    bool scatter(Particles const& particles) noexcept;
+
+    ///
+    /// \brief Advances every body by dt.
+    ///
+    /// The first step after scatter() also evaluates the starting accelerations.
+    ///
+    /// \return false if a rank is gone, the run can't continue then.
+    ///
+    bool step(float const dt) noexcept;
+
+    /// What every rank did in the last step.
+    std::span<Rank_stats const> last_step() const noexcept;
+
+    /// Wall time of the last step as the coordinator saw it.
+    float last_step_time() const noexcept;
+
+    /// Replaces out with the bodies of every rank, accelerations included, one rank after another.
+    bool gather(Particles& out) noexcept;
+
+private:
+    /// Kick, drift, decomposition, exchanges, forces and kick on every rank.
+    bool run_phase(float const kick_before, float const drift, float const kick_after) noexcept;
+
+    /// Socket to every rank and its process id.
+    std::vector<int> m_sockets;
+    std::vector<int> m_processes;
+
+    std::vector<Rank_stats> m_last_step;
+    float m_last_step_time{0.f};
+    bool m_evaluated{false};
+};
+
+} // namespace distributed
+
+#endif
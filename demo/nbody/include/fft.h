@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) https://github.com/kaapomoi 2023.
+ */
+
+#ifndef FFT_H
+#define FFT_H
+
+#include "parallel_for.h"
+
+#include <complex>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+///
+/// Radix-2 complex FFTs of cubes, small enough to carry with the demo instead of a dependency.
+///
+namespace fft {
+
+enum class Direction : std::size_t { forward = 0, inverse = 1 };
+
+///
+/// \brief Twiddle factors and bit reversal of one transform length, shared by every line of a
+/// cube.
+///
+class Plan {
+public:
+    /// \note n must be a power of two.
+    explicit Plan(std::size_t const n) noexcept;
+
+    std::size_t size() const noexcept;
+
+    ///
+    /// \brief Transforms one contiguous line of size() elements in place.
+    ///
+    /// \note The inverse is not scaled, a forward and inverse pair multiplies by size().
+    ///
+    void transform(std::span<std::complex<double>> const line,
+                   Direction const direction) const noexcept;
+
+private:
+    std::size_t m_size{0};
+    /// exp(-2 pi i k / n) for k < n / 2.
+    std::vector<std::complex<double>> m_twiddles;
+    std::vector<std::uint32_t> m_reversed;
+};
+
+///
+/// \brief 3D transform of a cube of plan.size()^3 elements, x fastest, one axis at a time with
+/// the lines of each axis split between the workers.
+///
+/// Only lines that can hold non-zero values or are read afterwards are transformed: forward, the
+/// input is taken to be zero outside of the corner cube of extent^3 elements, and inverse, only
+/// that corner of the output is kept. Pass extent = plan.size() for the whole cube.
+///
+/// \note The inverse is not scaled, see Plan::transform().
+///
+void transform(Plan const& plan,
+               std::span<std::complex<double>> const cube,
+               Direction const direction,
+               std::size_t const extent,
+               sal::Job_pool& pool) noexcept;
+
+} // namespace fft
+
+#endif
@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) https://github.com/kaapomoi 2023.
+ */
+
+#ifndef FORCE_KERNELS_H
+#define FORCE_KERNELS_H
+
+#include "particles.h"
+
+#include "glm/glm.hpp"
+
+#include <array>
+
+namespace kernels {
+
+constexpr double G{6.67e-11};
+constexpr float eps{100.f};
+
+///
+/// \brief Sources acting on one target, kept as a structure of arrays so that the kernels can
+/// load them straight into vector registers.
+///
+struct Interaction_list {
+    Aligned_vector<float> x;
+    Aligned_vector<float> y;
+    Aligned_vector<float> z;
+    Aligned_vector<float> mass;
+
+    std::size_t size() const noexcept { return x.size(); }
+
+    void clear() noexcept;
+
+    void reserve(std::size_t const n) noexcept;
+
+    void push(float const sx, float const sy, float const sz, float const m) noexcept;
+};
+
+///
+/// \brief Far-field cells with their quadrupole moments.
+///
+/// Each moment is the second mass moment about the cell's center of mass, M = sum(m * x * x^T),
+/// stored as xx, yy, zz, xy, xz, yz. It is kept whole rather than traceless because the softened
+/// force law is not harmonic, so the trace contributes to the force.
+///
+struct Quadrupole_list {
+    Aligned_vector<float> x;
+    Aligned_vector<float> y;
+    Aligned_vector<float> z;
+    Aligned_vector<float> mass;
+    Aligned_vector<float> xx;
+    Aligned_vector<float> yy;
+    Aligned_vector<float> zz;
+    Aligned_vector<float> xy;
+    Aligned_vector<float> xz;
+    Aligned_vector<float> yz;
+
+    std::size_t size() const noexcept { return x.size(); }
+
+    void clear() noexcept;
+
+    void reserve(std::size_t const n) noexcept;
+
+    void push(glm::vec3 const& center_of_mass,
+              float const m,
+              std::array<float, 6> const& q) noexcept;
+};
+
+///
+/// \brief Share of the pair force left to the short range of a TreePM split, sampled over the
+/// distance up to the cutoff. See Particle_mesh.
+///
+struct Split_table {
+    static constexpr std::size_t size{1024};
+
+    /// Samples per unit of distance, size / cutoff.
+    float scale{0.f};
+    /// Sample i is at distance i / scale, interpolated linearly in between.
+    std::array<float, size + 1> factor{};
+};
+
+enum class Isa : std::size_t { scalar = 0, avx2 = 1, avx512 = 2 };
+
+///
+/// \brief How a kernel sums the contributions of its list.
+///
+/// Every kernel is a template on this. Interactions are evaluated in float whatever the
+/// precision, only the per-body running sums differ.
+///
+enum class Precision : std::size_t {
+    /// Float sums, the full vector width for both the interactions and the sums.
+    single = 0,
+    /// Each term is widened and summed in double, two double vectors per float vector.
+    double_sum = 1,
+    /// Float sums with Kahan compensation, three more float operations per term.
+    compensated = 2
+};
+
+///
+/// \brief Acceleration of target caused by every source of the list.
+///
+/// a = -G * sum(m * d / (|d| * (|d|^2 + eps^2))), d = target - source.
+/// Sources at the target's position are skipped, which also covers the target itself.
+///
+typedef glm::vec3 (*Kernel)(glm::vec3 const& target, Interaction_list const& sources);
+
+///
+/// \brief Acceleration of target caused by the monopole and quadrupole terms of every cell.
+///
+/// Second order Taylor expansion of the softened law of Kernel about each center of mass:
+/// a = -G * (m * g * r + 1/2 * (g3 * (r . M * r) + g2 * tr(M)) * r + g2 * M * r), where
+/// r = target - center of mass, g = 1 / (|r| * (|r|^2 + eps^2)), g2 = g' / |r| and g3 = g2' / |r|.
+/// Only accepted cells are in the list, so r is never close to zero.
+///
+typedef glm::vec3 (*Quadrupole_kernel)(glm::vec3 const& target, Quadrupole_list const& sources);
+
+///
+/// \brief Kernel with every term scaled by the split's factor at its distance, sources at or past
+/// the cutoff are skipped.
+///
+typedef glm::vec3 (*Short_range_kernel)(glm::vec3 const& target,
+                                        Interaction_list const& sources,
+                                        Split_table const& split);
+
+/// Widest instruction set both this build and the CPU support.
+Isa detect() noexcept;
+
+Kernel select(Isa const isa, Precision const precision = Precision::single) noexcept;
+
+Quadrupole_kernel select_quadrupole(Isa const isa,
+                                    Precision const precision = Precision::single) noexcept;
+
+///
+/// \brief Kernel evaluated entirely in double, the yardstick the float kernels are measured
+/// against.
+///
+glm::dvec3 reference(glm::vec3 const& target, Interaction_list const& sources) noexcept;
+
+glm::dvec3 reference_quadrupole(glm::vec3 const& target, Quadrupole_list const& sources) noexcept;
+
+Short_range_kernel select_short_range(Isa const isa,
+                                      Precision const precision = Precision::single) noexcept;
+
+char const* str(Isa const isa) noexcept;
+char const* str(Precision const precision) noexcept;
+
+} // namespace kernels
+
+#endif
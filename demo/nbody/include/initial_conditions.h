@@ -0,0 +1,24 @@
+/*
+ * Copyright (c) https://github.com/kaapomoi 2023.
+ */
+
+#ifndef INITIAL_CONDITIONS_H
+#define INITIAL_CONDITIONS_H
+
+#include "particles.h"
+
+#include <random>
+
+namespace initial_conditions {
+
+///
+/// \brief Adds n bodies as ten spherical shells at random offsets from the origin, each body
+/// slowly circling the center of its own shell.
+///
+/// \note Everything is drawn from engine, so the same seed gives the same bodies.
+///
+void clusters(Particles& particles, std::size_t const n, std::mt19937& engine) noexcept;
+
+} // namespace initial_conditions
+
+#endif
@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) https://github.com/kaapomoi 2023.
+ */
+
+#ifndef LOD_H
+#define LOD_H
+
+#include "oct.h"
+
+#include <glm/glm.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+///
+/// Level of detail for drawing the bodies, picked from the octree.
+///
+/// The tree is walked from the root against the camera. A cell that covers fewer pixels than the
+/// threshold is drawn as one billboard at its center of mass instead of its bodies, and only the
+/// leaves close enough to be opened have their bodies drawn one by one. The number of things drawn
+/// depends on the screen and the distance to the bodies, not on how many there are.
+///
+/// Selections are made from a Scene, a copy of the tree, so the simulation can go on rebuilding
+/// the tree on its own thread while a scene is drawn.
+///
+namespace lod {
+
+/// Projected size in pixels below which a cell is drawn as an impostor.
+constexpr float default_pixel_threshold{16.f};
+
+/// Width a single body is drawn at.
+constexpr float default_body_size{0.5f};
+
+struct View {
+    glm::vec3 position{0.f};
+    /// Unit vector the camera looks along.
+    glm::vec3 front{0.f, 0.f, -1.f};
+    /// Pixels covered by one unit of width at a distance of one unit, see focal_length().
+    float focal_length{1.f};
+    float pixel_threshold{default_pixel_threshold};
+    /// Width a single body is drawn at, no cell is drawn smaller.
+    float body_size{default_body_size};
+};
+
+///
+/// \brief A body as the renderer uploads it, 16 bytes.
+///
+struct Sprite {
+    glm::vec3 position{0.f};
+    /// RGBA8 with red in the lowest byte, the alpha grows with the mass of the body.
+    std::uint32_t color{0};
+};
+static_assert(sizeof(Sprite) == 16);
+
+///
+/// \brief What select() reads of the tree.
+///
+struct Scene {
+    /// Walk cells in depth-first order, see Oct::walk_cells().
+    std::vector<Oct::Walk_cell> cells;
+    /// Every body in the tree order.
+    std::vector<Sprite> bodies;
+    glm::vec3 center_of_mass{0.f};
+
+    /// Copies the tree into the scene, the vectors keep their capacity between captures.
+    void capture(Oct const& tree) noexcept;
+};
+
+///
+/// \brief Billboard standing in for every body of a cell.
+///
+struct Impostor {
+    /// Center of mass and radius of the billboard.
+    glm::vec4 center_radius{0.f};
+    /// Brightness grows with the mass of the cell.
+    glm::vec4 color{0.f};
+};
+
+///
+/// \brief What to draw this frame. The vectors keep their capacity between frames.
+///
+struct Selection {
+    std::vector<Impostor> impostors;
+    /// Bodies drawn one by one.
+    std::vector<Sprite> bodies;
+    /// Cells left out for being behind the camera.
+    std::size_t culled_cells{0};
+
+    void clear() noexcept;
+};
+
+///
+/// \brief Pixels per unit of width at unit distance for a perspective projection.
+///
+/// \note fov_y is the vertical field of view in radians.
+///
+float focal_length(float const fov_y, float const viewport_height) noexcept;
+
+///
+/// \brief Walks the scene's tree once and fills the selection for the view.
+///
+/// \note The selection is cleared first.
+///
+void select(Scene const& scene, View const& view, Selection& selection) noexcept;
+
+} // namespace lod
+
+#endif
@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) https://github.com/kaapomoi 2023.
+ */
+
+#ifndef LOD_RENDERER_H
+#define LOD_RENDERER_H
+
+#include "lod.h"
+#include "shader_program.h"
+
+#include <cstdint>
+#include <vector>
+
+///
+/// \brief Draws a lod::Selection: impostors and the expanded bodies both as camera-facing
+/// billboards.
+///
+/// Bodies are uploaded as the selection holds them, a lod::Sprite of 16 bytes each, and their
+/// billboards are expanded from gl_VertexID, so all of them are one instanced draw of a
+/// four-vertex strip with no per-vertex matrix work.
+///
+/// The instance buffers are created once and refilled every frame, their size follows the
+/// selection instead of the body count.
+///
+class Lod_renderer {
+public:
+    /// Creates the buffers, needs a current GL context.
+    void init() noexcept;
+
+    /// Deletes the buffers, call before the context goes away.
+    void destroy() noexcept;
+
+    ///
+    /// \brief Uploads and draws the selection.
+    ///
+    /// \note body_shader takes a position and a normalized RGBA8 color per instance at attributes
+    /// 0 and 1 and the billboard radius as the uniform radius, like particle_vert.glsl.
+    /// impostor_shader takes a center and radius and a color at 0 and 1.
+    ///
+    void draw(lod::Selection const& selection,
+              sal::Shader_program& body_shader,
+              sal::Shader_program const& impostor_shader) noexcept;
+
+private:
+    static constexpr float body_radius{lod::default_body_size / 2.f};
+
+    void draw_bodies(std::vector<lod::Sprite> const& bodies, sal::Shader_program& shader) noexcept;
+    void draw_impostors(std::vector<lod::Impostor> const& impostors,
+                        sal::Shader_program const& shader) noexcept;
+
+    std::uint32_t m_body_vao{0};
+    std::uint32_t m_body_vbo{0};
+    std::uint32_t m_impostor_vao{0};
+    std::uint32_t m_impostor_vbo{0};
+};
+
+#endif
@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) https://github.com/kaapomoi 2023.
+ */
+
+#ifndef MORTON_H
+#define MORTON_H
+
+#include "parallel_for.h"
+
+#include "glm/glm.hpp"
+
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+namespace morton {
+
+/// 21 bits per axis fill 63 bits of the key, which also caps the octree depth.
+constexpr std::uint32_t bits_per_axis{21};
+
+/// Sorts after every valid key, used for bodies that are outside of the keyed box.
+constexpr std::uint64_t invalid_key{std::numeric_limits<std::uint64_t>::max()};
+
+struct Entry {
+    std::uint64_t key;
+    std::uint32_t index;
+};
+
+/// Spreads the low 21 bits of v so that there are two zero bits between each of them.
+inline std::uint64_t spread_bits(std::uint64_t v) noexcept
+{
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffff;
+    v = (v | v << 16) & 0x1f0000ff0000ff;
+    v = (v | v << 8) & 0x100f00f00f00f00f;
+    v = (v | v << 4) & 0x10c30c30c30c30c3;
+    v = (v | v << 2) & 0x1249249249249249;
+    return v;
+}
+
+///
+/// \brief Key of a point inside the box [min, min + size].
+///
+/// Each 3 bit digit of the key is the octant index used by Oct (z: 4, x: 2, y: 1), most significant
+/// digit first, so a prefix of the key names the cell that contains the point at that depth.
+///
+inline std::uint64_t key(glm::vec3 const& point, glm::vec3 const& min, glm::vec3 const& size) noexcept
+{
+    static constexpr float cells_per_axis{static_cast<float>(1u << bits_per_axis)};
+    static constexpr std::uint32_t max_coordinate{(1u << bits_per_axis) - 1};
+
+    /// Written as the negation of the inside test so that NaN, which compares false to
+    /// everything, is outside too.
+    glm::vec3 const normalized{(point - min) / size};
+    if (!(normalized.x >= 0.f && normalized.x <= 1.f)
+        || !(normalized.y >= 0.f && normalized.y <= 1.f)
+        || !(normalized.z >= 0.f && normalized.z <= 1.f)) {
+        return invalid_key;
+    }
+
+    std::uint64_t const x{std::min(static_cast<std::uint32_t>(normalized.x * cells_per_axis),
+                                   max_coordinate)};
+    std::uint64_t const y{std::min(static_cast<std::uint32_t>(normalized.y * cells_per_axis),
+                                   max_coordinate)};
+    std::uint64_t const z{std::min(static_cast<std::uint32_t>(normalized.z * cells_per_axis),
+                                   max_coordinate)};
+
+    return (spread_bits(z) << 2) | (spread_bits(x) << 1) | spread_bits(y);
+}
+
+/// Octant digit of the key at the given depth, depth 0 being the children of the root.
+inline std::uint32_t digit(std::uint64_t const key, std::uint32_t const depth) noexcept
+{
+    return static_cast<std::uint32_t>(key >> (3 * (bits_per_axis - 1 - depth))) & 0x7u;
+}
+
+///
+/// \brief Stable LSD radix sort on the keys, 8 bits per pass.
+///
+/// Every pass histograms and scatters per chunk on the pool. Passes where all keys share the
+/// same digit are skipped. scratch is resized to match entries, keep it around between calls.
+///
+void radix_sort(sal::Job_pool& pool, std::vector<Entry>& entries, std::vector<Entry>& scratch) noexcept;
+
+} // namespace morton
+
+#endif
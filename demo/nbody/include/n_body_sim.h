@@ -7,14 +7,27 @@
 
 #include "application.h"
 #include "camera_controller.h"
-#include "oct.h"
-#include "primitives.h"
+#include "initial_conditions.h"
+#include "lod.h"
+#include "lod_renderer.h"
+#include "simulation.h"
+#include "snapshot.h"
 #include "text.h"
+#include "triple_buffer.h"
+#include "ts_queue.h"
 
 #include <chrono>
+#include <functional>
 #include <random>
+#include <stop_token>
+#include <thread>
 
-
+///
+/// The simulation runs on a thread of its own and publishes a lod::Scene after every step. The
+/// render loop draws the latest published scene, so a slow step never holds up input or
+/// rendering. Everything that touches m_simulation runs on the simulation thread, input from the
+/// render thread reaches it through post().
+///
 class N_body_sim : public sal::Application {
 public:
     sal::Application::Exit_code start() noexcept;
@@ -29,22 +42,57 @@ private:
 
     void set_render_model_uniforms(sal::Shader_program& shader) noexcept final;
     void set_user_uniforms_before_render() noexcept final;
+    void render_user() noexcept final;
 
     void handle_input() noexcept;
 
+    /// Steps the simulation until stopped, runs on m_sim_thread.
+    void run_simulation(std::stop_token const stop) noexcept;
+
+    /// Queues a command to run on the simulation thread before its next step.
+    void post(std::function<void()> command) noexcept;
+
     void create_nodes(std::size_t const n) noexcept;
+    void restart() noexcept;
     void update_nodes() noexcept;
+    void log_step() const noexcept;
+
+    void save_snapshot() noexcept;
+    void load_snapshot() noexcept;
+    void toggle_recording() noexcept;
+    void toggle_replay() noexcept;
 
     Camera_controller m_camera_controller{};
     std::vector<sal::Shader_program> m_shaders;
-    std::vector<sal::Model> m_models;
     std::vector<sal::Font> m_fonts;
     std::vector<sal::Text> m_texts;
+
+    /// Draws distant cells as impostors, off draws every body.
+    bool m_lod{true};
+    lod::Selection m_lod_selection;
+    Lod_renderer m_lod_renderer;
+
+    /// Written by the simulation thread, the render thread draws the front scene.
+    sal::Triple_buffer<lod::Scene> m_scenes;
+    sal::Ts_queue<std::function<void()>> m_commands;
+
+    /// Simulation thread only from here on.
     std::mt19937 m_rand_engine;
     float m_sim_timescale{10.f};
-    bool m_should_restart_sim{false};
+    /// Steps per second, 0 runs the simulation as fast as it goes.
+    float m_max_step_rate{0.f};
+    std::uint64_t m_step_count{0};
+    double m_sim_time{0.0};
+
+    snapshot::Writer m_snapshot_writer;
+    snapshot::Writer m_recorder;
+    snapshot::Reader m_replay;
+    std::size_t m_replay_frame{0};
+
+    Simulation m_simulation{std::thread::hardware_concurrency()};
 
-    std::unique_ptr<Oct> m_root{nullptr};
+    /// Last member, so it is joined before anything it uses is destroyed.
+    std::jthread m_sim_thread;
 };
 
 #endif
@@ -5,53 +5,541 @@
 #ifndef OCT_H
 #define OCT_H
 
-#include "node.h"
+#include "force_kernels.h"
+#include "morton.h"
+#include "particles.h"
 
 #include <array>
-#include <memory>
+#include <cstdint>
+#include <limits>
+#include <span>
+#include <vector>
 
+///
+/// \brief Barnes-Hut octree stored as one flat array of cells.
+///
+/// The cell array is kept between frames, build() only clears it so the capacity is reused and
+/// building the tree does not touch the heap once it has grown to its working size.
+/// Children are addressed by their index into the cell array. Bodies live in the leaves, the
+/// bodies of every cell form one contiguous range of the tree order. The tree keeps its own copy
+/// of the positions and masses in that order, so walks stream through contiguous memory.
+///
+/// Cells are laid out in depth-first order. The next cell of a walk that opens a cell is the one
+/// right after it, and every cell stores where its subtree ends, which is where a walk that
+/// accepts the cell or finishes a leaf continues. Walks are one loop over the array without
+/// recursion or looking at the children.
+///
 class Oct {
 public:
-    Oct(glm::vec3 const front_top_left, glm::vec3 const back_bot_right) noexcept;
+    using Cell_index = std::uint32_t;
 
-    void update_force(std::shared_ptr<Node> const& node) noexcept;
+    enum class Build_mode : std::size_t {
+        /// Inserts the bodies one at a time from the root.
+        insertion = 0,
+        /// Sorts the bodies by Morton key and splits the sorted range top-down.
+        morton = 1
+    };
 
-    void insert(std::shared_ptr<Node> const& node) noexcept;
+    enum class Multipole_order : std::size_t {
+        /// Accepted cells act as a point mass at their center of mass.
+        monopole = 0,
+        /// Accepted cells also carry their quadrupole moment, which keeps the error of a wider
+        /// opening angle down.
+        quadrupole = 2
+    };
 
-    glm::vec3 const& center_of_mass() noexcept;
+    /// Axis aligned box, empty while min > max on any axis.
+    struct Box {
+        glm::vec3 min{0.f};
+        glm::vec3 max{0.f};
+    };
+
+    ///
+    /// \brief Bodies that share one interaction list in group walks.
+    ///
+    /// A group is the largest cell holding at most group_size() bodies, so its bodies are
+    /// contiguous in the tree order and close to each other.
+    ///
+    struct Group {
+        std::uint32_t first_body{0};
+        std::uint32_t body_count{0};
+        glm::vec3 min{0.f};
+        glm::vec3 max{0.f};
+    };
+
+    ///
+    /// \brief What a walk reads of a cell, packed into 32 bytes.
+    ///
+    /// Bodies of a cell are positions first_body to first_body + body_count of the tree order.
+    /// A cell is a leaf when its subtree is only itself, skip == index + 1.
+    ///
+    struct Walk_cell {
+        glm::vec3 center_of_mass{0.f};
+        float mass{0.f};
+        float width{0.f};
+        std::uint32_t first_body{0};
+        std::uint32_t body_count{0};
+        Cell_index skip{0};
+    };
+
+    /// Body found by a neighbour query.
+    struct Neighbour {
+        /// Index into the particle store.
+        std::uint32_t index{0};
+        float distance_squared{0.f};
+    };
+
+    static constexpr std::uint32_t default_group_size{32};
+
+    /// Bodies a leaf holds before it is split. Larger leaves make a shallower tree with fewer
+    /// cells, at the cost of more direct interactions when one is opened.
+    static constexpr std::uint32_t default_leaf_size{8};
+
+    /// A cell is accepted when width / distance < opening angle.
+    static constexpr float default_opening_angle{0.5f};
+
+    /// The root cube is widened by this share of its width, so that rounding never leaves the
+    /// outermost bodies just outside of it.
+    static constexpr float root_padding{1e-3f};
+
+    /// Keeps the root of a lone body, or of bodies on top of each other, from having no size.
+    static constexpr float min_root_width{2.f * kernels::eps};
+
+    /// Share of the bodies that may drift well outside of their leaf before refit() asks for a
+    /// rebuild.
+    static constexpr float default_max_escaped_fraction{0.05f};
+
+    struct Stats {
+        /// Width of the root cell, which a refit may have grown past the box it was built over.
+        float root_width{0.f};
+        std::size_t cell_count{0};
+        std::size_t leaf_count{0};
+        std::uint32_t max_depth{0};
+        float mean_leaf_depth{0.f};
+        std::uint32_t max_leaf_size{0};
+        float mean_leaf_size{0.f};
+    };
+
+    /// The root is always the first cell, so no cell can point to it as a child.
+    static constexpr Cell_index no_cell{0};
+
+    /// Leaves at this depth hold every body that ends up in them instead of subdividing.
+    static constexpr std::uint32_t max_depth{morton::bits_per_axis};
+
+    ///
+    /// \brief Rebuilds the tree over the given bodies with a root spanning the given box.
+    ///
+    /// \note Bodies outside of the box are left out of the tree.
+    ///
+    void build(glm::vec3 const front_top_left,
+               glm::vec3 const back_bot_right,
+               Particles const& particles,
+               Build_mode const mode,
+               sal::Job_pool& pool) noexcept;
+
+    ///
+    /// \brief Cube to build a root over for the bodies within bounds, padded by root_padding and
+    /// at least min_root_width wide.
+    ///
+    /// \note Empty bounds give a cube of min_root_width about the origin.
+    ///
+    static Box root_cube(Box const& bounds) noexcept;
+
+    ///
+    /// \brief Updates the tree for moved bodies without changing its structure.
+    ///
+    /// Bodies stay in the leaves they were built into. Positions, masses, centers of mass and
+    /// bounding boxes are refreshed bottom-up, and a cell whose bodies have spread past its box is
+    /// widened to cover them, so walks stay as accurate as after a build.
+    ///
+    /// \return false when the tree must be built instead: the body count or leaf size changed
+    /// since the last build, or too many bodies have left their leaves for the tree to stay
+    /// efficient. The tree is usable either way.
+    ///
+    bool refit(Particles const& particles, sal::Job_pool& pool) noexcept;
+
+    float max_escaped_fraction() const noexcept;
+    void set_max_escaped_fraction(float const fraction) noexcept;
+
+    ///
+    /// \brief Collects every source the body at the given position in the tree order interacts
+    /// with: the bodies of the leaves it opens and the centers of mass of the cells it accepts.
+    ///
+    /// With quadrupole moments the accepted cells go to far instead of list.
+    ///
+    /// \note The lists are cleared first. The body itself is never added.
+    ///
+    void interactions(std::uint32_t const body,
+                      kernels::Interaction_list& list,
+                      kernels::Quadrupole_list& far) const noexcept;
+
+    ///
+    /// \brief Collects the sources acting on every body of the group, using the group's bounding
+    /// box instead of a single position to decide which cells to open.
+    ///
+    /// \note The group's own bodies are in the list, the kernels skip the zero distance pair.
+    ///
+    void interactions(Group const& group,
+                      kernels::Interaction_list& list,
+                      kernels::Quadrupole_list& far) const noexcept;
+
+    ///
+    /// \brief Short-range counterpart of the group walk for a TreePM split, see Particle_mesh.
+    ///
+    /// Cells whose bodies are all further than cutoff from the group's box are left out. Accepted
+    /// cells go to the list as monopoles whatever the multipole order.
+    ///
+    /// \note The list is cleared first.
+    ///
+    void interactions(Group const& group,
+                      float const cutoff,
+                      kernels::Interaction_list& list) const noexcept;
+
+    std::span<Group const> groups() const noexcept;
+
+    ///
+    /// \brief The group walk over any cells laid out like walk_cells(), for trees stitched
+    /// together outside of an Oct.
+    ///
+    /// radii[index] bounds how far the bodies of a cell are from its center of mass, see
+    /// radii(). accept(index) is called for every cell the group takes as a whole and
+    /// open_leaf(index) for every leaf whose bodies it needs.
+    ///
+    template<class Accept, class Open_leaf>
+    static void walk_group(std::span<Walk_cell const> const cells,
+                           std::span<float const> const radii,
+                           Group const& group,
+                           float const opening_angle,
+                           Accept const& accept,
+                           Open_leaf const& open_leaf) noexcept;
+
+    ///
+    /// \brief Accelerations of the active bodies from a dual-tree traversal, the fast multipole
+    /// counterpart of the group walk.
+    ///
+    /// A pair of cells with radius_a + radius_b < opening angle * distance interacts once, through
+    /// a first order expansion of the source's field about the target's center of mass, and the
+    /// expansion is passed down the target's subtree. Otherwise the larger cell is split. Targets
+    /// stop splitting at the cells a group walk would use, where the bodies of the source leaves
+    /// still too close to expand are summed directly with kernel. Most of the far field is taken
+    /// in at the top of the tree, so the cost grows about linearly with the body count.
+    ///
+    /// \note Cells act through their monopoles whatever the multipole order.
+    /// \note active and the accelerations are indexed by particle, inactive bodies are left as
+    /// they are.
+    /// \return Number of interactions evaluated, cell pairs count as one
+    ///
+    std::uint64_t dual_tree(sal::Job_pool& pool,
+                            kernels::Kernel const kernel,
+                            std::span<std::uint8_t const> const active,
+                            Particles& particles) noexcept;
+
+    ///
+    /// \brief Appends the particle index of every body within radius of the point to out.
+    ///
+    /// Cells further than radius are skipped and cells entirely inside of it are taken whole, so
+    /// only the bodies of the leaves crossing the sphere are tested one by one.
+    ///
+    /// \note A body at the point itself is found as well. Bodies the tree left out are never found.
+    ///
+    void within_radius(glm::vec3 const& point,
+                       float const radius,
+                       std::vector<std::uint32_t>& out) const noexcept;
+
+    ///
+    /// \brief The k bodies nearest to the point, nearest first.
+    ///
+    /// Cells are visited nearest first and skipped once they can't hold a body closer than the
+    /// k-th one found so far.
+    ///
+    /// \note out is cleared first, it holds fewer than k bodies only if the tree does.
+    ///
+    void nearest(glm::vec3 const& point,
+                 std::uint32_t const k,
+                 std::vector<Neighbour>& out) const noexcept;
+
+    /// within_radius() for every point, run in parallel. out[i] holds the bodies near points[i].
+    void within_radius(sal::Job_pool& pool,
+                       std::span<glm::vec3 const> const points,
+                       float const radius,
+                       std::vector<std::vector<std::uint32_t>>& out) const noexcept;
+
+    /// nearest() for every point, run in parallel. out[i] holds the bodies nearest to points[i].
+    void nearest(sal::Job_pool& pool,
+                 std::span<glm::vec3 const> const points,
+                 std::uint32_t const k,
+                 std::vector<std::vector<Neighbour>>& out) const noexcept;
+
+    std::uint32_t group_size() const noexcept;
+    void set_group_size(std::uint32_t const size) noexcept;
+
+    std::uint32_t leaf_size() const noexcept;
+    /// Takes effect when the tree is next built, refit() asks for that.
+    void set_leaf_size(std::uint32_t const size) noexcept;
+
+    Multipole_order multipole_order() const noexcept;
+    /// Takes effect when the tree is next built or refitted.
+    void set_multipole_order(Multipole_order const order) noexcept;
+
+    float opening_angle() const noexcept;
+    void set_opening_angle(float const angle) noexcept;
+
+    /// Position of the body at the given position in the tree order.
+    glm::vec3 position(std::uint32_t const body) const noexcept;
+
+    /// Mass of the body at the given position in the tree order.
+    float mass(std::uint32_t const body) const noexcept;
+
+    glm::vec3 const& center_of_mass() const noexcept;
+
+    /// Particle index of every body in the tree, in depth-first cell order, which keeps spatial
+    /// neighbours together.
+    std::span<std::uint32_t const> order() const noexcept;
+
+    std::size_t cell_count() const noexcept;
+
+    ///
+    /// \brief Every cell in depth-first order, for walks outside of the tree like picking the
+    /// cells to draw.
+    ///
+    /// \note The root is the first cell, the span is empty before the first build.
+    ///
+    std::span<Walk_cell const> walk_cells() const noexcept;
+
+    /// Distance from the center of mass of every walk cell to its furthest body.
+    std::span<float const> radii() const noexcept;
+
+    /// Shape of the current tree, walks the cell array once.
+    Stats stats() const noexcept;
+
+    static char const* str(Build_mode const mode) noexcept;
+    static char const* str(Multipole_order const order) noexcept;
 
 private:
-    bool is_external() const noexcept;
+    static constexpr std::uint32_t no_body{std::numeric_limits<std::uint32_t>::max()};
+
+    struct Cell {
+        glm::vec3 front_top_left{0.0f};
+        glm::vec3 back_bottom_right{0.0f};
+        float width{0.f};
+        double total_mass{0.f};
+        glm::vec3 center_of_mass{0.f};
+
+        /// Second mass moment about the center of mass, xx, yy, zz, xy, xz, yz.
+        std::array<double, 6> quadrupole{};
+
+        /// Distance from the center of mass to the furthest body.
+        float radius{0.f};
+
+        /// Range of this cell in the tree order. While inserting, first_body of a leaf is instead
+        /// the head of its body list in m_next_body.
+        std::uint32_t first_body{no_body};
+        std::uint32_t body_count{0};
+        std::uint32_t depth{0};
+        std::uint32_t child_count{0};
+
+        /// One past the last cell of this cell's subtree.
+        Cell_index skip{0};
+
+        /*
+        Children of this cell:
+             frontTopLeftTree;
+             frontBotLeftTree;
+
+             frontTopRightTree;
+             frontBotRightTree;
+
+             backTopLeftTree;
+             backBotLeftTree;
+
+             backTopRightTree;
+             backBotRightTree;
+         */
+        std::array<Cell_index, 8> children{};
+
+        /// Bounding box of the bodies in this cell, only kept up to date by refit().
+        glm::vec3 bounds_min{0.f};
+        glm::vec3 bounds_max{0.f};
+
+        bool is_external() const noexcept;
+
+        bool in_boundary(glm::vec3 const& point) const noexcept;
+
+        std::size_t octant(glm::vec3 const& point) const noexcept;
+    };
+
+    /// First order expansion of the far field about a target cell's center of mass.
+    struct Local {
+        glm::dvec3 acceleration{0.0};
+        /// d acceleration / d position, xx, yy, zz, xy, xz, yz.
+        std::array<double, 6> gradient{};
+    };
+
+    /// What a worker of dual_tree() reuses between targets.
+    struct Dual_tree_scratch {
+        /// Sources left for the children of the target at each level below the task's root.
+        std::array<std::vector<Cell_index>, max_depth + 2> sources;
+        std::vector<Cell_index> work;
+        kernels::Interaction_list near;
+    };
+
+    void reset(glm::vec3 const front_top_left, glm::vec3 const back_bot_right) noexcept;
 
-    bool in_boundary(glm::vec3 const& point) const noexcept;
+    Cell_index create_cell(glm::vec3 const front_top_left,
+                           glm::vec3 const back_bot_right) noexcept;
 
+    Cell_index create_child(Cell_index const parent, std::size_t const octant) noexcept;
+    static Cell_index create_child(std::vector<Cell>& cells,
+                                   Cell_index const parent,
+                                   std::size_t const octant) noexcept;
 
-    /// Variables
-    glm::vec3 m_front_top_left{0.0f};
-    glm::vec3 m_back_bottom_right{0.0f};
-    float m_width{0.f};
-    float m_height{0.f};
-    float m_depth{0.f};
-    double m_total_mass{0.f};
-    glm::vec3 m_center_of_mass{0.f};
+    /// Insertion build
+    void insert(Particles const& particles, std::uint32_t const body) noexcept;
+    void gather_bodies(Cell_index const index) noexcept;
 
-    std::shared_ptr<Node> m_node;
+    /// Reorders the cells depth-first, insertion creates them in the order bodies arrive.
+    void sort_depth_first() noexcept;
+    Cell_index copy_depth_first(Cell_index const index) noexcept;
 
-    /*
-    Children of this tree:
-         frontTopLeftTree;
-         frontBotLeftTree;
+    /// Morton build
+    void sort_by_key(Particles const& particles, sal::Job_pool& pool) noexcept;
 
-         frontTopRightTree;
-         frontBotRightTree;
+    ///
+    /// \brief Splits the sorted range of cells[index] down to the leaves.
+    ///
+    /// Cells other than index with at most subtree_size bodies are left unsplit with
+    /// skip == no_cell, build_subtrees() finishes them. 0 splits everything.
+    ///
+    void split_sorted(std::vector<Cell>& cells,
+                      Cell_index const index,
+                      std::uint32_t const subtree_size) const noexcept;
 
-         backTopLeftTree;
-         backBotLeftTree;
+    /// Splits the top of the tree on the calling thread, builds the subtrees below it in parallel
+    /// each in an arena of its own and stitches them together in depth-first order.
+    void build_subtrees(sal::Job_pool& pool) noexcept;
 
-         backTopRightTree;
-         backBotRightTree;
-     */
-    std::array<std::shared_ptr<Oct>, 8> m_children;
+    /// Copies the top cell and its children depth-first into m_cell_scratch, leaving room for
+    /// the subtrees, and records where each one goes.
+    Cell_index stitch_top(Cell_index const index, std::size_t& subtree) noexcept;
+
+    /// Copies positions and masses into tree order.
+    void gather_particles(Particles const& particles, sal::Job_pool& pool) noexcept;
+
+    void sort_cells_by_depth() noexcept;
+
+    /// Runs fn(cell) for every cell, one tree level at a time from the deepest up.
+    template<class Fn>
+    void for_each_level_up(sal::Job_pool& pool, Fn const& fn) noexcept;
+
+    /// Mass, center of mass and radius of every cell.
+    void compute_moments(sal::Job_pool& pool) noexcept;
+
+    /// Bounding boxes and widths of the cells after their bodies moved.
+    /// \return Number of bodies that drifted well outside of their leaf's box
+    std::uint64_t refit_bounds(sal::Job_pool& pool) noexcept;
+
+    void fill_walk_cells(sal::Job_pool& pool) noexcept;
+
+    /// Adds the accepted cell to far or list depending on the multipole order.
+    void push_far(Cell_index const index,
+                  kernels::Interaction_list& list,
+                  kernels::Quadrupole_list& far) const noexcept;
+
+    ///
+    /// \brief Resolves every source against the target, then descends into its children with
+    /// the sources that are still too close.
+    ///
+    /// \return Number of interactions evaluated in the target's subtree
+    ///
+    std::uint64_t descend_dual_tree(Cell_index const target,
+                                    Local const& local,
+                                    std::span<Cell_index const> const sources,
+                                    std::size_t const level,
+                                    kernels::Kernel const kernel,
+                                    std::span<std::uint8_t const> const active,
+                                    Particles& particles,
+                                    Dual_tree_scratch& scratch) const noexcept;
+
+    /// Active bodies of the cell, from m_active_prefix.
+    std::uint32_t active_count(Cell_index const index) const noexcept;
+
+    void collect_groups() noexcept;
+    void compute_group_bounds(sal::Job_pool& pool) noexcept;
+
+    std::vector<Cell> m_cells;
+    std::vector<Walk_cell> m_walk_cells;
+    /// Quadrupole of every walk cell, empty with monopoles only.
+    std::vector<std::array<float, 6>> m_quadrupoles;
+    /// Radius of every walk cell.
+    std::vector<float> m_radii;
+    std::vector<Group> m_groups;
+    std::uint32_t m_group_size{default_group_size};
+    std::uint32_t m_leaf_size{default_leaf_size};
+    float m_max_escaped_fraction{default_max_escaped_fraction};
+    Multipole_order m_multipole_order{Multipole_order::monopole};
+    float m_opening_angle{default_opening_angle};
+
+    /// Size of the particle set and leaf size the tree was built with.
+    std::size_t m_particle_count{0};
+    std::uint32_t m_built_leaf_size{0};
+
+    /// Particle index, position and mass of every body in tree order.
+    std::vector<std::uint32_t> m_order;
+    Aligned_vector<float> m_x;
+    Aligned_vector<float> m_y;
+    Aligned_vector<float> m_z;
+    Aligned_vector<float> m_mass;
+
+    /// Scratch kept between builds.
+    std::vector<std::uint32_t> m_next_body;
+    std::vector<Cell> m_cell_scratch;
+    std::vector<morton::Entry> m_keys;
+    std::vector<morton::Entry> m_key_scratch;
+    std::vector<Cell_index> m_cells_by_depth;
+    std::vector<Cell_index> m_subtree_roots;
+    std::vector<std::size_t> m_subtree_offsets;
+    std::vector<std::vector<Cell>> m_arenas;
+    /// Active bodies before each position of the tree order, and the roots of the subtrees the
+    /// dual-tree traversal hands to the workers.
+    std::vector<std::uint32_t> m_active_prefix;
+    std::vector<Cell_index> m_dual_tree_tasks;
+    std::array<std::size_t, max_depth + 2> m_depth_offsets{};
 };
 
+template<class Accept, class Open_leaf>
+void Oct::walk_group(std::span<Walk_cell const> const cells,
+                     std::span<float const> const radii,
+                     Group const& group,
+                     float const opening_angle,
+                     Accept const& accept,
+                     Open_leaf const& open_leaf) noexcept
+{
+    Cell_index const end{static_cast<Cell_index>(cells.size())};
+    Cell_index index{0};
+
+    while (index < end) {
+        Walk_cell const& cell{cells[index]};
+        bool const leaf{cell.skip == index + 1};
+
+        /// Closest any body of the group can get to the center of mass. Within the radius the
+        /// cell may hold bodies of the group, which always opens it, so a group never accepts a
+        /// cell of its own at any angle.
+        glm::vec3 const closest{glm::min(glm::max(cell.center_of_mass, group.min), group.max)};
+        float const dist{glm::distance(closest, cell.center_of_mass)};
+
+        if ((!leaf || cell.body_count > 1) && (dist > radii[index])
+            && (cell.width / dist < opening_angle)) {
+            accept(index);
+            index = cell.skip;
+        }
+        else if (leaf) {
+            open_leaf(index);
+            index = cell.skip;
+        }
+        else {
+            index++;
+        }
+    }
+}
+
 #endif
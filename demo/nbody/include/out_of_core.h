@@ -0,0 +1,203 @@
+/*
+ * Copyright (c) https://github.com/kaapomoi 2023.
+ */
+
+#ifndef OUT_OF_CORE_H
+#define OUT_OF_CORE_H
+
+#include "force_kernels.h"
+#include "mapped_file.h"
+#include "oct.h"
+#include "parallel_for.h"
+#include "particles.h"
+
+#include <glm/glm.hpp>
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+///
+/// \brief Barnes-Hut stepping of more bodies than fit in memory, kept in memory-mapped files.
+///
+/// Bodies are stored in blocks of block_size() bodies with one array per quantity, so every
+/// block is one contiguous range of the file. After every drift the blocks are sorted by Morton
+/// key: bodies are bucketed by the leading digits of their key over the bounds of all bodies and
+/// scattered into a second file, then every block is sorted on its own by building an Oct over
+/// it.
+///
+/// Only the upper levels of the tree are resident. Of every block's Oct the cells down to
+/// resident_leaf_size bodies are kept, and a binary tree over the blocks joins them into one
+/// walk. The force pass runs over the blocks in order: the target block is built again in memory,
+/// its groups walk the resident cells and read the bodies of the resident leaves they open from
+/// the file. Key order keeps those mostly within the neighbouring blocks, and the next block is
+/// advised to the OS as needed while the current one is evaluated, so reading it overlaps the
+/// walks.
+///
+/// Mapped pages belong to the page cache. When the bodies don't fit in memory the OS writes back
+/// and drops pages instead of killing the process, and the steps only get slower.
+///
+/// Every body steps with the same dt in kick-drift-kick leapfrog, accepted cells are monopoles at
+/// Oct::default_opening_angle.
+///
+/// \note The walks address bodies with 32 bits, which caps the body count at about 4 billion.
+///
+class Out_of_core {
+public:
+    static constexpr std::size_t default_block_size{std::size_t{1} << 16};
+
+    /// Block sizes are a multiple of this, which keeps every array of a block on its own pages.
+    static constexpr std::size_t block_alignment{1024};
+
+    /// Cells of at most this many bodies are the leaves of the resident tree. Smaller keeps more
+    /// of the tree in memory, larger reads more bodies from the file for every opened leaf.
+    static constexpr std::uint32_t resident_leaf_size{32};
+
+    /// Where the last step() spent its time.
+    struct Step_stats {
+        float sort_time{0.f};
+        float tree_time{0.f};
+        float force_time{0.f};
+        float integrate_time{0.f};
+        /// Bodies the sort moved to another block, zero when every block held its own bodies.
+        std::uint64_t scattered{0};
+        std::uint64_t interactions{0};
+    };
+
+    explicit Out_of_core(std::size_t const thread_count) noexcept;
+    ~Out_of_core() noexcept;
+
+    Out_of_core(Out_of_core const&) = delete;
+    Out_of_core& operator=(Out_of_core const&) = delete;
+
+    ///
+    /// \brief Creates the files for the given number of bodies, file and file + ".scatter".
+    ///
+    /// Every body starts at rest at the origin with no mass, write() puts the real ones in.
+    ///
+    /// \note block_size is rounded up to a multiple of block_alignment.
+    ///
+    bool create(std::string const& file,
+                std::size_t const body_count,
+                std::size_t const block_size = default_block_size) noexcept;
+
+    /// Unmaps and deletes both files.
+    void close() noexcept;
+
+    bool is_open() const noexcept;
+
+    std::size_t size() const noexcept;
+    std::size_t block_size() const noexcept;
+
+    ///
+    /// \brief Copies the bodies to positions first to first + bodies.size() of the store.
+    ///
+    /// \note Bodies past size() are left out. The order of the store changes with every step.
+    ///
+    void write(std::size_t const first, Particles const& bodies) noexcept;
+
+    /// Replaces out with count bodies of the store from first on, accelerations included.
+    void read(std::size_t const first, std::size_t const count, Particles& out) const noexcept;
+
+    /// Advances every body by dt, the first step also evaluates the starting accelerations.
+    void step(float const dt) noexcept;
+
+    Step_stats const& last_step() const noexcept;
+
+    /// Cells of the resident tree, the only part of the tree that is always in memory.
+    std::size_t resident_cell_count() const noexcept;
+
+    std::size_t thread_count() const noexcept;
+
+    kernels::Isa kernel_isa() const noexcept;
+
+private:
+    /// Arrays of a block, in the order they are stored.
+    enum class Quantity : std::size_t { x = 0, y, z, vx, vy, vz, ax, ay, az, mass };
+    static constexpr std::size_t quantity_count{10};
+
+    using Bounds = Oct::Box;
+
+    /// Bounding cube of a block's bodies and where its resident cells are.
+    struct Block {
+        Bounds bounds{};
+        std::size_t first_cell{0};
+        std::size_t cell_count{0};
+    };
+
+    /// Leading key digits the sort buckets the bodies by.
+    static constexpr std::uint32_t sort_digits{6};
+
+    std::size_t block_count() const noexcept;
+    std::size_t bodies_in(std::size_t const block) const noexcept;
+
+    /// Array of one quantity of a block in the given file.
+    float* array(std::size_t const file, std::size_t const block, Quantity const quantity)
+        const noexcept;
+
+    /// Reads ahead the block after the given one in the given file.
+    void read_ahead(std::size_t const file, std::size_t const block) const noexcept;
+
+    /// Kicks and drifts every body and measures the bounds of the result.
+    void kick_drift(float const kick_dt, float const drift_dt) noexcept;
+
+    /// Buckets the bodies by key into the other file, a no-op when every block already holds the
+    /// bodies of its buckets.
+    void sort() noexcept;
+
+    /// Sorts every block by its own Oct and collects the resident cells.
+    void build_resident_tree() noexcept;
+
+    /// Cells of the binary tree over blocks [first, last) followed by the cells of the blocks.
+    void join_blocks(std::size_t const first, std::size_t const last) noexcept;
+
+    /// Accelerations of every body, followed by a kick.
+    void evaluate(float const kick_dt) noexcept;
+
+    /// Sources of a group of the target block: resident cells and the bodies of opened leaves.
+    void interactions(Oct::Group const& group, kernels::Interaction_list& list) const noexcept;
+
+    /// Copies the positions and masses of a block into m_block and builds m_tree over them.
+    /// \return the root cube of the tree
+    Bounds build_block(std::size_t const block) noexcept;
+
+    std::size_t m_block_size{default_block_size};
+    std::size_t m_body_count{0};
+    /// The bodies are in m_files[m_current], the other one is where the sort scatters to.
+    std::array<sal::Mapped_file, 2> m_files;
+    std::array<std::string, 2> m_paths;
+    std::size_t m_current{0};
+    bool m_evaluated{false};
+
+    sal::Job_pool m_thread_pool;
+    kernels::Isa m_kernel_isa{kernels::Isa::scalar};
+    kernels::Kernel m_kernel{nullptr};
+
+    /// Bounds of every body after the last drift, the sort keys are taken over them.
+    Bounds m_bounds{};
+
+    std::vector<Block> m_blocks;
+    /// Resident cells of every block and their radii, first_body counts from the start of the
+    /// store.
+    std::vector<Oct::Walk_cell> m_block_cells;
+    std::vector<float> m_block_radii;
+    /// What the walks read, see join_blocks().
+    std::vector<Oct::Walk_cell> m_cells;
+    std::vector<float> m_radii;
+
+    /// One block in memory and its tree.
+    Particles m_block;
+    Oct m_tree;
+    std::vector<std::uint32_t> m_permutation;
+    std::vector<float> m_scratch;
+    /// Index of every kept cell of m_tree among the resident cells of its block.
+    std::vector<Oct::Cell_index> m_cell_remap;
+    /// Sort bucket of every body of a block, and the next free place of every bucket.
+    std::vector<std::uint32_t> m_buckets;
+    std::vector<std::uint64_t> m_bucket_cursors;
+
+    Step_stats m_last_step{};
+};
+
+#endif
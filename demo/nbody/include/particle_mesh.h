@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) https://github.com/kaapomoi 2023.
+ */
+
+#ifndef PARTICLE_MESH_H
+#define PARTICLE_MESH_H
+
+#include "fft.h"
+#include "force_kernels.h"
+#include "parallel_for.h"
+#include "particles.h"
+
+#include <glm/glm.hpp>
+
+#include <array>
+#include <complex>
+#include <cstdint>
+#include <vector>
+
+///
+/// \brief Long-range half of a TreePM force split, solved on a mesh.
+///
+/// The softened pair force of kernels::Kernel is split with a Gaussian of scale r_s into a
+/// smooth long-range part, solved here, and a short-range part that is negligible a few r_s away
+/// and is left to a tree walk with a cutoff, see split(). Without softening the long-range
+/// potential would be -G * m * erf(r / (2 * r_s)) / r, but the softening length is larger than a
+/// mesh cell at the demo's scales, so the split is applied to the softened force instead.
+///
+/// A solve deposits every body on the mesh with cloud-in-cell weights, convolves the masses with
+/// the long-range Green's function through FFTs and differences the potential into three
+/// acceleration meshes, which acceleration() interpolates with the same weights. The transforms
+/// run on a mesh padded to twice the size with zeros (Hockney & Eastwood), so bodies feel no
+/// periodic images of each other.
+///
+/// r_s is a fixed number of mesh cells. The Green's function depends on the spacing, so the mesh
+/// is fitted to the bodies with some room to spare and keeps its spacing, and its transform, for
+/// as long as they fit.
+///
+class Particle_mesh {
+public:
+    static constexpr std::size_t default_mesh_size{64};
+    static constexpr std::size_t min_mesh_size{16};
+
+    /// r_s in mesh cells, smaller leaves more of the force to the mesh at a larger error.
+    static constexpr float split_cells{1.25f};
+
+    /// The short-range force is dropped past this many r_s, where less than 2% of the pair force
+    /// is left to it.
+    static constexpr float cutoff_splits{4.5f};
+
+    Particle_mesh() noexcept;
+
+    std::size_t mesh_size() const noexcept;
+    /// \note Rounded up to a power of two, and to min_mesh_size.
+    void set_mesh_size(std::size_t const size) noexcept;
+
+    ///
+    /// \brief Solves for the long-range field of every body over the cube [min, max].
+    ///
+    /// \note Bodies outside of the cube or with non-finite positions are left out.
+    ///
+    void solve(Particles const& particles,
+               glm::vec3 const& min,
+               glm::vec3 const& max,
+               sal::Job_pool& pool) noexcept;
+
+    /// Long-range acceleration at the position from the last solve, zero outside of its cube.
+    glm::vec3 acceleration(glm::vec3 const& position) const noexcept;
+
+    ///
+    /// \brief Short-range factor of the last solve for kernels::Short_range_kernel.
+    ///
+    /// erfc(u / 2) + u / sqrt(pi) * exp(-u^2 / 4), u = r / r_s, is what is left of the force
+    /// after the long-range part.
+    ///
+    kernels::Split_table const& split() const noexcept;
+
+    /// r_s of the last solve.
+    float split_scale() const noexcept;
+
+    /// Distance past which the short-range force is dropped.
+    float cutoff() const noexcept;
+
+private:
+    /// The cube starts this many cells into the mesh, leaving room for the difference stencil.
+    static constexpr std::size_t margin{2};
+
+    /// Share of the bodies' extent the mesh is widened by when it is fitted to them.
+    static constexpr float fit_slack{0.25f};
+
+    /// Samples of the long-range potential over the distances on the padded mesh.
+    static constexpr std::size_t potential_table_size{4096};
+
+    void deposit(Particles const& particles, sal::Job_pool& pool) noexcept;
+    void differentiate(sal::Job_pool& pool) noexcept;
+
+    /// Transform of the long-range Green's function at the current spacing, scaled for the
+    /// inverse.
+    void transform_green(sal::Job_pool& pool) noexcept;
+
+    /// What is left of the pair force at u = r / r_s once the long-range part is taken out.
+    static double short_range_factor(double const u) noexcept;
+
+    /// Lower mesh node and weights of the upper one along each axis, false outside of the cube.
+    bool locate(glm::vec3 const& position,
+                std::array<std::size_t, 3>& node,
+                glm::vec3& weight) const noexcept;
+
+    std::size_t node(std::size_t const x, std::size_t const y, std::size_t const z) const noexcept;
+
+    std::size_t m_size{default_mesh_size};
+    glm::vec3 m_origin{0.f};
+    float m_spacing{1.f};
+    /// Width of the cube the spacing was fitted to, zero before the first solve.
+    float m_fitted_width{0.f};
+
+    fft::Plan m_plan;
+    /// Padded mesh of twice the size, masses in and potential out.
+    std::vector<std::complex<double>> m_padded;
+    std::vector<double> m_green;
+    /// One mass mesh per worker, summed into m_padded.
+    std::vector<std::vector<double>> m_deposits;
+
+    std::array<std::vector<float>, 3> m_acceleration;
+    kernels::Split_table m_split;
+};
+
+#endif
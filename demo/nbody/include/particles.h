@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) https://github.com/kaapomoi 2023.
+ */
+
+#ifndef PARTICLES_H
+#define PARTICLES_H
+
+#include "glm/glm.hpp"
+
+#include <cstdint>
+#include <new>
+#include <vector>
+
+///
+/// \brief Allocates on cache line boundaries so that vector loads from the start of an array
+/// never straddle two lines.
+///
+template<class T, std::size_t Alignment = 64>
+struct Aligned_allocator {
+    using value_type = T;
+
+    template<class U>
+    struct rebind {
+        using other = Aligned_allocator<U, Alignment>;
+    };
+
+    Aligned_allocator() noexcept = default;
+
+    template<class U>
+    Aligned_allocator(Aligned_allocator<U, Alignment> const&) noexcept
+    {
+    }
+
+    T* allocate(std::size_t const n)
+    {
+        return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t{Alignment}));
+    }
+
+    void deallocate(T* p, std::size_t const) noexcept
+    {
+        ::operator delete(p, std::align_val_t{Alignment});
+    }
+
+    template<class U>
+    bool operator==(Aligned_allocator<U, Alignment> const&) const noexcept
+    {
+        return true;
+    }
+};
+
+template<class T>
+using Aligned_vector = std::vector<T, Aligned_allocator<T>>;
+
+///
+/// \brief Structure-of-arrays store that owns the state of every simulated body.
+///
+/// Every quantity has its own aligned array, body i is element i of each of them.
+///
+struct Particles {
+    Aligned_vector<float> x;
+    Aligned_vector<float> y;
+    Aligned_vector<float> z;
+    Aligned_vector<float> vx;
+    Aligned_vector<float> vy;
+    Aligned_vector<float> vz;
+    Aligned_vector<float> ax;
+    Aligned_vector<float> ay;
+    Aligned_vector<float> az;
+    Aligned_vector<float> mass;
+
+    std::size_t size() const noexcept { return x.size(); }
+
+    void reserve(std::size_t const n) noexcept;
+
+    void clear() noexcept;
+
+    /// \return Index of the new body
+    std::uint32_t add(glm::vec3 const position, glm::vec3 const velocity, float const m) noexcept;
+
+    glm::vec3 position(std::size_t const i) const noexcept { return {x[i], y[i], z[i]}; }
+
+    glm::vec3 velocity(std::size_t const i) const noexcept { return {vx[i], vy[i], vz[i]}; }
+};
+
+#endif
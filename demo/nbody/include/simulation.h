@@ -0,0 +1,175 @@
+/*
+ * Copyright (c) https://github.com/kaapomoi 2023.
+ */
+
+#ifndef SIMULATION_H
+#define SIMULATION_H
+
+#include "oct.h"
+#include "parallel_for.h"
+#include "particle_mesh.h"
+#include "particles.h"
+
+#include <cstdint>
+#include <vector>
+
+///
+/// \brief Owns the bodies and advances them with the Barnes-Hut solver.
+///
+/// Nothing in here touches the window or the registry, the renderer reads the bodies through
+/// tree().
+///
+/// Bodies are integrated with kick-drift-kick leapfrog on power-of-two block timesteps. Each step
+/// every body picks a level from its acceleration and advances in 2^level sub-steps. Forces are
+/// only evaluated for the bodies that finish a sub-step, everything else just drifts.
+///
+class Simulation {
+public:
+    enum class Walk_mode : std::size_t {
+        /// Every body walks the tree on its own.
+        per_body = 0,
+        /// One walk per Oct::Group, its list is evaluated for every body of the group.
+        group = 1,
+        /// Cell against cell, see Oct::dual_tree(). Monopoles only, the multipole order is ignored
+        /// and the opening angle is the monopole one, Oct::default_opening_angle.
+        dual_tree = 2,
+        /// Group walk limited to the short-range part of the force, Particle_mesh adds the rest.
+        /// Monopoles only like dual_tree, at Oct::default_opening_angle.
+        tree_pm = 3
+    };
+
+    enum class Tree_update : std::size_t {
+        /// Builds the tree from scratch every step.
+        rebuild = 0,
+        /// Refits the previous tree, and builds only when Oct::refit() reports it degraded.
+        refit = 1
+    };
+
+    /// Where the last step() spent its time.
+    struct Step_stats {
+        float tree_time{0.f};
+        float force_time{0.f};
+        float integrate_time{0.f};
+        std::size_t tree_builds{0};
+        std::size_t tree_refits{0};
+        std::uint32_t sub_steps{0};
+        std::uint64_t force_evaluations{0};
+        std::uint64_t interactions{0};
+    };
+
+    explicit Simulation(std::size_t const thread_count) noexcept;
+
+    /// Advances every body by dt.
+    void step(float const dt) noexcept;
+
+    /// Removes every body.
+    void clear() noexcept;
+
+    ///
+    /// \brief Brings the tree up to date with bodies that were changed through particles(),
+    /// without advancing them.
+    ///
+    void refresh_tree() noexcept;
+
+    Particles& particles() noexcept;
+    Particles const& particles() const noexcept;
+
+    Oct const& tree() const noexcept;
+
+    Oct::Build_mode build_mode() const noexcept;
+    void set_build_mode(Oct::Build_mode const mode) noexcept;
+
+    Walk_mode walk_mode() const noexcept;
+    /// Also moves the opening angle to the one tuned for the mode and multipole order.
+    void set_walk_mode(Walk_mode const mode) noexcept;
+
+    Tree_update tree_update() const noexcept;
+    void set_tree_update(Tree_update const update) noexcept;
+
+    Oct::Multipole_order multipole_order() const noexcept;
+    /// Also moves the opening angle to the one tuned for the walk mode and order.
+    void set_multipole_order(Oct::Multipole_order const order) noexcept;
+
+    float opening_angle() const noexcept;
+    void set_opening_angle(float const angle) noexcept;
+
+    /// Bodies per tree leaf, the tree is rebuilt with it on the next step.
+    std::uint32_t leaf_size() const noexcept;
+    void set_leaf_size(std::uint32_t const size) noexcept;
+
+    /// Cells per axis of the tree_pm walk's mesh.
+    std::size_t mesh_size() const noexcept;
+    void set_mesh_size(std::size_t const size) noexcept;
+
+    std::size_t thread_count() const noexcept;
+
+    Step_stats const& last_step() const noexcept;
+
+    kernels::Isa kernel_isa() const noexcept;
+
+    kernels::Precision precision() const noexcept;
+    void set_precision(kernels::Precision const precision) noexcept;
+
+    static char const* str(Walk_mode const mode) noexcept;
+    static char const* str(Tree_update const update) noexcept;
+
+private:
+    using Bounds = Oct::Box;
+
+    /// \return true when the tree was refitted instead of built
+    bool update_tree() noexcept;
+
+    /// Opening angle for the walk mode and multipole order, the wider quadrupole one only where
+    /// the walk evaluates quadrupoles.
+    float tuned_opening_angle() const noexcept;
+
+    ///
+    /// \brief Smallest cube around every body, from a parallel min / max reduction over the
+    /// positions.
+    ///
+    /// \note Bodies with non-finite positions are left out, the tree can't hold them anyway.
+    ///
+    Bounds root_bounds() noexcept;
+
+    /// \return Number of interactions evaluated
+    std::uint64_t compute_accelerations() noexcept;
+    std::uint64_t walk_per_body() noexcept;
+    glm::vec3 evaluate(glm::vec3 const& target,
+                       kernels::Interaction_list const& list,
+                       kernels::Quadrupole_list const& far) const noexcept;
+    std::uint64_t walk_groups() noexcept;
+    /// Solves the mesh, then walks the groups for the short-range force and adds the mesh's.
+    std::uint64_t walk_tree_pm() noexcept;
+
+    void assign_levels(float const dt) noexcept;
+
+    /// Marks the bodies whose sub-step starts or ends at the given tick of the step.
+    /// \return Number of marked bodies
+    std::size_t mark_active(std::uint32_t const tick, std::uint32_t const ticks) noexcept;
+
+    /// Kicks every marked body by half of its own sub-step of dt.
+    void kick(float const dt) noexcept;
+    void drift(float const dt) noexcept;
+
+    sal::Job_pool m_thread_pool;
+    Particles m_particles;
+    Oct m_tree;
+    Particle_mesh m_mesh;
+    Oct::Build_mode m_build_mode{Oct::Build_mode::morton};
+    Walk_mode m_walk_mode{Walk_mode::group};
+    Tree_update m_tree_update{Tree_update::refit};
+    kernels::Isa m_kernel_isa{kernels::Isa::scalar};
+    kernels::Precision m_precision{kernels::Precision::single};
+    kernels::Kernel m_kernel{nullptr};
+    kernels::Quadrupole_kernel m_quadrupole_kernel{nullptr};
+    kernels::Short_range_kernel m_short_range_kernel{nullptr};
+
+    /// Timestep level and whether the force is evaluated at the current tick, per particle.
+    std::vector<std::uint8_t> m_levels;
+    std::vector<std::uint8_t> m_active;
+    std::uint8_t m_finest_level{0};
+
+    Step_stats m_last_step;
+};
+
+#endif
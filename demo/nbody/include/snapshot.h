@@ -0,0 +1,178 @@
+/*
+ * Copyright (c) https://github.com/kaapomoi 2023.
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "mapped_file.h"
+#include "particles.h"
+#include "ts_queue.h"
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <span>
+#include <string>
+#include <thread>
+#include <vector>
+
+///
+/// Binary snapshots of the simulation state.
+///
+/// A file is a header followed by any number of frames of the same bodies, so one saved state and
+/// a whole recorded run share the format. Every frame is a frame header followed by one block per
+/// quantity: x, y, z, vx, vy, vz and mass as little-endian floats. Headers and blocks start on 64
+/// byte boundaries and all frames are the same size, so frame i is at a fixed offset and a mapped
+/// file is used in place, without reading or converting anything.
+///
+namespace snapshot {
+
+static_assert(std::endian::native == std::endian::little,
+              "Snapshots are little-endian and read in place, big-endian hosts are not supported");
+
+constexpr std::array<char, 8> magic{'N', 'B', 'O', 'D', 'Y', 'S', 'N', 'P'};
+constexpr std::uint32_t version{1};
+
+/// x, y, z, vx, vy, vz, mass
+constexpr std::uint32_t block_count{7};
+constexpr std::size_t alignment{64};
+
+struct Header {
+    std::array<char, 8> magic{snapshot::magic};
+    std::uint32_t version{snapshot::version};
+    std::uint32_t block_count{snapshot::block_count};
+    std::uint64_t body_count{0};
+    /// Updated after every written frame, so a recording cut short is readable up to its last
+    /// complete frame.
+    std::uint64_t frame_count{0};
+    /// Bytes from the start of one frame to the next.
+    std::uint64_t frame_size{0};
+    std::array<std::uint8_t, 24> reserved{};
+};
+
+struct Frame_header {
+    std::uint64_t step{0};
+    double time{0.0};
+    std::array<std::uint8_t, 48> reserved{};
+};
+
+static_assert(sizeof(Header) == alignment);
+static_assert(sizeof(Frame_header) == alignment);
+
+/// Bytes of one block, padded to the alignment.
+constexpr std::size_t block_size(std::size_t const body_count) noexcept
+{
+    return (body_count * sizeof(float) + alignment - 1) / alignment * alignment;
+}
+
+constexpr std::size_t frame_size(std::size_t const body_count) noexcept
+{
+    return sizeof(Frame_header) + block_count * block_size(body_count);
+}
+
+///
+/// \brief One frame of a mapped file, the spans point into the mapping.
+///
+struct Frame {
+    std::uint64_t step{0};
+    double time{0.0};
+    std::span<float const> x;
+    std::span<float const> y;
+    std::span<float const> z;
+    std::span<float const> vx;
+    std::span<float const> vy;
+    std::span<float const> vz;
+    std::span<float const> mass;
+};
+
+///
+/// \brief Writes frames on a thread of its own.
+///
+/// write() copies the bodies into a buffer and returns, the caller never waits for the disk.
+///
+class Writer {
+public:
+    Writer() = default;
+    ~Writer() noexcept;
+
+    Writer(Writer const&) = delete;
+    Writer& operator=(Writer const&) = delete;
+
+    ///
+    /// \brief Creates or truncates the file for frames of the given number of bodies.
+    ///
+    /// \note A file that is still open is closed first.
+    ///
+    bool open(std::string const& file, std::size_t const body_count) noexcept;
+
+    ///
+    /// \brief Waits for the queued frames to be written and closes the file.
+    ///
+    void close() noexcept;
+
+    bool is_open() const noexcept;
+
+    ///
+    /// \brief Queues the current state of the bodies as the next frame.
+    ///
+    /// \return false if no file is open or the body count differs from the one it was opened with
+    ///
+    bool write(Particles const& particles, std::uint64_t const step, double const time) noexcept;
+
+    /// Frames that have reached the file.
+    std::uint64_t frames_written() const noexcept;
+
+private:
+    using Buffer = std::shared_ptr<std::vector<std::byte>>;
+
+    void execute_writer() noexcept;
+
+    std::FILE* m_file{nullptr};
+    Header m_header{};
+    std::unique_ptr<sal::Ts_queue<Buffer>> m_queue;
+    std::atomic_uint64_t m_frames_written{0};
+    std::jthread m_thread;
+};
+
+///
+/// \brief Maps a snapshot file and hands out its frames in place.
+///
+class Reader {
+public:
+    ///
+    /// \brief Maps the file and checks its header.
+    ///
+    /// \return false if the file can't be mapped or isn't a snapshot of this version. Frames
+    /// missing from the end of a recording that was cut short are left out.
+    ///
+    bool open(std::string const& file) noexcept;
+
+    void close() noexcept;
+
+    bool is_open() const noexcept;
+
+    std::size_t body_count() const noexcept;
+    std::size_t frame_count() const noexcept;
+
+    /// \note index must be less than frame_count().
+    Frame frame(std::size_t const index) const noexcept;
+
+    ///
+    /// \brief Replaces the bodies with the ones of the given frame.
+    ///
+    /// Accelerations are zeroed, the next step evaluates them.
+    ///
+    void load(std::size_t const index, Particles& particles) const noexcept;
+
+private:
+    sal::Mapped_file m_file;
+    Header m_header{};
+};
+
+} // namespace snapshot
+
+#endif
@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) https://github.com/kaapomoi 2023.
+ */
+
+#ifndef SOLVER_H
+#define SOLVER_H
+
+#include <chrono>
+#include <cstddef>
+
+///
+/// \brief Tuning shared by the solvers that step a Particles set on a pool: Simulation,
+/// Out_of_core and the distributed workers.
+///
+namespace solver {
+
+/// Below this a job costs more to hand out than the bodies take to update.
+constexpr std::size_t min_bodies_per_job{256};
+
+/// Groups are coarser work items than bodies, a few of them already fill a job.
+constexpr std::size_t min_groups_per_job{8};
+
+/// Lists at 50k bodies hold a few hundred sources, this keeps most walks from growing them.
+constexpr std::size_t interaction_list_capacity{1024};
+
+/// Time from start until now, for the step statistics.
+inline float seconds_since(std::chrono::high_resolution_clock::time_point const start) noexcept
+{
+    return std::chrono::duration_cast<std::chrono::duration<float>>(
+               std::chrono::high_resolution_clock::now() - start)
+        .count();
+}
+
+} // namespace solver
+
+#endif
@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) https://github.com/kaapomoi 2023.
+ */
+
+#include "direct_sum.h"
+
+#include <algorithm>
+#include <vector>
+
+namespace direct_sum {
+
+namespace {
+
+/// Each job runs at least this many targets over every tile, which keeps the tiles hot.
+constexpr std::size_t min_targets_per_job{64};
+
+double percentile(std::vector<double> const& sorted, double const fraction) noexcept
+{
+    std::size_t const index{static_cast<std::size_t>(fraction * (sorted.size() - 1) + 0.5)};
+    return sorted[index];
+}
+
+} // namespace
+
+void accelerations(sal::Job_pool& pool,
+                   Particles const& particles,
+                   kernels::Kernel const kernel,
+                   std::span<std::uint32_t const> const targets,
+                   std::span<glm::dvec3> const out) noexcept
+{
+    std::size_t const n{particles.size()};
+    std::size_t const tile_count{(n + tile_size - 1) / tile_size};
+
+    std::vector<kernels::Interaction_list> tiles(tile_count);
+    sal::parallel_for(pool, tile_count, [&](std::size_t const begin, std::size_t const end) {
+        for (std::size_t t{begin}; t < end; t++) {
+            kernels::Interaction_list& tile{tiles[t]};
+            tile.reserve(tile_size);
+            for (std::size_t i{t * tile_size}; i < std::min(n, (t + 1) * tile_size); i++) {
+                tile.push(particles.x[i], particles.y[i], particles.z[i], particles.mass[i]);
+            }
+        }
+    });
+
+    sal::parallel_for(
+        pool, targets.size(),
+        [&](std::size_t const begin, std::size_t const end) {
+            std::fill(out.begin() + begin, out.begin() + end, glm::dvec3{0.0});
+
+            for (kernels::Interaction_list const& tile : tiles) {
+                for (std::size_t i{begin}; i < end; i++) {
+                    out[i] += glm::dvec3{kernel(particles.position(targets[i]), tile)};
+                }
+            }
+        },
+        min_targets_per_job);
+}
+
+Error_stats relative_error(Particles const& particles,
+                           std::span<std::uint32_t const> const targets,
+                           std::span<glm::dvec3 const> const reference) noexcept
+{
+    Error_stats stats{};
+    if (targets.empty()) {
+        return stats;
+    }
+
+    std::vector<double> errors(targets.size());
+    double sum{0.0};
+    for (std::size_t i{0}; i < targets.size(); i++) {
+        std::uint32_t const p{targets[i]};
+        glm::dvec3 const a{particles.ax[p], particles.ay[p], particles.az[p]};
+        double const magnitude{glm::length(reference[i])};
+
+        errors[i] = (magnitude > 0.0) ? glm::length(a - reference[i]) / magnitude
+                                      : glm::length(a);
+        sum += errors[i];
+    }
+
+    std::sort(errors.begin(), errors.end());
+
+    stats.count = errors.size();
+    stats.mean = sum / static_cast<double>(errors.size());
+    stats.p50 = percentile(errors, 0.5);
+    stats.p90 = percentile(errors, 0.9);
+    stats.p99 = percentile(errors, 0.99);
+    stats.max = errors.back();
+    return stats;
+}
+
+} // namespace direct_sum
@@ -0,0 +1,967 @@
+/*
+ * Copyright (c) https://github.com/kaapomoi 2023.
+ */
+
+#include "distributed.h"
+
+#include "force_kernels.h"
+#include "morton.h"
+#include "oct.h"
+#include "parallel_for.h"
+#include "solver.h"
+
+#if !defined(_WIN32)
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <limits>
+#include <mutex>
+#include <type_traits>
+#include <utility>
+
+namespace distributed {
+
+namespace {
+
+/// Leading key digits the work is measured over, the finest cut between two ranks.
+constexpr std::uint32_t balance_digits{5};
+
+/// Buckets of balance_digits digits, and one more for bodies outside of the root.
+constexpr std::size_t bucket_count{(std::size_t{1} << (3 * balance_digits)) + 1};
+
+/// Work of a body that hasn't been evaluated yet, so the first cut splits the bodies evenly.
+constexpr float default_work{1.f};
+
+enum class Command : std::uint32_t { scatter = 0, step = 1, gather = 2, quit = 3 };
+
+struct Command_message {
+    Command command{Command::quit};
+    float kick_before{0.f};
+    float drift{0.f};
+    float kick_after{0.f};
+};
+
+/// A body as it travels between processes, with the interactions it took in the last step.
+struct Body {
+    glm::vec3 position{0.f};
+    glm::vec3 velocity{0.f};
+    glm::vec3 acceleration{0.f};
+    float mass{0.f};
+    float work{default_work};
+};
+
+/// Cell or body of an essential tree, a point mass either way.
+struct Source {
+    glm::vec3 position{0.f};
+    float mass{0.f};
+};
+
+struct Box {
+    glm::vec3 min{std::numeric_limits<float>::max()};
+    glm::vec3 max{std::numeric_limits<float>::lowest()};
+
+    bool is_empty() const noexcept { return min.x > max.x; }
+
+    void add(glm::vec3 const& point) noexcept
+    {
+        min = glm::min(min, point);
+        max = glm::max(max, point);
+    }
+
+    void add(Box const& box) noexcept
+    {
+        min = glm::min(min, box.min);
+        max = glm::max(max, box.max);
+    }
+};
+
+bool is_finite(glm::vec3 const& v) noexcept
+{
+    return std::isfinite(v.x) && std::isfinite(v.y) && std::isfinite(v.z);
+}
+
+Body body_of(Particles const& particles, std::vector<float> const& work, std::size_t const i)
+{
+    return {particles.position(i),
+            particles.velocity(i),
+            {particles.ax[i], particles.ay[i], particles.az[i]},
+            particles.mass[i],
+            work[i]};
+}
+
+void append(Particles& particles, std::vector<float>& work, std::span<Body const> const bodies)
+{
+    for (Body const& body : bodies) {
+        std::uint32_t const i{particles.add(body.position, body.velocity, body.mass)};
+        particles.ax[i] = body.acceleration.x;
+        particles.ay[i] = body.acceleration.y;
+        particles.az[i] = body.acceleration.z;
+        work.push_back(body.work);
+    }
+}
+
+template<class T>
+std::span<std::byte const> bytes_of(std::span<T const> const values) noexcept
+{
+    static_assert(std::is_trivially_copyable_v<T>);
+    return std::as_bytes(values);
+}
+
+#if !defined(_WIN32)
+
+///
+/// Every message is its size in bytes followed by the bytes. Messages to and from the
+/// coordinator are sent and received blocking, between ranks through exchange().
+///
+bool write_all(int const socket, std::span<std::byte const> data) noexcept
+{
+    while (!data.empty()) {
+        ssize_t const written{::send(socket, data.data(), data.size(), MSG_NOSIGNAL)};
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        data = data.subspan(static_cast<std::size_t>(written));
+    }
+    return true;
+}
+
+bool read_all(int const socket, std::span<std::byte> data) noexcept
+{
+    while (!data.empty()) {
+        ssize_t const count{::read(socket, data.data(), data.size())};
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            return false;
+        }
+        data = data.subspan(static_cast<std::size_t>(count));
+    }
+    return true;
+}
+
+template<class T>
+bool send(int const socket, std::span<T const> const values) noexcept
+{
+    std::span<std::byte const> const data{bytes_of(values)};
+    std::uint64_t const size{data.size()};
+    return write_all(socket, std::as_bytes(std::span{&size, 1})) && write_all(socket, data);
+}
+
+template<class T>
+bool send_value(int const socket, T const& value) noexcept
+{
+    return send(socket, std::span<T const>{&value, 1});
+}
+
+template<class T>
+bool receive(int const socket, std::vector<T>& values) noexcept
+{
+    static_assert(std::is_trivially_copyable_v<T>);
+    std::uint64_t size{0};
+    if (!read_all(socket, std::as_writable_bytes(std::span{&size, 1})) || (size % sizeof(T) != 0)) {
+        return false;
+    }
+    values.resize(size / sizeof(T));
+    return read_all(socket, std::as_writable_bytes(std::span{values}));
+}
+
+template<class T>
+bool receive_value(int const socket, T& value) noexcept
+{
+    std::vector<T> values;
+    if (!receive(socket, values) || values.size() != 1) {
+        return false;
+    }
+    value = values.front();
+    return true;
+}
+
+///
+/// \brief Sends outgoing[r] to every other rank r and receives one message from each into
+/// incoming[r].
+///
+/// The sockets are non-blocking and polled together, every one is served as soon as it can take
+/// or give more bytes. A rank whose socket is -1, the rank itself, is left out.
+///
+/// \return false if a rank is gone
+///
+bool exchange(std::span<int const> const peers,
+              std::vector<std::vector<std::byte>> const& outgoing,
+              std::vector<std::vector<std::byte>>& incoming) noexcept
+{
+    static constexpr std::size_t header{sizeof(std::uint64_t)};
+
+    std::size_t const n{peers.size()};
+    std::vector<std::uint64_t> send_sizes(n);
+    std::vector<std::size_t> sent(n, 0);
+    std::vector<std::uint64_t> receive_sizes(n, 0);
+    std::vector<std::size_t> received(n, 0);
+    incoming.assign(n, {});
+    for (std::size_t r{0}; r < n; r++) {
+        send_sizes[r] = outgoing[r].size();
+    }
+
+    auto const sending = [&](std::size_t const r) { return sent[r] < header + send_sizes[r]; };
+    auto const receiving = [&](std::size_t const r) {
+        return received[r] < header + receive_sizes[r] || received[r] < header;
+    };
+
+    std::vector<pollfd> fds;
+    std::vector<std::size_t> fd_ranks;
+    while (true) {
+        fds.clear();
+        fd_ranks.clear();
+        for (std::size_t r{0}; r < n; r++) {
+            short const events{static_cast<short>((sending(r) ? POLLOUT : 0)
+                                                  | (receiving(r) ? POLLIN : 0))};
+            if (peers[r] >= 0 && events != 0) {
+                fds.push_back({peers[r], events, 0});
+                fd_ranks.push_back(r);
+            }
+        }
+        if (fds.empty()) {
+            return true;
+        }
+
+        if (poll(fds.data(), fds.size(), -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+
+        for (std::size_t i{0}; i < fds.size(); i++) {
+            std::size_t const r{fd_ranks[i]};
+            short const events{fds[i].revents};
+            if ((events & (POLLERR | POLLNVAL)) != 0) {
+                return false;
+            }
+
+            if ((events & POLLOUT) != 0) {
+                std::span<std::byte const> const data{
+                    (sent[r] < header)
+                        ? std::as_bytes(std::span{&send_sizes[r], 1}).subspan(sent[r])
+                        : std::span{outgoing[r]}.subspan(sent[r] - header)};
+                ssize_t const written{::send(peers[r], data.data(), data.size(), MSG_NOSIGNAL)};
+                if (written < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                    return false;
+                }
+                sent[r] += static_cast<std::size_t>(std::max<ssize_t>(written, 0));
+            }
+
+            if ((events & (POLLIN | POLLHUP)) != 0) {
+                std::span<std::byte> const data{
+                    (received[r] < header)
+                        ? std::as_writable_bytes(std::span{&receive_sizes[r], 1})
+                              .subspan(received[r])
+                        : std::span{incoming[r]}.subspan(received[r] - header)};
+                ssize_t const count{::read(peers[r], data.data(), data.size())};
+                if (count == 0
+                    || (count < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                    return false;
+                }
+
+                bool const had_header{received[r] >= header};
+                received[r] += static_cast<std::size_t>(std::max<ssize_t>(count, 0));
+                if (!had_header && received[r] >= header) {
+                    incoming[r].resize(receive_sizes[r]);
+                }
+            }
+        }
+    }
+}
+
+template<class T>
+std::vector<std::byte> to_bytes(std::span<T const> const values)
+{
+    std::span<std::byte const> const data{bytes_of(values)};
+    return {data.begin(), data.end()};
+}
+
+template<class T>
+std::span<T const> from_bytes(std::vector<std::byte> const& data) noexcept
+{
+    static_assert(std::is_trivially_copyable_v<T>);
+    return {reinterpret_cast<T const*>(data.data()), data.size() / sizeof(T)};
+}
+
+///
+/// \brief One rank: owns its bodies and runs the phases the coordinator asks for.
+///
+class Worker {
+public:
+    Worker(std::size_t const rank,
+           int const coordinator,
+           std::vector<int> peers,
+           std::size_t const thread_count) noexcept
+        : m_rank{rank}
+        , m_coordinator{coordinator}
+        , m_peers{std::move(peers)}
+        , m_thread_pool{thread_count}
+        , m_kernel{kernels::select(kernels::detect())}
+    {
+        for (int const peer : m_peers) {
+            if (peer >= 0) {
+                fcntl(peer, F_SETFL, fcntl(peer, F_GETFL) | O_NONBLOCK);
+            }
+        }
+    }
+
+    /// Serves the coordinator until it says quit or is gone.
+    void run() noexcept
+    {
+        Command_message command;
+        std::vector<Body> bodies;
+        while (receive_value(m_coordinator, command)) {
+            switch (command.command) {
+            case Command::scatter:
+                if (!receive(m_coordinator, bodies)) {
+                    return;
+                }
+                m_owned.clear();
+                m_work.clear();
+                append(m_owned, m_work, bodies);
+                break;
+            case Command::step:
+                if (!run_phase(command)) {
+                    return;
+                }
+                break;
+            case Command::gather:
+                bodies.clear();
+                for (std::size_t i{0}; i < m_owned.size(); i++) {
+                    bodies.push_back(body_of(m_owned, m_work, i));
+                }
+                if (!send(m_coordinator, std::span<Body const>{bodies})) {
+                    return;
+                }
+                break;
+            case Command::quit:
+                return;
+            }
+        }
+    }
+
+private:
+    bool run_phase(Command_message const& command) noexcept
+    {
+        m_stats = {};
+
+        std::chrono::high_resolution_clock::time_point sw_start{
+            std::chrono::high_resolution_clock::now()};
+        Box const bounds{kick_drift(command.kick_before, command.drift)};
+        m_stats.integrate_time += solver::seconds_since(sw_start);
+
+        sw_start = std::chrono::high_resolution_clock::now();
+        Box root;
+        std::vector<std::uint32_t> splitters;
+        if (!send_value(m_coordinator, bounds) || !receive_value(m_coordinator, root)) {
+            return false;
+        }
+        histogram_work(root);
+        if (!send(m_coordinator, std::span<double const>{m_histogram})
+            || !receive(m_coordinator, splitters) || !migrate(splitters)) {
+            return false;
+        }
+
+        Box domain;
+        for (std::size_t i{0}; i < m_owned.size(); i++) {
+            if (is_finite(m_owned.position(i))) {
+                domain.add(m_owned.position(i));
+            }
+        }
+        std::vector<Box> domains;
+        if (!send_value(m_coordinator, domain) || !receive(m_coordinator, domains)) {
+            return false;
+        }
+        m_stats.exchange_time += solver::seconds_since(sw_start);
+
+        if (!import_essential_trees(root, domains)) {
+            return false;
+        }
+
+        sw_start = std::chrono::high_resolution_clock::now();
+        evaluate();
+        m_stats.force_time += solver::seconds_since(sw_start);
+
+        sw_start = std::chrono::high_resolution_clock::now();
+        kick_drift(command.kick_after, 0.f);
+        m_stats.integrate_time += solver::seconds_since(sw_start);
+
+        m_stats.body_count = m_owned.size();
+        return send_value(m_coordinator, m_stats);
+    }
+
+    /// \return the bounds of the bodies afterwards
+    Box kick_drift(float const kick_dt, float const drift_dt) noexcept
+    {
+        Particles& p{m_owned};
+        Box bounds;
+        std::mutex mutex;
+
+        sal::parallel_for(
+            m_thread_pool, p.size(),
+            [&](std::size_t const begin, std::size_t const end) {
+                Box chunk;
+                for (std::size_t i{begin}; i < end; i++) {
+                    p.vx[i] += p.ax[i] * kick_dt;
+                    p.vy[i] += p.ay[i] * kick_dt;
+                    p.vz[i] += p.az[i] * kick_dt;
+                    p.x[i] += p.vx[i] * drift_dt;
+                    p.y[i] += p.vy[i] * drift_dt;
+                    p.z[i] += p.vz[i] * drift_dt;
+                    if (is_finite(p.position(i))) {
+                        chunk.add(p.position(i));
+                    }
+                }
+
+                std::lock_guard<std::mutex> lock{mutex};
+                bounds.add(chunk);
+            },
+            solver::min_bodies_per_job);
+
+        return bounds;
+    }
+
+    /// Bucket of every body and the work in every bucket.
+    void histogram_work(Box const& root) noexcept
+    {
+        static constexpr std::uint32_t shift{3 * (morton::bits_per_axis - balance_digits)};
+        glm::vec3 const size{root.max - root.min};
+
+        m_buckets.resize(m_owned.size());
+        sal::parallel_for(
+            m_thread_pool, m_owned.size(),
+            [&](std::size_t const begin, std::size_t const end) {
+                for (std::size_t i{begin}; i < end; i++) {
+                    std::uint64_t const key{morton::key(m_owned.position(i), root.min, size)};
+                    m_buckets[i] = static_cast<std::uint32_t>(
+                        std::min<std::uint64_t>(key >> shift, bucket_count - 1));
+                }
+            },
+            solver::min_bodies_per_job);
+
+        m_histogram.assign(bucket_count, 0.0);
+        for (std::size_t i{0}; i < m_owned.size(); i++) {
+            m_histogram[m_buckets[i]] += m_work[i];
+        }
+    }
+
+    /// Sends away the bodies of the other ranks' buckets and takes in the ones of this rank's.
+    bool migrate(std::vector<std::uint32_t> const& splitters) noexcept
+    {
+        std::vector<std::vector<Body>> leaving(m_peers.size());
+        Particles staying;
+        std::vector<float> staying_work;
+        for (std::size_t i{0}; i < m_owned.size(); i++) {
+            std::size_t const rank{static_cast<std::size_t>(
+                std::upper_bound(splitters.begin(), splitters.end(), m_buckets[i])
+                - splitters.begin() - 1)};
+            if (rank == m_rank || rank >= m_peers.size()) {
+                std::uint32_t const s{staying.add(m_owned.position(i), m_owned.velocity(i),
+                                                  m_owned.mass[i])};
+                staying.ax[s] = m_owned.ax[i];
+                staying.ay[s] = m_owned.ay[i];
+                staying.az[s] = m_owned.az[i];
+                staying_work.push_back(m_work[i]);
+            }
+            else {
+                leaving[rank].push_back(body_of(m_owned, m_work, i));
+            }
+        }
+
+        std::vector<std::vector<std::byte>> outgoing(m_peers.size());
+        for (std::size_t r{0}; r < m_peers.size(); r++) {
+            outgoing[r] = to_bytes(std::span<Body const>{leaving[r]});
+        }
+        if (!exchange(m_peers, outgoing, m_incoming)) {
+            return false;
+        }
+
+        m_owned = std::move(staying);
+        m_work = std::move(staying_work);
+        for (std::vector<std::byte> const& data : m_incoming) {
+            std::span<Body const> const arrived{from_bytes<Body>(data)};
+            append(m_owned, m_work, arrived);
+            m_stats.migrated += arrived.size();
+        }
+        return true;
+    }
+
+    ///
+    /// \brief Cells of the tree that the domain accepts and bodies of the leaves it opens.
+    ///
+    /// Oct's group walk with the whole domain as the group, so every group of the other rank
+    /// finds what it would open in its own walk.
+    ///
+    void export_essential_tree(Box const& domain, std::vector<Source>& out) const noexcept
+    {
+        out.clear();
+        if (domain.is_empty()) {
+            return;
+        }
+
+        std::span<Oct::Walk_cell const> const cells{m_tree.walk_cells()};
+        Oct::Group const group{0, 0, domain.min, domain.max};
+        Oct::walk_group(
+            cells, m_tree.radii(), group, m_tree.opening_angle(),
+            [&](Oct::Cell_index const index) {
+                out.push_back({cells[index].center_of_mass, cells[index].mass});
+            },
+            [&](Oct::Cell_index const index) {
+                Oct::Walk_cell const& cell{cells[index]};
+                for (std::uint32_t b{cell.first_body}; b < cell.first_body + cell.body_count;
+                     b++) {
+                    out.push_back({m_tree.position(b), m_tree.mass(b)});
+                }
+            });
+    }
+
+    ///
+    /// \brief Trades essential trees with every other rank and builds the tree the forces are
+    /// walked on, this rank's bodies first and then the imported sources.
+    ///
+    bool import_essential_trees(Box const& root, std::vector<Box> const& domains) noexcept
+    {
+        std::chrono::high_resolution_clock::time_point sw_start{
+            std::chrono::high_resolution_clock::now()};
+
+        m_tree.build(root.min, root.max, m_owned, Oct::Build_mode::morton, m_thread_pool);
+
+        std::vector<std::vector<std::byte>> outgoing(m_peers.size());
+        std::vector<Source> sources;
+        for (std::size_t r{0}; r < m_peers.size(); r++) {
+            if (r != m_rank && r < domains.size()) {
+                export_essential_tree(domains[r], sources);
+                outgoing[r] = to_bytes(std::span<Source const>{sources});
+            }
+        }
+        m_stats.tree_time += solver::seconds_since(sw_start);
+
+        sw_start = std::chrono::high_resolution_clock::now();
+        if (!exchange(m_peers, outgoing, m_incoming)) {
+            return false;
+        }
+        m_stats.exchange_time += solver::seconds_since(sw_start);
+
+        sw_start = std::chrono::high_resolution_clock::now();
+        m_combined.clear();
+        m_combined.x.assign(m_owned.x.begin(), m_owned.x.end());
+        m_combined.y.assign(m_owned.y.begin(), m_owned.y.end());
+        m_combined.z.assign(m_owned.z.begin(), m_owned.z.end());
+        m_combined.mass.assign(m_owned.mass.begin(), m_owned.mass.end());
+        for (std::vector<std::byte> const& data : m_incoming) {
+            for (Source const& source : from_bytes<Source>(data)) {
+                m_combined.x.push_back(source.position.x);
+                m_combined.y.push_back(source.position.y);
+                m_combined.z.push_back(source.position.z);
+                m_combined.mass.push_back(source.mass);
+                m_stats.imported++;
+            }
+        }
+
+        m_tree.build(root.min, root.max, m_combined, Oct::Build_mode::morton, m_thread_pool);
+        m_stats.tree_time += solver::seconds_since(sw_start);
+        return true;
+    }
+
+    /// Accelerations of this rank's bodies from the group walk over the combined tree.
+    void evaluate() noexcept
+    {
+        std::span<std::uint32_t const> const order{m_tree.order()};
+        std::span<Oct::Group const> const groups{m_tree.groups()};
+        std::size_t const owned{m_owned.size()};
+        std::atomic<std::uint64_t> interaction_count{0};
+
+        /// Bodies that fell outside of the tree feel nothing.
+        if (order.size() != m_combined.size()) {
+            std::fill(m_owned.ax.begin(), m_owned.ax.end(), 0.f);
+            std::fill(m_owned.ay.begin(), m_owned.ay.end(), 0.f);
+            std::fill(m_owned.az.begin(), m_owned.az.end(), 0.f);
+        }
+
+        sal::parallel_for(
+            m_thread_pool, groups.size(),
+            [&](std::size_t const begin, std::size_t const end) {
+                kernels::Interaction_list list;
+                kernels::Quadrupole_list far;
+                list.reserve(solver::interaction_list_capacity);
+                std::uint64_t chunk_interactions{0};
+
+                for (std::size_t g{begin}; g < end; g++) {
+                    Oct::Group const& group{groups[g]};
+
+                    std::uint32_t owned_count{0};
+                    for (std::uint32_t body{group.first_body};
+                         body < group.first_body + group.body_count; body++) {
+                        owned_count += (order[body] < owned);
+                    }
+                    if (owned_count == 0) {
+                        continue;
+                    }
+
+                    /// Monopoles only, far stays empty.
+                    m_tree.interactions(group, list, far);
+                    chunk_interactions += list.size() * owned_count;
+
+                    for (std::uint32_t body{group.first_body};
+                         body < group.first_body + group.body_count; body++) {
+                        std::uint32_t const p{order[body]};
+                        if (p >= owned) {
+                            continue;
+                        }
+
+                        glm::vec3 const a{m_kernel(m_tree.position(body), list)};
+                        m_owned.ax[p] = a.x;
+                        m_owned.ay[p] = a.y;
+                        m_owned.az[p] = a.z;
+                        m_work[p] = static_cast<float>(list.size());
+                    }
+                }
+
+                interaction_count += chunk_interactions;
+            },
+            solver::min_groups_per_job);
+
+        m_stats.interactions += interaction_count.load();
+    }
+
+    std::size_t m_rank{0};
+    int m_coordinator{-1};
+    /// Socket to every other rank, -1 for this one.
+    std::vector<int> m_peers;
+
+    sal::Job_pool m_thread_pool;
+    kernels::Kernel m_kernel{nullptr};
+
+    Particles m_owned;
+    /// Interactions of every owned body in the last step.
+    std::vector<float> m_work;
+    std::vector<std::uint32_t> m_buckets;
+    std::vector<double> m_histogram;
+
+    /// Owned bodies followed by the imported sources, positions and masses only.
+    Particles m_combined;
+    Oct m_tree;
+    std::vector<std::vector<std::byte>> m_incoming;
+
+    Rank_stats m_stats{};
+};
+
+#endif
+
+} // namespace
+
+void add(Rank_stats& total, Rank_stats const& later) noexcept
+{
+    total.body_count = later.body_count;
+    total.migrated += later.migrated;
+    total.imported += later.imported;
+    total.interactions += later.interactions;
+    total.integrate_time += later.integrate_time;
+    total.tree_time += later.tree_time;
+    total.force_time += later.force_time;
+    total.exchange_time += later.exchange_time;
+}
+
+Coordinator::~Coordinator() noexcept
+{
+    stop();
+}
+
+bool Coordinator::start(std::size_t const rank_count, std::size_t const threads_per_rank) noexcept
+{
+#if defined(_WIN32)
+    (void)rank_count;
+    (void)threads_per_rank;
+    return false;
+#else
+    stop();
+    if (rank_count == 0) {
+        return false;
+    }
+
+    /// Every socket is made up front, so every rank inherits the ones it needs.
+    std::vector<std::array<int, 2>> coordinator_pairs(rank_count, {-1, -1});
+    std::vector<std::vector<int>> peers(rank_count, std::vector<int>(rank_count, -1));
+    auto const close_all = [&]() {
+        for (std::array<int, 2> const& pair : coordinator_pairs) {
+            for (int const fd : pair) {
+                if (fd >= 0) {
+                    ::close(fd);
+                }
+            }
+        }
+        for (std::vector<int> const& row : peers) {
+            for (int const fd : row) {
+                if (fd >= 0) {
+                    ::close(fd);
+                }
+            }
+        }
+    };
+
+    bool made{true};
+    for (std::size_t r{0}; r < rank_count && made; r++) {
+        made = socketpair(AF_UNIX, SOCK_STREAM, 0, coordinator_pairs[r].data()) == 0;
+        for (std::size_t s{r + 1}; s < rank_count && made; s++) {
+            std::array<int, 2> pair{-1, -1};
+            made = socketpair(AF_UNIX, SOCK_STREAM, 0, pair.data()) == 0;
+            peers[r][s] = pair[0];
+            peers[s][r] = pair[1];
+        }
+    }
+    if (!made) {
+        close_all();
+        return false;
+    }
+
+    /// Output still buffered in stdio would be written again by every rank that exits through it.
+    std::fflush(nullptr);
+
+    for (std::size_t r{0}; r < rank_count; r++) {
+        pid_t const process{fork()};
+        if (process == 0) {
+            int const coordinator{std::exchange(coordinator_pairs[r][1], -1)};
+            std::vector<int> own{peers[r]};
+            std::fill(peers[r].begin(), peers[r].end(), -1);
+            close_all();
+            for (int const socket : m_sockets) {
+                ::close(socket);
+            }
+
+            Worker{r, coordinator, std::move(own), threads_per_rank}.run();
+            _exit(0);
+        }
+
+        if (process < 0) {
+            close_all();
+            stop();
+            return false;
+        }
+
+        m_sockets.push_back(std::exchange(coordinator_pairs[r][0], -1));
+        m_processes.push_back(process);
+    }
+
+    close_all();
+    m_last_step.assign(rank_count, {});
+    m_evaluated = false;
+    return true;
+#endif
+}
+
+void Coordinator::stop() noexcept
+{
+#if !defined(_WIN32)
+    for (int const socket : m_sockets) {
+        send_value(socket, Command_message{Command::quit});
+        ::close(socket);
+    }
+    for (int const process : m_processes) {
+        waitpid(process, nullptr, 0);
+    }
+#endif
+    m_sockets.clear();
+    m_processes.clear();
+    m_last_step.clear();
+}
+
+bool Coordinator::is_running() const noexcept
+{
+    return !m_sockets.empty();
+}
+
+std::size_t Coordinator::rank_count() const noexcept
+{
+    return m_sockets.size();
+}
+
+bool Coordinator::scatter(Particles const& particles) noexcept
+{
+#if defined(_WIN32)
+    (void)particles;
+    return false;
+#else
+    std::vector<float> const work(particles.size(), default_work);
+    std::vector<Body> bodies;
+    for (std::size_t r{0}; r < m_sockets.size(); r++) {
+        std::size_t const first{particles.size() * r / m_sockets.size()};
+        std::size_t const last{particles.size() * (r + 1) / m_sockets.size()};
+        bodies.clear();
+        for (std::size_t i{first}; i < last; i++) {
+            bodies.push_back(body_of(particles, work, i));
+        }
+
+        if (!send_value(m_sockets[r], Command_message{Command::scatter})
+            || !send(m_sockets[r], std::span<Body const>{bodies})) {
+            return false;
+        }
+    }
+
+    m_evaluated = false;
+    return true;
+#endif
+}
+
+bool Coordinator::step(float const dt) noexcept
+{
+    std::chrono::high_resolution_clock::time_point const sw_start{
+        std::chrono::high_resolution_clock::now()};
+    m_last_step.assign(m_sockets.size(), {});
+
+    /// The first kick needs the accelerations of the starting positions.
+    if (!m_evaluated) {
+        if (!run_phase(0.f, 0.f, 0.f)) {
+            return false;
+        }
+        m_evaluated = true;
+    }
+
+    bool const stepped{run_phase(dt / 2.f, dt, dt / 2.f)};
+    m_last_step_time = solver::seconds_since(sw_start);
+    return stepped;
+}
+
+std::span<Rank_stats const> Coordinator::last_step() const noexcept
+{
+    return m_last_step;
+}
+
+float Coordinator::last_step_time() const noexcept
+{
+    return m_last_step_time;
+}
+
+bool Coordinator::gather(Particles& out) noexcept
+{
+#if defined(_WIN32)
+    (void)out;
+    return false;
+#else
+    out.clear();
+    std::vector<float> work;
+    std::vector<Body> bodies;
+    for (int const socket : m_sockets) {
+        if (!send_value(socket, Command_message{Command::gather}) || !receive(socket, bodies)) {
+            return false;
+        }
+        append(out, work, bodies);
+    }
+    return true;
+#endif
+}
+
+
+///
+/// Private section:
+///
+bool Coordinator::run_phase(float const kick_before,
+                            float const drift,
+                            float const kick_after) noexcept
+{
+#if defined(_WIN32)
+    (void)kick_before;
+    (void)drift;
+    (void)kick_after;
+    return false;
+#else
+    std::size_t const rank_count{m_sockets.size()};
+    Command_message const command{Command::step, kick_before, drift, kick_after};
+    for (int const socket : m_sockets) {
+        if (!send_value(socket, command)) {
+            return false;
+        }
+    }
+
+    /// One root for every rank, so their trees are parts of one tree.
+    Box bounds;
+    for (int const socket : m_sockets) {
+        Box rank_bounds;
+        if (!receive_value(socket, rank_bounds)) {
+            return false;
+        }
+        bounds.add(rank_bounds);
+    }
+    Oct::Box const cube{Oct::root_cube({bounds.min, bounds.max})};
+    Box const root{cube.min, cube.max};
+    for (int const socket : m_sockets) {
+        if (!send_value(socket, root)) {
+            return false;
+        }
+    }
+
+    /// Rank r takes the buckets from splitters[r] to splitters[r + 1], cut where the work of the
+    /// ranks before it reaches its share.
+    std::vector<double> work(bucket_count, 0.0);
+    std::vector<double> rank_work;
+    for (int const socket : m_sockets) {
+        if (!receive(socket, rank_work) || rank_work.size() != bucket_count) {
+            return false;
+        }
+        for (std::size_t b{0}; b < bucket_count; b++) {
+            work[b] += rank_work[b];
+        }
+    }
+
+    double total{0.0};
+    for (double const w : work) {
+        total += w;
+    }
+    std::vector<std::uint32_t> splitters(rank_count + 1, static_cast<std::uint32_t>(bucket_count));
+    splitters.front() = 0;
+    std::size_t next{1};
+    double cumulative{0.0};
+    double const share{total / static_cast<double>(rank_count)};
+    for (std::size_t b{0}; b < bucket_count && next < rank_count; b++) {
+        while (next < rank_count && cumulative >= share * static_cast<double>(next)) {
+            splitters[next++] = static_cast<std::uint32_t>(b);
+        }
+        cumulative += work[b];
+    }
+    for (int const socket : m_sockets) {
+        if (!send(socket, std::span<std::uint32_t const>{splitters})) {
+            return false;
+        }
+    }
+
+    /// Every rank needs every other rank's domain to cut its essential trees.
+    std::vector<Box> domains(rank_count);
+    for (std::size_t r{0}; r < rank_count; r++) {
+        if (!receive_value(m_sockets[r], domains[r])) {
+            return false;
+        }
+    }
+    for (int const socket : m_sockets) {
+        if (!send(socket, std::span<Box const>{domains})) {
+            return false;
+        }
+    }
+
+    for (std::size_t r{0}; r < rank_count; r++) {
+        Rank_stats stats;
+        if (!receive_value(m_sockets[r], stats)) {
+            return false;
+        }
+        add(m_last_step[r], stats);
+    }
+    return true;
+#endif
+}
+
+} // namespace distributed
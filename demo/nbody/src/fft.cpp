@@ -0,0 +1,167 @@
+/*
+ * Copyright (c) https://github.com/kaapomoi 2023.
+ */
+
+#include "fft.h"
+
+#include <algorithm>
+#include <numbers>
+#include <utility>
+
+namespace fft {
+
+namespace {
+
+/// Below this many lines a job costs more to hand out than the lines take to transform.
+constexpr std::size_t min_lines_per_job{16};
+
+/// Lines along y and z are copied out this many neighbours at a time, so that every cache line
+/// read from the cube is used whole.
+constexpr std::size_t lines_per_copy{8};
+
+enum class Axis : std::size_t { x = 0, y = 1, z = 2 };
+
+///
+/// \brief Transforms the lines of the cube along one axis.
+///
+/// Lines along x are limited to y, z < extent, lines along y to z < extent, lines along z are all
+/// transformed. That covers every non-zero line forward and every line read afterwards inverse.
+///
+void transform_axis(Plan const& plan,
+                    std::span<std::complex<double>> const cube,
+                    Direction const direction,
+                    std::size_t const extent,
+                    Axis const axis,
+                    sal::Job_pool& pool) noexcept
+{
+    std::size_t const n{plan.size()};
+
+    if (axis == Axis::x) {
+        sal::parallel_for(
+            pool, extent * extent,
+            [&](std::size_t const begin, std::size_t const end) {
+                for (std::size_t l{begin}; l < end; l++) {
+                    std::size_t const start{((l / extent) * n + l % extent) * n};
+                    plan.transform(cube.subspan(start, n), direction);
+                }
+            },
+            min_lines_per_job);
+        return;
+    }
+
+    /// Lines along y and z start at consecutive x, a copy takes lines_per_copy of them.
+    std::size_t const block{std::min(lines_per_copy, n)};
+    std::size_t const copies_per_row{n / block};
+    std::size_t const copy_count{((axis == Axis::y) ? extent : n) * copies_per_row};
+    std::size_t const stride{(axis == Axis::y) ? n : n * n};
+
+    sal::parallel_for(
+        pool, copy_count,
+        [&](std::size_t const begin, std::size_t const end) {
+            std::vector<std::complex<double>> lines(block * n);
+
+            for (std::size_t c{begin}; c < end; c++) {
+                std::size_t const row{c / copies_per_row};
+                std::size_t const x{(c % copies_per_row) * block};
+                std::size_t const start{((axis == Axis::y) ? row * n * n : row * n) + x};
+
+                for (std::size_t i{0}; i < n; i++) {
+                    for (std::size_t b{0}; b < block; b++) {
+                        lines[b * n + i] = cube[start + i * stride + b];
+                    }
+                }
+                for (std::size_t b{0}; b < block; b++) {
+                    plan.transform(std::span{lines}.subspan(b * n, n), direction);
+                }
+                for (std::size_t i{0}; i < n; i++) {
+                    for (std::size_t b{0}; b < block; b++) {
+                        cube[start + i * stride + b] = lines[b * n + i];
+                    }
+                }
+            }
+        },
+        std::max<std::size_t>(1, min_lines_per_job / block));
+}
+
+} // namespace
+
+Plan::Plan(std::size_t const n) noexcept : m_size{n}, m_twiddles(n / 2), m_reversed(n)
+{
+    for (std::size_t k{0}; k < n / 2; k++) {
+        m_twiddles[k] = std::polar(1.0, -2.0 * std::numbers::pi * static_cast<double>(k)
+                                            / static_cast<double>(n));
+    }
+
+    std::size_t bits{0};
+    while ((std::size_t{1} << bits) < n) {
+        bits++;
+    }
+    for (std::size_t i{0}; i < n; i++) {
+        std::uint32_t reversed{0};
+        for (std::size_t b{0}; b < bits; b++) {
+            reversed |= ((i >> b) & 1u) << (bits - 1 - b);
+        }
+        m_reversed[i] = reversed;
+    }
+}
+
+std::size_t Plan::size() const noexcept
+{
+    return m_size;
+}
+
+void Plan::transform(std::span<std::complex<double>> const line,
+                     Direction const direction) const noexcept
+{
+    for (std::size_t i{0}; i < m_size; i++) {
+        if (i < m_reversed[i]) {
+            std::swap(line[i], line[m_reversed[i]]);
+        }
+    }
+
+    /// The butterflies are written out on the real and imaginary parts. std::complex's operator*
+    /// checks for inf and NaN on every call, and building temporaries of it stalls on store
+    /// forwarding.
+    double const sign{(direction == Direction::forward) ? 1.0 : -1.0};
+    for (std::size_t half{1}; half < m_size; half *= 2) {
+        std::size_t const step{m_size / (2 * half)};
+        for (std::size_t begin{0}; begin < m_size; begin += 2 * half) {
+            for (std::size_t k{0}; k < half; k++) {
+                double const wr{m_twiddles[k * step].real()};
+                double const wi{sign * m_twiddles[k * step].imag()};
+
+                std::complex<double>& even{line[begin + k]};
+                std::complex<double>& odd{line[begin + k + half]};
+                double const er{even.real()};
+                double const ei{even.imag()};
+                double const tr{odd.real() * wr - odd.imag() * wi};
+                double const ti{odd.real() * wi + odd.imag() * wr};
+
+                odd.real(er - tr);
+                odd.imag(ei - ti);
+                even.real(er + tr);
+                even.imag(ei + ti);
+            }
+        }
+    }
+}
+
+void transform(Plan const& plan,
+               std::span<std::complex<double>> const cube,
+               Direction const direction,
+               std::size_t const extent,
+               sal::Job_pool& pool) noexcept
+{
+    if (direction == Direction::forward) {
+        transform_axis(plan, cube, direction, extent, Axis::x, pool);
+        transform_axis(plan, cube, direction, extent, Axis::y, pool);
+        transform_axis(plan, cube, direction, extent, Axis::z, pool);
+    }
+    else {
+        transform_axis(plan, cube, direction, extent, Axis::z, pool);
+        transform_axis(plan, cube, direction, extent, Axis::y, pool);
+        transform_axis(plan, cube, direction, extent, Axis::x, pool);
+    }
+}
+
+} // namespace fft
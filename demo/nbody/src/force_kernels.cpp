@@ -0,0 +1,1013 @@
+/*
+ * Copyright (c) https://github.com/kaapomoi 2023.
+ */
+
+#include "force_kernels.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define NBODY_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+#if defined(NBODY_X86_KERNELS) && defined(_MSC_VER)
+#include <intrin.h>
+#define NBODY_TARGET(isa)
+#elif defined(NBODY_X86_KERNELS)
+#define NBODY_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+#include <array>
+#include <cmath>
+
+namespace kernels {
+
+namespace {
+
+constexpr float eps2{eps * eps};
+
+///
+/// \brief Running sum of one axis in the given precision.
+///
+/// Used by the scalar kernels and for the remainders of the vector ones.
+///
+template<Precision P>
+struct Sum {
+    float value{0.f};
+    /// Low order bits lost by value so far, negated.
+    float compensation{0.f};
+    double wide{0.0};
+
+    void add(float const term) noexcept
+    {
+        if constexpr (P == Precision::single) {
+            value += term;
+        }
+        else if constexpr (P == Precision::compensated) {
+            float const y{term - compensation};
+            float const t{value + y};
+            compensation = (t - value) - y;
+            value = t;
+        }
+        else {
+            wide += term;
+        }
+    }
+
+    double total() const noexcept
+    {
+        if constexpr (P == Precision::double_sum) {
+            return wide;
+        }
+        return static_cast<double>(value) - compensation;
+    }
+};
+
+template<Precision P>
+using Sum3 = std::array<Sum<P>, 3>;
+
+/// Scales the summed lanes and remainder by -G, the only step done in double for every precision.
+template<Precision P>
+glm::vec3 acceleration(Sum3<P> const& sum, glm::dvec3 const& lanes) noexcept
+{
+    glm::dvec3 const total{lanes
+                           + glm::dvec3{sum[0].total(), sum[1].total(), sum[2].total()}};
+    return glm::vec3{total * -G};
+}
+
+/// Adds the contribution of sources [begin, end) one at a time. Also finishes the vector kernels.
+template<Precision P>
+void accumulate_scalar(glm::vec3 const& target,
+                       Interaction_list const& sources,
+                       std::size_t const begin,
+                       Sum3<P>& sum) noexcept
+{
+    for (std::size_t j{begin}; j < sources.size(); j++) {
+        float const dx{target.x - sources.x[j]};
+        float const dy{target.y - sources.y[j]};
+        float const dz{target.z - sources.z[j]};
+        float const r2{dx * dx + dy * dy + dz * dz};
+        if (r2 > 0.f) {
+            float const s{sources.mass[j] / (std::sqrt(r2) * (r2 + eps2))};
+            sum[0].add(s * dx);
+            sum[1].add(s * dy);
+            sum[2].add(s * dz);
+        }
+    }
+}
+
+template<Precision P>
+glm::vec3 kernel_scalar(glm::vec3 const& target, Interaction_list const& sources)
+{
+    Sum3<P> sum{};
+    accumulate_scalar(target, sources, 0, sum);
+    return acceleration(sum, glm::dvec3{0.0});
+}
+
+/// Short-range counterpart of accumulate_scalar.
+template<Precision P>
+void accumulate_short_range_scalar(glm::vec3 const& target,
+                                   Interaction_list const& sources,
+                                   Split_table const& split,
+                                   std::size_t const begin,
+                                   Sum3<P>& sum) noexcept
+{
+    for (std::size_t j{begin}; j < sources.size(); j++) {
+        float const dx{target.x - sources.x[j]};
+        float const dy{target.y - sources.y[j]};
+        float const dz{target.z - sources.z[j]};
+        float const r2{dx * dx + dy * dy + dz * dz};
+        float const r{std::sqrt(r2)};
+        float const t{r * split.scale};
+        if ((r2 > 0.f) && (t < static_cast<float>(Split_table::size))) {
+            std::size_t const i{static_cast<std::size_t>(t)};
+            float const f{t - static_cast<float>(i)};
+            float const factor{split.factor[i] + f * (split.factor[i + 1] - split.factor[i])};
+            float const s{sources.mass[j] * factor / (r * (r2 + eps2))};
+            sum[0].add(s * dx);
+            sum[1].add(s * dy);
+            sum[2].add(s * dz);
+        }
+    }
+}
+
+template<Precision P>
+glm::vec3 short_range_scalar(glm::vec3 const& target,
+                             Interaction_list const& sources,
+                             Split_table const& split)
+{
+    Sum3<P> sum{};
+    accumulate_short_range_scalar(target, sources, split, 0, sum);
+    return acceleration(sum, glm::dvec3{0.0});
+}
+
+/// Quadrupole counterpart of accumulate_scalar.
+template<Precision P>
+void accumulate_quadrupole_scalar(glm::vec3 const& target,
+                                  Quadrupole_list const& sources,
+                                  std::size_t const begin,
+                                  Sum3<P>& sum) noexcept
+{
+    for (std::size_t j{begin}; j < sources.size(); j++) {
+        float const dx{target.x - sources.x[j]};
+        float const dy{target.y - sources.y[j]};
+        float const dz{target.z - sources.z[j]};
+        float const r2{dx * dx + dy * dy + dz * dz};
+        float const inv_r{1.f / std::sqrt(r2)};
+        float const inv_r2{inv_r * inv_r};
+        float const inv_e{1.f / (r2 + eps2)};
+
+        /// -g2 and g3 of the softened law. Multiplied in this order so that nothing underflows
+        /// for distant cells.
+        float const g2{(3.f * r2 + eps2) * inv_e * inv_e * inv_r2 * inv_r};
+        float const g3{(15.f * r2 * r2 + 10.f * r2 * eps2 + 3.f * eps2 * eps2) * inv_e * inv_e
+                       * inv_e * inv_r2 * inv_r2 * inv_r};
+
+        /// M * r, r . M * r and the trace of M.
+        float const mx{sources.xx[j] * dx + sources.xy[j] * dy + sources.xz[j] * dz};
+        float const my{sources.xy[j] * dx + sources.yy[j] * dy + sources.yz[j] * dz};
+        float const mz{sources.xz[j] * dx + sources.yz[j] * dy + sources.zz[j] * dz};
+        float const rmr{dx * mx + dy * my + dz * mz};
+        float const trace{sources.xx[j] + sources.yy[j] + sources.zz[j]};
+
+        float const radial{sources.mass[j] * inv_r * inv_e + 0.5f * (g3 * rmr - g2 * trace)};
+
+        sum[0].add(radial * dx - g2 * mx);
+        sum[1].add(radial * dy - g2 * my);
+        sum[2].add(radial * dz - g2 * mz);
+    }
+}
+
+template<Precision P>
+glm::vec3 quadrupole_scalar(glm::vec3 const& target, Quadrupole_list const& sources)
+{
+    Sum3<P> sum{};
+    accumulate_quadrupole_scalar(target, sources, 0, sum);
+    return acceleration(sum, glm::dvec3{0.0});
+}
+
+#if defined(NBODY_X86_KERNELS)
+
+NBODY_TARGET("avx2,fma")
+float horizontal_sum(__m256 const v) noexcept
+{
+    __m128 sum{_mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1))};
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum = _mm_add_ss(sum, _mm_movehdup_ps(sum));
+    return _mm_cvtss_f32(sum);
+}
+
+NBODY_TARGET("avx2,fma")
+double horizontal_sum(__m256d const v) noexcept
+{
+    __m128d const sum{_mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1))};
+    return _mm_cvtsd_f64(_mm_add_sd(sum, _mm_unpackhi_pd(sum, sum)));
+}
+
+/// Lower and upper four lanes converted to double.
+NBODY_TARGET("avx2,fma")
+__m256d widen_low(__m256 const v) noexcept
+{
+    return _mm256_cvtps_pd(_mm256_castps256_ps128(v));
+}
+
+NBODY_TARGET("avx2,fma")
+__m256d widen_high(__m256 const v) noexcept
+{
+    return _mm256_cvtps_pd(_mm256_extractf128_ps(v, 1));
+}
+
+/// Vector counterpart of Sum, one running sum per lane. Only the members of the precision are
+/// used.
+struct Lanes_avx2 {
+    __m256 value;
+    __m256 compensation;
+    __m256d low;
+    __m256d high;
+};
+
+NBODY_TARGET("avx2,fma")
+Lanes_avx2 zero_avx2() noexcept
+{
+    return {_mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_pd(), _mm256_setzero_pd()};
+}
+
+template<Precision P>
+NBODY_TARGET("avx2,fma")
+void add(Lanes_avx2& lanes, __m256 const term) noexcept
+{
+    if constexpr (P == Precision::single) {
+        lanes.value = _mm256_add_ps(lanes.value, term);
+    }
+    else if constexpr (P == Precision::compensated) {
+        __m256 const y{_mm256_sub_ps(term, lanes.compensation)};
+        __m256 const t{_mm256_add_ps(lanes.value, y)};
+        lanes.compensation = _mm256_sub_ps(_mm256_sub_ps(t, lanes.value), y);
+        lanes.value = t;
+    }
+    else {
+        lanes.low = _mm256_add_pd(lanes.low, widen_low(term));
+        lanes.high = _mm256_add_pd(lanes.high, widen_high(term));
+    }
+}
+
+/// lanes += a * b, fused when the sum is kept in float anyway.
+template<Precision P>
+NBODY_TARGET("avx2,fma")
+void add_product(Lanes_avx2& lanes, __m256 const a, __m256 const b) noexcept
+{
+    if constexpr (P == Precision::single) {
+        lanes.value = _mm256_fmadd_ps(a, b, lanes.value);
+    }
+    else {
+        add<P>(lanes, _mm256_mul_ps(a, b));
+    }
+}
+
+template<Precision P>
+NBODY_TARGET("avx2,fma")
+double total(Lanes_avx2 const& lanes) noexcept
+{
+    if constexpr (P == Precision::single) {
+        return horizontal_sum(lanes.value);
+    }
+    else if constexpr (P == Precision::compensated) {
+        return horizontal_sum(
+            _mm256_add_pd(_mm256_sub_pd(widen_low(lanes.value), widen_low(lanes.compensation)),
+                          _mm256_sub_pd(widen_high(lanes.value), widen_high(lanes.compensation))));
+    }
+    else {
+        return horizontal_sum(_mm256_add_pd(lanes.low, lanes.high));
+    }
+}
+
+/// 8 sources per iteration. rsqrt and rcp are refined with one Newton-Raphson step each, which
+/// brings them from 12 to about 22 bits.
+template<Precision P>
+NBODY_TARGET("avx2,fma")
+glm::vec3 kernel_avx2(glm::vec3 const& target, Interaction_list const& sources)
+{
+    static constexpr std::size_t width{8};
+
+    __m256 const tx{_mm256_set1_ps(target.x)};
+    __m256 const ty{_mm256_set1_ps(target.y)};
+    __m256 const tz{_mm256_set1_ps(target.z)};
+    __m256 const soft{_mm256_set1_ps(eps2)};
+    __m256 const half{_mm256_set1_ps(0.5f)};
+    __m256 const three_halves{_mm256_set1_ps(1.5f)};
+    __m256 const two{_mm256_set1_ps(2.f)};
+    __m256 const zero{_mm256_setzero_ps()};
+
+    Lanes_avx2 ax{zero_avx2()};
+    Lanes_avx2 ay{zero_avx2()};
+    Lanes_avx2 az{zero_avx2()};
+
+    std::size_t const n{sources.size() - sources.size() % width};
+    for (std::size_t j{0}; j < n; j += width) {
+        __m256 const dx{_mm256_sub_ps(tx, _mm256_load_ps(&sources.x[j]))};
+        __m256 const dy{_mm256_sub_ps(ty, _mm256_load_ps(&sources.y[j]))};
+        __m256 const dz{_mm256_sub_ps(tz, _mm256_load_ps(&sources.z[j]))};
+        __m256 const m{_mm256_load_ps(&sources.mass[j])};
+
+        __m256 const r2{_mm256_fmadd_ps(dx, dx, _mm256_fmadd_ps(dy, dy, _mm256_mul_ps(dz, dz)))};
+
+        __m256 inv_r{_mm256_rsqrt_ps(r2)};
+        inv_r = _mm256_mul_ps(
+            inv_r,
+            _mm256_fnmadd_ps(_mm256_mul_ps(half, r2), _mm256_mul_ps(inv_r, inv_r), three_halves));
+
+        __m256 const denominator{_mm256_add_ps(r2, soft)};
+        __m256 inv_denominator{_mm256_rcp_ps(denominator)};
+        inv_denominator = _mm256_mul_ps(
+            inv_denominator, _mm256_fnmadd_ps(denominator, inv_denominator, two));
+
+        /// r2 == 0 is the target itself, its inf / NaN lanes are dropped by the mask.
+        __m256 const self{_mm256_cmp_ps(r2, zero, _CMP_GT_OQ)};
+        __m256 const s{
+            _mm256_and_ps(_mm256_mul_ps(m, _mm256_mul_ps(inv_r, inv_denominator)), self)};
+
+        add_product<P>(ax, s, dx);
+        add_product<P>(ay, s, dy);
+        add_product<P>(az, s, dz);
+    }
+
+    Sum3<P> sum{};
+    accumulate_scalar(target, sources, n, sum);
+    return acceleration(sum, glm::dvec3{total<P>(ax), total<P>(ay), total<P>(az)});
+}
+
+/// AVX-512 counterpart of Lanes_avx2.
+struct Lanes_avx512 {
+    __m512 value;
+    __m512 compensation;
+    __m512d low;
+    __m512d high;
+};
+
+NBODY_TARGET("avx512f")
+Lanes_avx512 zero_avx512() noexcept
+{
+    return {_mm512_setzero_ps(), _mm512_setzero_ps(), _mm512_setzero_pd(), _mm512_setzero_pd()};
+}
+
+NBODY_TARGET("avx512f")
+__m256 upper_half(__m512 const v) noexcept
+{
+    return _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(v), 1));
+}
+
+template<Precision P>
+NBODY_TARGET("avx512f")
+void add(Lanes_avx512& lanes, __m512 const term) noexcept
+{
+    if constexpr (P == Precision::single) {
+        lanes.value = _mm512_add_ps(lanes.value, term);
+    }
+    else if constexpr (P == Precision::compensated) {
+        __m512 const y{_mm512_sub_ps(term, lanes.compensation)};
+        __m512 const t{_mm512_add_ps(lanes.value, y)};
+        lanes.compensation = _mm512_sub_ps(_mm512_sub_ps(t, lanes.value), y);
+        lanes.value = t;
+    }
+    else {
+        lanes.low = _mm512_add_pd(lanes.low, _mm512_cvtps_pd(_mm512_castps512_ps256(term)));
+        lanes.high = _mm512_add_pd(lanes.high, _mm512_cvtps_pd(upper_half(term)));
+    }
+}
+
+template<Precision P>
+NBODY_TARGET("avx512f")
+void add_product(Lanes_avx512& lanes, __m512 const a, __m512 const b) noexcept
+{
+    if constexpr (P == Precision::single) {
+        lanes.value = _mm512_fmadd_ps(a, b, lanes.value);
+    }
+    else {
+        add<P>(lanes, _mm512_mul_ps(a, b));
+    }
+}
+
+template<Precision P>
+NBODY_TARGET("avx512f")
+double total(Lanes_avx512 const& lanes) noexcept
+{
+    if constexpr (P == Precision::single) {
+        return _mm512_reduce_add_ps(lanes.value);
+    }
+    else if constexpr (P == Precision::compensated) {
+        __m512d const low{
+            _mm512_sub_pd(_mm512_cvtps_pd(_mm512_castps512_ps256(lanes.value)),
+                          _mm512_cvtps_pd(_mm512_castps512_ps256(lanes.compensation)))};
+        __m512d const high{_mm512_sub_pd(_mm512_cvtps_pd(upper_half(lanes.value)),
+                                         _mm512_cvtps_pd(upper_half(lanes.compensation)))};
+        return _mm512_reduce_add_pd(_mm512_add_pd(low, high));
+    }
+    else {
+        return _mm512_reduce_add_pd(_mm512_add_pd(lanes.low, lanes.high));
+    }
+}
+
+/// 16 sources per iteration, rsqrt14 and rcp14 need a single Newton-Raphson step for ~23 bits.
+template<Precision P>
+NBODY_TARGET("avx512f")
+glm::vec3 kernel_avx512(glm::vec3 const& target, Interaction_list const& sources)
+{
+    static constexpr std::size_t width{16};
+
+    __m512 const tx{_mm512_set1_ps(target.x)};
+    __m512 const ty{_mm512_set1_ps(target.y)};
+    __m512 const tz{_mm512_set1_ps(target.z)};
+    __m512 const soft{_mm512_set1_ps(eps2)};
+    __m512 const half{_mm512_set1_ps(0.5f)};
+    __m512 const three_halves{_mm512_set1_ps(1.5f)};
+    __m512 const two{_mm512_set1_ps(2.f)};
+    __m512 const zero{_mm512_setzero_ps()};
+
+    Lanes_avx512 ax{zero_avx512()};
+    Lanes_avx512 ay{zero_avx512()};
+    Lanes_avx512 az{zero_avx512()};
+
+    std::size_t const n{sources.size() - sources.size() % width};
+    for (std::size_t j{0}; j < n; j += width) {
+        __m512 const dx{_mm512_sub_ps(tx, _mm512_load_ps(&sources.x[j]))};
+        __m512 const dy{_mm512_sub_ps(ty, _mm512_load_ps(&sources.y[j]))};
+        __m512 const dz{_mm512_sub_ps(tz, _mm512_load_ps(&sources.z[j]))};
+        __m512 const m{_mm512_load_ps(&sources.mass[j])};
+
+        __m512 const r2{_mm512_fmadd_ps(dx, dx, _mm512_fmadd_ps(dy, dy, _mm512_mul_ps(dz, dz)))};
+
+        __m512 inv_r{_mm512_rsqrt14_ps(r2)};
+        inv_r = _mm512_mul_ps(
+            inv_r,
+            _mm512_fnmadd_ps(_mm512_mul_ps(half, r2), _mm512_mul_ps(inv_r, inv_r), three_halves));
+
+        __m512 const denominator{_mm512_add_ps(r2, soft)};
+        __m512 inv_denominator{_mm512_rcp14_ps(denominator)};
+        inv_denominator = _mm512_mul_ps(
+            inv_denominator, _mm512_fnmadd_ps(denominator, inv_denominator, two));
+
+        /// r2 == 0 is the target itself, its lanes are zeroed before the accumulation.
+        __mmask16 const others{_mm512_cmp_ps_mask(r2, zero, _CMP_GT_OQ)};
+        __m512 const s{_mm512_maskz_mul_ps(others, m, _mm512_mul_ps(inv_r, inv_denominator))};
+
+        add_product<P>(ax, s, dx);
+        add_product<P>(ay, s, dy);
+        add_product<P>(az, s, dz);
+    }
+
+    Sum3<P> sum{};
+    accumulate_scalar(target, sources, n, sum);
+    return acceleration(sum, glm::dvec3{total<P>(ax), total<P>(ay), total<P>(az)});
+}
+
+/// kernel_avx2 with the split's factor gathered for each lane. Lanes past the cutoff gather the
+/// last sample and are masked out with the target itself.
+template<Precision P>
+NBODY_TARGET("avx2,fma")
+glm::vec3 short_range_avx2(glm::vec3 const& target,
+                           Interaction_list const& sources,
+                           Split_table const& split)
+{
+    static constexpr std::size_t width{8};
+
+    __m256 const tx{_mm256_set1_ps(target.x)};
+    __m256 const ty{_mm256_set1_ps(target.y)};
+    __m256 const tz{_mm256_set1_ps(target.z)};
+    __m256 const soft{_mm256_set1_ps(eps2)};
+    __m256 const half{_mm256_set1_ps(0.5f)};
+    __m256 const three_halves{_mm256_set1_ps(1.5f)};
+    __m256 const two{_mm256_set1_ps(2.f)};
+    __m256 const zero{_mm256_setzero_ps()};
+    __m256 const scale{_mm256_set1_ps(split.scale)};
+    __m256 const samples{_mm256_set1_ps(static_cast<float>(Split_table::size))};
+    __m256 const last{_mm256_set1_ps(static_cast<float>(Split_table::size - 1))};
+
+    Lanes_avx2 ax{zero_avx2()};
+    Lanes_avx2 ay{zero_avx2()};
+    Lanes_avx2 az{zero_avx2()};
+
+    std::size_t const n{sources.size() - sources.size() % width};
+    for (std::size_t j{0}; j < n; j += width) {
+        __m256 const dx{_mm256_sub_ps(tx, _mm256_load_ps(&sources.x[j]))};
+        __m256 const dy{_mm256_sub_ps(ty, _mm256_load_ps(&sources.y[j]))};
+        __m256 const dz{_mm256_sub_ps(tz, _mm256_load_ps(&sources.z[j]))};
+        __m256 const m{_mm256_load_ps(&sources.mass[j])};
+
+        __m256 const r2{_mm256_fmadd_ps(dx, dx, _mm256_fmadd_ps(dy, dy, _mm256_mul_ps(dz, dz)))};
+
+        __m256 inv_r{_mm256_rsqrt_ps(r2)};
+        inv_r = _mm256_mul_ps(
+            inv_r,
+            _mm256_fnmadd_ps(_mm256_mul_ps(half, r2), _mm256_mul_ps(inv_r, inv_r), three_halves));
+
+        __m256 const denominator{_mm256_add_ps(r2, soft)};
+        __m256 inv_denominator{_mm256_rcp_ps(denominator)};
+        inv_denominator = _mm256_mul_ps(
+            inv_denominator, _mm256_fnmadd_ps(denominator, inv_denominator, two));
+
+        /// t is NaN for the target itself, min returns its second operand for it.
+        __m256 const t{_mm256_mul_ps(_mm256_mul_ps(r2, inv_r), scale)};
+        __m256 const sample{_mm256_floor_ps(_mm256_min_ps(t, last))};
+        __m256i const i{_mm256_cvttps_epi32(sample)};
+        __m256 const low{_mm256_i32gather_ps(split.factor.data(), i, 4)};
+        __m256 const high{_mm256_i32gather_ps(split.factor.data() + 1, i, 4)};
+        __m256 const factor{
+            _mm256_fmadd_ps(_mm256_sub_ps(t, sample), _mm256_sub_ps(high, low), low)};
+
+        __m256 const inside{_mm256_and_ps(_mm256_cmp_ps(r2, zero, _CMP_GT_OQ),
+                                          _mm256_cmp_ps(t, samples, _CMP_LT_OQ))};
+        __m256 const s{_mm256_and_ps(
+            _mm256_mul_ps(_mm256_mul_ps(m, factor), _mm256_mul_ps(inv_r, inv_denominator)),
+            inside)};
+
+        add_product<P>(ax, s, dx);
+        add_product<P>(ay, s, dy);
+        add_product<P>(az, s, dz);
+    }
+
+    Sum3<P> sum{};
+    accumulate_short_range_scalar(target, sources, split, n, sum);
+    return acceleration(sum, glm::dvec3{total<P>(ax), total<P>(ay), total<P>(az)});
+}
+
+/// AVX-512 counterpart of short_range_avx2.
+template<Precision P>
+NBODY_TARGET("avx512f")
+glm::vec3 short_range_avx512(glm::vec3 const& target,
+                             Interaction_list const& sources,
+                             Split_table const& split)
+{
+    static constexpr std::size_t width{16};
+
+    __m512 const tx{_mm512_set1_ps(target.x)};
+    __m512 const ty{_mm512_set1_ps(target.y)};
+    __m512 const tz{_mm512_set1_ps(target.z)};
+    __m512 const soft{_mm512_set1_ps(eps2)};
+    __m512 const half{_mm512_set1_ps(0.5f)};
+    __m512 const three_halves{_mm512_set1_ps(1.5f)};
+    __m512 const two{_mm512_set1_ps(2.f)};
+    __m512 const zero{_mm512_setzero_ps()};
+    __m512 const scale{_mm512_set1_ps(split.scale)};
+    __m512 const samples{_mm512_set1_ps(static_cast<float>(Split_table::size))};
+    __m512 const last{_mm512_set1_ps(static_cast<float>(Split_table::size - 1))};
+
+    Lanes_avx512 ax{zero_avx512()};
+    Lanes_avx512 ay{zero_avx512()};
+    Lanes_avx512 az{zero_avx512()};
+
+    std::size_t const n{sources.size() - sources.size() % width};
+    for (std::size_t j{0}; j < n; j += width) {
+        __m512 const dx{_mm512_sub_ps(tx, _mm512_load_ps(&sources.x[j]))};
+        __m512 const dy{_mm512_sub_ps(ty, _mm512_load_ps(&sources.y[j]))};
+        __m512 const dz{_mm512_sub_ps(tz, _mm512_load_ps(&sources.z[j]))};
+        __m512 const m{_mm512_load_ps(&sources.mass[j])};
+
+        __m512 const r2{_mm512_fmadd_ps(dx, dx, _mm512_fmadd_ps(dy, dy, _mm512_mul_ps(dz, dz)))};
+
+        __m512 inv_r{_mm512_rsqrt14_ps(r2)};
+        inv_r = _mm512_mul_ps(
+            inv_r,
+            _mm512_fnmadd_ps(_mm512_mul_ps(half, r2), _mm512_mul_ps(inv_r, inv_r), three_halves));
+
+        __m512 const denominator{_mm512_add_ps(r2, soft)};
+        __m512 inv_denominator{_mm512_rcp14_ps(denominator)};
+        inv_denominator = _mm512_mul_ps(
+            inv_denominator, _mm512_fnmadd_ps(denominator, inv_denominator, two));
+
+        __m512 const t{_mm512_mul_ps(_mm512_mul_ps(r2, inv_r), scale)};
+        __m512 const sample{_mm512_roundscale_ps(_mm512_min_ps(t, last), _MM_FROUND_TO_NEG_INF)};
+        __m512i const i{_mm512_cvttps_epi32(sample)};
+        __m512 const low{_mm512_i32gather_ps(i, split.factor.data(), 4)};
+        __m512 const high{_mm512_i32gather_ps(i, split.factor.data() + 1, 4)};
+        __m512 const factor{
+            _mm512_fmadd_ps(_mm512_sub_ps(t, sample), _mm512_sub_ps(high, low), low)};
+
+        __mmask16 const inside{_mm512_mask_cmp_ps_mask(_mm512_cmp_ps_mask(r2, zero, _CMP_GT_OQ),
+                                                       t, samples, _CMP_LT_OQ)};
+        __m512 const s{_mm512_maskz_mul_ps(inside, _mm512_mul_ps(m, factor),
+                                           _mm512_mul_ps(inv_r, inv_denominator))};
+
+        add_product<P>(ax, s, dx);
+        add_product<P>(ay, s, dy);
+        add_product<P>(az, s, dz);
+    }
+
+    Sum3<P> sum{};
+    accumulate_short_range_scalar(target, sources, split, n, sum);
+    return acceleration(sum, glm::dvec3{total<P>(ax), total<P>(ay), total<P>(az)});
+}
+
+template<Precision P>
+NBODY_TARGET("avx2,fma")
+glm::vec3 quadrupole_avx2(glm::vec3 const& target, Quadrupole_list const& sources)
+{
+    static constexpr std::size_t width{8};
+
+    __m256 const tx{_mm256_set1_ps(target.x)};
+    __m256 const ty{_mm256_set1_ps(target.y)};
+    __m256 const tz{_mm256_set1_ps(target.z)};
+    __m256 const soft{_mm256_set1_ps(eps2)};
+    __m256 const soft_10{_mm256_set1_ps(10.f * eps2)};
+    __m256 const soft2_3{_mm256_set1_ps(3.f * eps2 * eps2)};
+    __m256 const fifteen{_mm256_set1_ps(15.f)};
+    __m256 const three{_mm256_set1_ps(3.f)};
+    __m256 const half{_mm256_set1_ps(0.5f)};
+    __m256 const three_halves{_mm256_set1_ps(1.5f)};
+    __m256 const two{_mm256_set1_ps(2.f)};
+
+    Lanes_avx2 ax{zero_avx2()};
+    Lanes_avx2 ay{zero_avx2()};
+    Lanes_avx2 az{zero_avx2()};
+
+    std::size_t const n{sources.size() - sources.size() % width};
+    for (std::size_t j{0}; j < n; j += width) {
+        __m256 const dx{_mm256_sub_ps(tx, _mm256_load_ps(&sources.x[j]))};
+        __m256 const dy{_mm256_sub_ps(ty, _mm256_load_ps(&sources.y[j]))};
+        __m256 const dz{_mm256_sub_ps(tz, _mm256_load_ps(&sources.z[j]))};
+        __m256 const xx{_mm256_load_ps(&sources.xx[j])};
+        __m256 const yy{_mm256_load_ps(&sources.yy[j])};
+        __m256 const zz{_mm256_load_ps(&sources.zz[j])};
+        __m256 const xy{_mm256_load_ps(&sources.xy[j])};
+        __m256 const xz{_mm256_load_ps(&sources.xz[j])};
+        __m256 const yz{_mm256_load_ps(&sources.yz[j])};
+
+        __m256 const r2{_mm256_fmadd_ps(dx, dx, _mm256_fmadd_ps(dy, dy, _mm256_mul_ps(dz, dz)))};
+
+        __m256 inv_r{_mm256_rsqrt_ps(r2)};
+        inv_r = _mm256_mul_ps(
+            inv_r,
+            _mm256_fnmadd_ps(_mm256_mul_ps(half, r2), _mm256_mul_ps(inv_r, inv_r), three_halves));
+        __m256 const inv_r2{_mm256_mul_ps(inv_r, inv_r)};
+
+        __m256 const e{_mm256_add_ps(r2, soft)};
+        __m256 inv_e{_mm256_rcp_ps(e)};
+        inv_e = _mm256_mul_ps(inv_e, _mm256_fnmadd_ps(e, inv_e, two));
+        __m256 const inv_e2{_mm256_mul_ps(inv_e, inv_e)};
+
+        __m256 const g2{_mm256_mul_ps(_mm256_mul_ps(_mm256_fmadd_ps(three, r2, soft), inv_e2),
+                                      _mm256_mul_ps(inv_r2, inv_r))};
+        __m256 const g3{_mm256_mul_ps(
+            _mm256_mul_ps(
+                _mm256_mul_ps(_mm256_fmadd_ps(_mm256_fmadd_ps(fifteen, r2, soft_10), r2, soft2_3),
+                              inv_e2),
+                _mm256_mul_ps(inv_e, inv_r2)),
+            _mm256_mul_ps(inv_r2, inv_r))};
+
+        __m256 const mx{_mm256_fmadd_ps(xx, dx, _mm256_fmadd_ps(xy, dy, _mm256_mul_ps(xz, dz)))};
+        __m256 const my{_mm256_fmadd_ps(xy, dx, _mm256_fmadd_ps(yy, dy, _mm256_mul_ps(yz, dz)))};
+        __m256 const mz{_mm256_fmadd_ps(xz, dx, _mm256_fmadd_ps(yz, dy, _mm256_mul_ps(zz, dz)))};
+        __m256 const rmr{_mm256_fmadd_ps(dx, mx, _mm256_fmadd_ps(dy, my, _mm256_mul_ps(dz, mz)))};
+        __m256 const trace{_mm256_add_ps(xx, _mm256_add_ps(yy, zz))};
+
+        __m256 const radial{_mm256_fmadd_ps(
+            _mm256_mul_ps(_mm256_load_ps(&sources.mass[j]), inv_r), inv_e,
+            _mm256_mul_ps(half, _mm256_fmsub_ps(g3, rmr, _mm256_mul_ps(g2, trace))))};
+
+        add<P>(ax, _mm256_fnmadd_ps(g2, mx, _mm256_mul_ps(radial, dx)));
+        add<P>(ay, _mm256_fnmadd_ps(g2, my, _mm256_mul_ps(radial, dy)));
+        add<P>(az, _mm256_fnmadd_ps(g2, mz, _mm256_mul_ps(radial, dz)));
+    }
+
+    Sum3<P> sum{};
+    accumulate_quadrupole_scalar(target, sources, n, sum);
+    return acceleration(sum, glm::dvec3{total<P>(ax), total<P>(ay), total<P>(az)});
+}
+
+template<Precision P>
+NBODY_TARGET("avx512f")
+glm::vec3 quadrupole_avx512(glm::vec3 const& target, Quadrupole_list const& sources)
+{
+    static constexpr std::size_t width{16};
+
+    __m512 const tx{_mm512_set1_ps(target.x)};
+    __m512 const ty{_mm512_set1_ps(target.y)};
+    __m512 const tz{_mm512_set1_ps(target.z)};
+    __m512 const soft{_mm512_set1_ps(eps2)};
+    __m512 const soft_10{_mm512_set1_ps(10.f * eps2)};
+    __m512 const soft2_3{_mm512_set1_ps(3.f * eps2 * eps2)};
+    __m512 const fifteen{_mm512_set1_ps(15.f)};
+    __m512 const three{_mm512_set1_ps(3.f)};
+    __m512 const half{_mm512_set1_ps(0.5f)};
+    __m512 const three_halves{_mm512_set1_ps(1.5f)};
+    __m512 const two{_mm512_set1_ps(2.f)};
+
+    Lanes_avx512 ax{zero_avx512()};
+    Lanes_avx512 ay{zero_avx512()};
+    Lanes_avx512 az{zero_avx512()};
+
+    std::size_t const n{sources.size() - sources.size() % width};
+    for (std::size_t j{0}; j < n; j += width) {
+        __m512 const dx{_mm512_sub_ps(tx, _mm512_load_ps(&sources.x[j]))};
+        __m512 const dy{_mm512_sub_ps(ty, _mm512_load_ps(&sources.y[j]))};
+        __m512 const dz{_mm512_sub_ps(tz, _mm512_load_ps(&sources.z[j]))};
+        __m512 const xx{_mm512_load_ps(&sources.xx[j])};
+        __m512 const yy{_mm512_load_ps(&sources.yy[j])};
+        __m512 const zz{_mm512_load_ps(&sources.zz[j])};
+        __m512 const xy{_mm512_load_ps(&sources.xy[j])};
+        __m512 const xz{_mm512_load_ps(&sources.xz[j])};
+        __m512 const yz{_mm512_load_ps(&sources.yz[j])};
+
+        __m512 const r2{_mm512_fmadd_ps(dx, dx, _mm512_fmadd_ps(dy, dy, _mm512_mul_ps(dz, dz)))};
+
+        __m512 inv_r{_mm512_rsqrt14_ps(r2)};
+        inv_r = _mm512_mul_ps(
+            inv_r,
+            _mm512_fnmadd_ps(_mm512_mul_ps(half, r2), _mm512_mul_ps(inv_r, inv_r), three_halves));
+        __m512 const inv_r2{_mm512_mul_ps(inv_r, inv_r)};
+
+        __m512 const e{_mm512_add_ps(r2, soft)};
+        __m512 inv_e{_mm512_rcp14_ps(e)};
+        inv_e = _mm512_mul_ps(inv_e, _mm512_fnmadd_ps(e, inv_e, two));
+        __m512 const inv_e2{_mm512_mul_ps(inv_e, inv_e)};
+
+        __m512 const g2{_mm512_mul_ps(_mm512_mul_ps(_mm512_fmadd_ps(three, r2, soft), inv_e2),
+                                      _mm512_mul_ps(inv_r2, inv_r))};
+        __m512 const g3{_mm512_mul_ps(
+            _mm512_mul_ps(
+                _mm512_mul_ps(_mm512_fmadd_ps(_mm512_fmadd_ps(fifteen, r2, soft_10), r2, soft2_3),
+                              inv_e2),
+                _mm512_mul_ps(inv_e, inv_r2)),
+            _mm512_mul_ps(inv_r2, inv_r))};
+
+        __m512 const mx{_mm512_fmadd_ps(xx, dx, _mm512_fmadd_ps(xy, dy, _mm512_mul_ps(xz, dz)))};
+        __m512 const my{_mm512_fmadd_ps(xy, dx, _mm512_fmadd_ps(yy, dy, _mm512_mul_ps(yz, dz)))};
+        __m512 const mz{_mm512_fmadd_ps(xz, dx, _mm512_fmadd_ps(yz, dy, _mm512_mul_ps(zz, dz)))};
+        __m512 const rmr{_mm512_fmadd_ps(dx, mx, _mm512_fmadd_ps(dy, my, _mm512_mul_ps(dz, mz)))};
+        __m512 const trace{_mm512_add_ps(xx, _mm512_add_ps(yy, zz))};
+
+        __m512 const radial{_mm512_fmadd_ps(
+            _mm512_mul_ps(_mm512_load_ps(&sources.mass[j]), inv_r), inv_e,
+            _mm512_mul_ps(half, _mm512_fmsub_ps(g3, rmr, _mm512_mul_ps(g2, trace))))};
+
+        add<P>(ax, _mm512_fnmadd_ps(g2, mx, _mm512_mul_ps(radial, dx)));
+        add<P>(ay, _mm512_fnmadd_ps(g2, my, _mm512_mul_ps(radial, dy)));
+        add<P>(az, _mm512_fnmadd_ps(g2, mz, _mm512_mul_ps(radial, dz)));
+    }
+
+    Sum3<P> sum{};
+    accumulate_quadrupole_scalar(target, sources, n, sum);
+    return acceleration(sum, glm::dvec3{total<P>(ax), total<P>(ay), total<P>(az)});
+}
+
+#endif
+
+template<Precision P>
+Kernel select_kernel(Isa const isa) noexcept
+{
+    switch (isa) {
+#if defined(NBODY_X86_KERNELS)
+    case Isa::avx512:
+        return &kernel_avx512<P>;
+    case Isa::avx2:
+        return &kernel_avx2<P>;
+#endif
+    default:
+        return &kernel_scalar<P>;
+    }
+}
+
+template<Precision P>
+Quadrupole_kernel select_quadrupole_kernel(Isa const isa) noexcept
+{
+    switch (isa) {
+#if defined(NBODY_X86_KERNELS)
+    case Isa::avx512:
+        return &quadrupole_avx512<P>;
+    case Isa::avx2:
+        return &quadrupole_avx2<P>;
+#endif
+    default:
+        return &quadrupole_scalar<P>;
+    }
+}
+
+template<Precision P>
+Short_range_kernel select_short_range_kernel(Isa const isa) noexcept
+{
+    switch (isa) {
+#if defined(NBODY_X86_KERNELS)
+    case Isa::avx512:
+        return &short_range_avx512<P>;
+    case Isa::avx2:
+        return &short_range_avx2<P>;
+#endif
+    default:
+        return &short_range_scalar<P>;
+    }
+}
+
+} // namespace
+
+
+void Interaction_list::clear() noexcept
+{
+    x.clear();
+    y.clear();
+    z.clear();
+    mass.clear();
+}
+
+void Interaction_list::reserve(std::size_t const n) noexcept
+{
+    x.reserve(n);
+    y.reserve(n);
+    z.reserve(n);
+    mass.reserve(n);
+}
+
+void Interaction_list::push(float const sx,
+                            float const sy,
+                            float const sz,
+                            float const m) noexcept
+{
+    x.push_back(sx);
+    y.push_back(sy);
+    z.push_back(sz);
+    mass.push_back(m);
+}
+
+void Quadrupole_list::clear() noexcept
+{
+    x.clear();
+    y.clear();
+    z.clear();
+    mass.clear();
+    xx.clear();
+    yy.clear();
+    zz.clear();
+    xy.clear();
+    xz.clear();
+    yz.clear();
+}
+
+void Quadrupole_list::reserve(std::size_t const n) noexcept
+{
+    x.reserve(n);
+    y.reserve(n);
+    z.reserve(n);
+    mass.reserve(n);
+    xx.reserve(n);
+    yy.reserve(n);
+    zz.reserve(n);
+    xy.reserve(n);
+    xz.reserve(n);
+    yz.reserve(n);
+}
+
+void Quadrupole_list::push(glm::vec3 const& center_of_mass,
+                           float const m,
+                           std::array<float, 6> const& q) noexcept
+{
+    x.push_back(center_of_mass.x);
+    y.push_back(center_of_mass.y);
+    z.push_back(center_of_mass.z);
+    mass.push_back(m);
+    xx.push_back(q[0]);
+    yy.push_back(q[1]);
+    zz.push_back(q[2]);
+    xy.push_back(q[3]);
+    xz.push_back(q[4]);
+    yz.push_back(q[5]);
+}
+
+Isa detect() noexcept
+{
+#if defined(NBODY_X86_KERNELS) && defined(_MSC_VER)
+    std::array<int, 4> info{};
+    __cpuid(info.data(), 0);
+    if (info[0] < 7) {
+        return Isa::scalar;
+    }
+
+    __cpuid(info.data(), 1);
+    bool const fma{(info[2] & (1 << 12)) != 0};
+    bool const os_saves_ymm{((info[2] & (1 << 27)) != 0) && ((_xgetbv(0) & 0x6) == 0x6)};
+    bool const os_saves_zmm{os_saves_ymm && ((_xgetbv(0) & 0xe6) == 0xe6)};
+
+    __cpuidex(info.data(), 7, 0);
+    bool const avx2{(info[1] & (1 << 5)) != 0};
+    bool const avx512f{(info[1] & (1 << 16)) != 0};
+
+    if (avx512f && os_saves_zmm) {
+        return Isa::avx512;
+    }
+    if (avx2 && fma && os_saves_ymm) {
+        return Isa::avx2;
+    }
+#elif defined(NBODY_X86_KERNELS)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        return Isa::avx512;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return Isa::avx2;
+    }
+#endif
+    return Isa::scalar;
+}
+
+Kernel select(Isa const isa, Precision const precision) noexcept
+{
+    switch (precision) {
+    case Precision::double_sum:
+        return select_kernel<Precision::double_sum>(isa);
+    case Precision::compensated:
+        return select_kernel<Precision::compensated>(isa);
+    default:
+        return select_kernel<Precision::single>(isa);
+    }
+}
+
+Quadrupole_kernel select_quadrupole(Isa const isa, Precision const precision) noexcept
+{
+    switch (precision) {
+    case Precision::double_sum:
+        return select_quadrupole_kernel<Precision::double_sum>(isa);
+    case Precision::compensated:
+        return select_quadrupole_kernel<Precision::compensated>(isa);
+    default:
+        return select_quadrupole_kernel<Precision::single>(isa);
+    }
+}
+
+Short_range_kernel select_short_range(Isa const isa, Precision const precision) noexcept
+{
+    switch (precision) {
+    case Precision::double_sum:
+        return select_short_range_kernel<Precision::double_sum>(isa);
+    case Precision::compensated:
+        return select_short_range_kernel<Precision::compensated>(isa);
+    default:
+        return select_short_range_kernel<Precision::single>(isa);
+    }
+}
+
+glm::dvec3 reference(glm::vec3 const& target, Interaction_list const& sources) noexcept
+{
+    glm::dvec3 sum{0.0};
+    for (std::size_t j{0}; j < sources.size(); j++) {
+        glm::dvec3 const d{glm::dvec3{target}
+                           - glm::dvec3{sources.x[j], sources.y[j], sources.z[j]}};
+        double const r2{glm::dot(d, d)};
+        if (r2 > 0.0) {
+            double const soft{static_cast<double>(eps) * eps};
+            sum += d * (sources.mass[j] / (std::sqrt(r2) * (r2 + soft)));
+        }
+    }
+    return sum * -G;
+}
+
+glm::dvec3 reference_quadrupole(glm::vec3 const& target, Quadrupole_list const& sources) noexcept
+{
+    double const soft{static_cast<double>(eps) * eps};
+
+    glm::dvec3 sum{0.0};
+    for (std::size_t j{0}; j < sources.size(); j++) {
+        glm::dvec3 const d{glm::dvec3{target}
+                           - glm::dvec3{sources.x[j], sources.y[j], sources.z[j]}};
+        double const r2{glm::dot(d, d)};
+        double const r{std::sqrt(r2)};
+        double const e{r2 + soft};
+
+        double const g2{(3.0 * r2 + soft) / (e * e * r2 * r)};
+        double const g3{(15.0 * r2 * r2 + 10.0 * r2 * soft + 3.0 * soft * soft)
+                        / (e * e * e * r2 * r2 * r)};
+
+        glm::dvec3 const m{
+            sources.xx[j] * d.x + sources.xy[j] * d.y + sources.xz[j] * d.z,
+            sources.xy[j] * d.x + sources.yy[j] * d.y + sources.yz[j] * d.z,
+            sources.xz[j] * d.x + sources.yz[j] * d.y + sources.zz[j] * d.z};
+        double const trace{static_cast<double>(sources.xx[j]) + sources.yy[j] + sources.zz[j]};
+
+        double const radial{sources.mass[j] / (r * e) + 0.5 * (g3 * glm::dot(d, m) - g2 * trace)};
+        sum += d * radial - m * g2;
+    }
+    return sum * -G;
+}
+
+char const* str(Isa const isa) noexcept
+{
+    switch (isa) {
+    case Isa::scalar:
+        return "scalar";
+    case Isa::avx2:
+        return "avx2";
+    case Isa::avx512:
+        return "avx512";
+    }
+    return "unknown";
+}
+
+char const* str(Precision const precision) noexcept
+{
+    switch (precision) {
+    case Precision::single:
+        return "single";
+    case Precision::double_sum:
+        return "double";
+    case Precision::compensated:
+        return "compensated";
+    }
+    return "unknown";
+}
+
+} // namespace kernels
@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) https://github.com/kaapomoi 2023.
+ */
+
+#include "initial_conditions.h"
+
+namespace initial_conditions {
+
+void clusters(Particles& particles, std::size_t const n, std::mt19937& engine) noexcept
+{
+    std::uniform_real_distribution<float> velo0(0.0001f, 0.0002f);
+    std::uniform_real_distribution<float> mass(5e5, 5e5);
+
+    float const radius{300.f};
+
+    particles.reserve(particles.size() + n);
+
+    std::uniform_real_distribution<float> pos0(-1.0f, 1.0f);
+    for (std::size_t j{0}; j < 10; j++) {
+        glm::vec3 const offset{pos0(engine) * 200.f, pos0(engine) * 200.f, pos0(engine) * 200.f};
+        for (std::size_t i{0}; i < (n * 0.1); i++) {
+            glm::vec3 const p{pos0(engine), pos0(engine), pos0(engine)};
+
+            glm::vec3 const p_norm{glm::normalize(p)};
+
+            glm::vec3 const perpendicular{0.f, 1.f, 0.f};
+            glm::vec3 const tangent{glm::cross(p_norm, perpendicular)};
+            glm::vec3 const v0{tangent * velo0(engine)};
+
+            glm::vec3 const position{p_norm * radius * 0.3f + offset};
+            particles.add(position, v0, mass(engine));
+        }
+    }
+}
+
+} // namespace initial_conditions
@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) https://github.com/kaapomoi 2023.
+ */
+
+#include "lod.h"
+
+#include <glm/gtc/packing.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <numbers>
+
+namespace lod {
+
+namespace {
+
+glm::vec3 const impostor_tint{1.f, 0.9f, 0.75f};
+
+/// Brightness of a cell of one body of the mean mass.
+constexpr float impostor_brightness{0.25f};
+constexpr float body_brightness{0.5f};
+
+/// Every doubling of the mass over the mean adds the same step of brightness.
+float brightness(float const mass, float const mean_mass, float const base) noexcept
+{
+    return std::clamp(base + 0.125f * std::log2(mass / mean_mass), 0.25f, 1.f);
+}
+
+float mean_mass(std::vector<Oct::Walk_cell> const& cells) noexcept
+{
+    return cells.front().mass / static_cast<float>(cells.front().body_count);
+}
+
+} // namespace
+
+void Scene::capture(Oct const& tree) noexcept
+{
+    std::span<Oct::Walk_cell const> const walk_cells{tree.walk_cells()};
+    cells.assign(walk_cells.begin(), walk_cells.end());
+
+    bodies.resize(tree.order().size());
+    float const mean{bodies.empty() ? 1.f : mean_mass(cells)};
+    for (std::uint32_t body{0}; body < bodies.size(); body++) {
+        bodies[body] = {tree.position(body),
+                        glm::packUnorm4x8(glm::vec4{
+                            1.f, 1.f, 1.f, brightness(tree.mass(body), mean, body_brightness)})};
+    }
+
+    center_of_mass = tree.center_of_mass();
+}
+
+void Selection::clear() noexcept
+{
+    impostors.clear();
+    bodies.clear();
+    culled_cells = 0;
+}
+
+float focal_length(float const fov_y, float const viewport_height) noexcept
+{
+    return viewport_height / (2.f * std::tan(0.5f * fov_y));
+}
+
+void select(Scene const& scene, View const& view, Selection& selection) noexcept
+{
+    selection.clear();
+
+    std::vector<Oct::Walk_cell> const& cells{scene.cells};
+    if (cells.empty() || (cells.front().body_count == 0)) {
+        return;
+    }
+
+    float const mean{mean_mass(cells)};
+
+    Oct::Cell_index index{0};
+    while (index < cells.size()) {
+        Oct::Walk_cell const& cell{cells[index]};
+        if (cell.body_count == 0) {
+            index = cell.skip;
+            continue;
+        }
+
+        /// The center of mass is inside the cell, so no body is further than the diagonal from it.
+        glm::vec3 const offset{cell.center_of_mass - view.position};
+        if (glm::dot(offset, view.front) < -std::numbers::sqrt3_v<float> * cell.width) {
+            selection.culled_cells++;
+            index = cell.skip;
+            continue;
+        }
+
+        float const distance{glm::length(offset)};
+        float const size{std::max(cell.width, view.body_size)};
+        if ((distance > size) && (size * view.focal_length < view.pixel_threshold * distance)) {
+            selection.impostors.push_back(
+                {glm::vec4{cell.center_of_mass, 0.5f * size},
+                 glm::vec4{impostor_tint, brightness(cell.mass, mean, impostor_brightness)}});
+            index = cell.skip;
+            continue;
+        }
+
+        if (cell.skip == index + 1) {
+            auto const first{scene.bodies.begin() + cell.first_body};
+            selection.bodies.insert(selection.bodies.end(), first, first + cell.body_count);
+        }
+        index++;
+    }
+}
+
+} // namespace lod
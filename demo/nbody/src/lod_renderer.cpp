@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) https://github.com/kaapomoi 2023.
+ */
+
+#include "lod_renderer.h"
+
+#include <cstddef>
+
+void Lod_renderer::init() noexcept
+{
+    glGenBuffers(1, &m_body_vbo);
+    glGenBuffers(1, &m_impostor_vbo);
+
+    /// The billboard corners come from gl_VertexID, the only attributes are per instance.
+    glGenVertexArrays(1, &m_body_vao);
+    glBindVertexArray(m_body_vao);
+    glBindBuffer(GL_ARRAY_BUFFER, m_body_vbo);
+
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(lod::Sprite),
+                          (void*)offsetof(lod::Sprite, position));
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(lod::Sprite),
+                          (void*)offsetof(lod::Sprite, color));
+    glVertexAttribDivisor(0, 1);
+    glVertexAttribDivisor(1, 1);
+
+    glGenVertexArrays(1, &m_impostor_vao);
+    glBindVertexArray(m_impostor_vao);
+    glBindBuffer(GL_ARRAY_BUFFER, m_impostor_vbo);
+
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, sizeof(lod::Impostor),
+                          (void*)offsetof(lod::Impostor, center_radius));
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, sizeof(lod::Impostor),
+                          (void*)offsetof(lod::Impostor, color));
+    glVertexAttribDivisor(0, 1);
+    glVertexAttribDivisor(1, 1);
+
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void Lod_renderer::destroy() noexcept
+{
+    glDeleteVertexArrays(1, &m_impostor_vao);
+    glDeleteBuffers(1, &m_impostor_vbo);
+    glDeleteVertexArrays(1, &m_body_vao);
+    glDeleteBuffers(1, &m_body_vbo);
+    m_impostor_vao = 0;
+    m_impostor_vbo = 0;
+    m_body_vao = 0;
+    m_body_vbo = 0;
+}
+
+void Lod_renderer::draw(lod::Selection const& selection,
+                        sal::Shader_program& body_shader,
+                        sal::Shader_program const& impostor_shader) noexcept
+{
+    if (!selection.bodies.empty()) {
+        draw_bodies(selection.bodies, body_shader);
+    }
+    if (!selection.impostors.empty()) {
+        draw_impostors(selection.impostors, impostor_shader);
+    }
+}
+
+
+///
+/// Private section:
+///
+void Lod_renderer::draw_bodies(std::vector<lod::Sprite> const& bodies,
+                               sal::Shader_program& shader) noexcept
+{
+    /// Orphans the previous frame's storage instead of waiting for the draws that still read it.
+    glBindBuffer(GL_ARRAY_BUFFER, m_body_vbo);
+    glBufferData(GL_ARRAY_BUFFER, bodies.size() * sizeof(lod::Sprite), bodies.data(),
+                 GL_STREAM_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    shader.use();
+    shader.set_uniform<float>("radius", body_radius);
+    glBindVertexArray(m_body_vao);
+    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, bodies.size());
+    glBindVertexArray(0);
+    shader.un_use();
+}
+
+void Lod_renderer::draw_impostors(std::vector<lod::Impostor> const& impostors,
+                                  sal::Shader_program const& shader) noexcept
+{
+    glBindBuffer(GL_ARRAY_BUFFER, m_impostor_vbo);
+    glBufferData(GL_ARRAY_BUFFER, impostors.size() * sizeof(lod::Impostor), impostors.data(),
+                 GL_STREAM_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    /// Overlapping billboards add up like the light of the bodies they stand for, and don't hide
+    /// each other in the depth buffer.
+    glDepthMask(GL_FALSE);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE);
+
+    shader.use();
+    glBindVertexArray(m_impostor_vao);
+    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, impostors.size());
+    glBindVertexArray(0);
+    shader.un_use();
+
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    glDepthMask(GL_TRUE);
+}
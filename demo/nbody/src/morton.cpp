@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) https://github.com/kaapomoi 2023.
+ */
+
+#include "morton.h"
+
+#include <array>
+
+namespace morton {
+
+void radix_sort(sal::Job_pool& pool, std::vector<Entry>& entries, std::vector<Entry>& scratch) noexcept
+{
+    static constexpr std::size_t radix{256};
+    static constexpr std::size_t min_chunk_size{1 << 14};
+
+    std::size_t const n{entries.size()};
+    scratch.resize(n);
+
+    std::size_t const chunk_count{
+        std::max<std::size_t>(std::min(pool.thread_count(), n / min_chunk_size), 1)};
+    std::size_t const chunk_size{(n + chunk_count - 1) / chunk_count};
+
+    std::vector<std::array<std::size_t, radix>> histograms(chunk_count);
+
+    Entry* src{entries.data()};
+    Entry* dst{scratch.data()};
+
+    for (std::uint32_t shift{0}; shift < 64; shift += 8) {
+        sal::parallel_for(pool, chunk_count, [&](std::size_t const begin, std::size_t const end) {
+            for (std::size_t c{begin}; c < end; c++) {
+                auto& histogram{histograms[c]};
+                histogram.fill(0);
+                std::size_t const last{std::min((c + 1) * chunk_size, n)};
+                for (std::size_t i{c * chunk_size}; i < last; i++) {
+                    histogram[(src[i].key >> shift) & (radix - 1)]++;
+                }
+            }
+        });
+
+        /// Turn the counts into scatter offsets, ordered by digit first and chunk second.
+        std::size_t offset{0};
+        bool single_digit{false};
+        for (std::size_t d{0}; d < radix; d++) {
+            std::size_t digit_total{0};
+            for (auto& histogram : histograms) {
+                std::size_t const count{histogram[d]};
+                histogram[d] = offset;
+                offset += count;
+                digit_total += count;
+            }
+            single_digit = single_digit || (digit_total == n);
+        }
+
+        if (single_digit) {
+            continue;
+        }
+
+        sal::parallel_for(pool, chunk_count, [&](std::size_t const begin, std::size_t const end) {
+            for (std::size_t c{begin}; c < end; c++) {
+                auto& histogram{histograms[c]};
+                std::size_t const last{std::min((c + 1) * chunk_size, n)};
+                for (std::size_t i{c * chunk_size}; i < last; i++) {
+                    dst[histogram[(src[i].key >> shift) & (radix - 1)]++] = src[i];
+                }
+            }
+        });
+
+        std::swap(src, dst);
+    }
+
+    if (src != entries.data()) {
+        entries.swap(scratch);
+    }
+}
+
+} // namespace morton
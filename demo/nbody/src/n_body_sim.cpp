@@ -1,12 +1,12 @@
 #include "n_body_sim.h"
 
-#include "texture_loader.h"
-
 
 sal::Application::Exit_code N_body_sim::start() noexcept
 {
     register_keys({GLFW_KEY_W, GLFW_KEY_A, GLFW_KEY_S, GLFW_KEY_D, GLFW_KEY_LEFT_SHIFT, GLFW_KEY_E,
-                   GLFW_KEY_Q, GLFW_KEY_R, GLFW_KEY_ESCAPE, GLFW_KEY_F1},
+                   GLFW_KEY_Q, GLFW_KEY_R, GLFW_KEY_B, GLFW_KEY_G, GLFW_KEY_U, GLFW_KEY_M,
+                   GLFW_KEY_L, GLFW_KEY_C, GLFW_KEY_ESCAPE, GLFW_KEY_F1, GLFW_KEY_F5,
+                   GLFW_KEY_F6, GLFW_KEY_F7, GLFW_KEY_F9},
                   {GLFW_MOUSE_BUTTON_RIGHT});
 
     return setup(1920, 1080);
@@ -31,29 +31,13 @@ sal::Application::Exit_code N_body_sim::run() noexcept
         v_str, f2_str, {{"in_uv"}, {"in_normal"}, {"in_pos"}, {"in_color"}},
         {"material", "frame"}));
 
-    auto instanced_vert = sal::File_reader::read_file("../res/shaders/instanced_vert.glsl");
-    m_shaders.push_back(sal::Shader_loader::from_sources(instanced_vert, f2_str,
-                                                         {{"in_uv"},
-                                                          {"in_normal"},
-                                                          {"in_pos"},
-                                                          {"in_color"},
-                                                          {"in_instance_model_matrix", 4},
-                                                          {"in_instance_color"}},
-                                                         {"material", "frame"}));
-
-    std::uint64_t const base_flags = aiProcess_Triangulate | aiProcess_GenNormals
-                                     | aiProcess_OptimizeGraph | aiProcess_OptimizeMeshes;
-
-    std::string const model_file{"../res/models/cube/cube.obj"};
-    float const scale_factor{0.5f};
-    m_models.push_back(
-        sal::Model_loader::from_file(model_file, scale_factor, base_flags | aiProcess_FlipUVs));
-
-    sal::Texture cube_tex{sal::Texture_loader::from_file("../res/models/case/j-cover.png",
-                                                         sal::Texture::Type::diffuse)};
-
-    sal::Mesh cube{sal::Primitive_factory::cube(glm::vec3{scale_factor}, {cube_tex})};
-    m_models.push_back(sal::Model{{cube}});
+    /// Both billboard vertex shaders start from the expansion in billboard.glsl.
+    auto billboard_str = sal::File_reader::read_file("../res/shaders/billboard.glsl");
+    auto particle_vert =
+        billboard_str + sal::File_reader::read_file("../res/shaders/particle_vert.glsl");
+    auto particle_frag = sal::File_reader::read_file("../res/shaders/particle_frag.glsl");
+    m_shaders.push_back(sal::Shader_loader::from_sources(
+        particle_vert, particle_frag, {{"in_position"}, {"in_color"}}, {"radius"}));
 
     auto text_vert = sal::File_reader::read_file("../res/shaders/basic_text_vert.glsl");
     auto text_frag = sal::File_reader::read_file("../res/shaders/basic_text_frag.glsl");
@@ -62,6 +46,13 @@ sal::Application::Exit_code N_body_sim::run() noexcept
         {"atlas", "color"}));
     m_fonts.emplace_back(m_font_loader.create("../res/fonts/calibri.ttf"));
 
+    auto impostor_vert =
+        billboard_str + sal::File_reader::read_file("../res/shaders/impostor_vert.glsl");
+    auto impostor_frag = sal::File_reader::read_file("../res/shaders/impostor_frag.glsl");
+    m_shaders.push_back(sal::Shader_loader::from_sources(
+        impostor_vert, impostor_frag, {{"in_center_radius"}, {"in_color"}}, {}));
+    m_lod_renderer.init();
+
 
     auto entity2 = m_registry.create();
     sal::Text text{"Hello, world", m_fonts.front(), glm::vec2{0}, glm::vec2{0.2f},
@@ -79,6 +70,7 @@ sal::Application::Exit_code N_body_sim::run() noexcept
     m_registry.emplace<sal::Transform>(camera, glm::vec3{0.0f}, glm::vec3{0.0f}, glm::vec3{1.0f});
     m_registry.emplace<sal::Camera>(camera);
 
+    m_sim_thread = std::jthread{[this](std::stop_token const stop) { run_simulation(stop); }};
 
     m_t_start = std::chrono::high_resolution_clock::now();
     m_t_prev_update = m_t_start;
@@ -92,6 +84,15 @@ sal::Application::Exit_code N_body_sim::run() noexcept
 
 void N_body_sim::cleanup() noexcept
 {
+    if (m_sim_thread.joinable()) {
+        m_sim_thread.request_stop();
+        m_sim_thread.join();
+    }
+
+    m_recorder.close();
+    m_snapshot_writer.close();
+    m_lod_renderer.destroy();
+
     for (auto const& shader : m_shaders) {
         glDeleteProgram(shader.program_id);
     }
@@ -102,6 +103,14 @@ void N_body_sim::cleanup() noexcept
 ///
 /// Private section:
 ///
+namespace {
+
+constexpr char const* snapshot_file{"nbody_snapshot.nbs"};
+constexpr char const* recording_file{"nbody_recording.nbs"};
+
+} // namespace
+
+
 void N_body_sim::run_user_tasks() noexcept
 {
     handle_input();
@@ -110,11 +119,12 @@ void N_body_sim::run_user_tasks() noexcept
 
     glEnable(GL_DEPTH_TEST);
 
-    update_nodes();
+    /// Keeps the previous scene when no step has finished since the last frame.
+    m_scenes.acquire();
 
     auto text_view = m_registry.view<sal::Transform, sal::Text>();
     for (auto [entity, transform, text] : text_view.each()) {
-        auto c_of_m = m_root->center_of_mass();
+        auto c_of_m = m_scenes.front().center_of_mass;
         std::string x{std::to_string(c_of_m.x)};
         std::string y{std::to_string(c_of_m.y)};
         std::string z{std::to_string(c_of_m.z)};
@@ -160,6 +170,32 @@ void N_body_sim::set_user_uniforms_before_render() noexcept
 
 void N_body_sim::set_render_model_uniforms(sal::Shader_program& shader) noexcept {}
 
+void N_body_sim::render_user() noexcept
+{
+    std::chrono::high_resolution_clock::time_point sw_start{
+        std::chrono::high_resolution_clock::now()};
+
+    auto camera_view = m_registry.view<sal::Transform, sal::Camera>();
+    for (auto [entity, transform, camera] : camera_view.each()) {
+        lod::View const view{transform.position, camera.front(),
+                             lod::focal_length(glm::radians(camera.zoom()),
+                                               static_cast<float>(m_window_height)),
+                             m_lod ? lod::default_pixel_threshold : 0.f};
+        lod::select(m_scenes.front(), view, m_lod_selection);
+    }
+
+    m_lod_renderer.draw(m_lod_selection, m_shaders.at(3), m_shaders.at(5));
+
+    std::chrono::high_resolution_clock::time_point const now{
+        std::chrono::high_resolution_clock::now()};
+
+    float const time_diff =
+        std::chrono::duration_cast<std::chrono::duration<float>>(now - sw_start).count();
+    sal::Log::info("render_time_lod ({} impostors, {} bodies, {} culled cells): {}",
+                   m_lod_selection.impostors.size(), m_lod_selection.bodies.size(),
+                   m_lod_selection.culled_cells, time_diff);
+}
+
 
 void N_body_sim::handle_input() noexcept
 {
@@ -181,91 +217,161 @@ void N_body_sim::handle_input() noexcept
         sal::Log::info("FPS: {}", (1 / m_delta_time));
     }
     if (m_input_manager.key_now(GLFW_KEY_Q)) {
-        m_sim_timescale /= 2;
-        sal::Log::info("Timescale: {}", m_sim_timescale);
+        post([this] {
+            m_sim_timescale /= 2;
+            sal::Log::info("Timescale: {}", m_sim_timescale);
+        });
     }
     if (m_input_manager.key_now(GLFW_KEY_E)) {
-        m_sim_timescale *= 2;
-        sal::Log::info("Timescale: {}", m_sim_timescale);
+        post([this] {
+            m_sim_timescale *= 2;
+            sal::Log::info("Timescale: {}", m_sim_timescale);
+        });
     }
     if (m_input_manager.key_now(GLFW_KEY_R)) {
-        m_should_restart_sim = true;
+        post([this] { restart(); });
+    }
+    if (m_input_manager.key_now(GLFW_KEY_B)) {
+        post([this] {
+            m_simulation.set_build_mode((m_simulation.build_mode() == Oct::Build_mode::insertion)
+                                            ? Oct::Build_mode::morton
+                                            : Oct::Build_mode::insertion);
+            sal::Log::info("Tree build mode: {}", Oct::str(m_simulation.build_mode()));
+        });
+    }
+    if (m_input_manager.key_now(GLFW_KEY_G)) {
+        post([this] {
+            switch (m_simulation.walk_mode()) {
+            case Simulation::Walk_mode::group:
+                m_simulation.set_walk_mode(Simulation::Walk_mode::per_body);
+                break;
+            case Simulation::Walk_mode::per_body:
+                m_simulation.set_walk_mode(Simulation::Walk_mode::dual_tree);
+                break;
+            case Simulation::Walk_mode::dual_tree:
+                m_simulation.set_walk_mode(Simulation::Walk_mode::tree_pm);
+                break;
+            case Simulation::Walk_mode::tree_pm:
+                m_simulation.set_walk_mode(Simulation::Walk_mode::group);
+                break;
+            }
+            sal::Log::info("Tree walk mode: {}, opening angle: {}",
+                           Simulation::str(m_simulation.walk_mode()), m_simulation.opening_angle());
+        });
+    }
+    if (m_input_manager.key_now(GLFW_KEY_U)) {
+        post([this] {
+            m_simulation.set_tree_update(
+                (m_simulation.tree_update() == Simulation::Tree_update::refit)
+                    ? Simulation::Tree_update::rebuild
+                    : Simulation::Tree_update::refit);
+            sal::Log::info("Tree update: {}", Simulation::str(m_simulation.tree_update()));
+        });
+    }
+    if (m_input_manager.key_now(GLFW_KEY_M)) {
+        post([this] {
+            m_simulation.set_multipole_order(
+                (m_simulation.multipole_order() == Oct::Multipole_order::quadrupole)
+                    ? Oct::Multipole_order::monopole
+                    : Oct::Multipole_order::quadrupole);
+            sal::Log::info("Multipole order: {}, opening angle: {}",
+                           Oct::str(m_simulation.multipole_order()),
+                           m_simulation.opening_angle());
+        });
+    }
+    if (m_input_manager.key_now(GLFW_KEY_L)) {
+        m_lod = !m_lod;
+        sal::Log::info("Level of detail: {}", m_lod ? "on" : "off");
+    }
+    if (m_input_manager.key_now(GLFW_KEY_C)) {
+        post([this] {
+            m_max_step_rate = (m_max_step_rate > 0.f) ? 0.f : 60.f;
+            sal::Log::info("Max steps per second: {}", m_max_step_rate);
+        });
+    }
+    if (m_input_manager.key_now(GLFW_KEY_F5)) {
+        post([this] { save_snapshot(); });
+    }
+    if (m_input_manager.key_now(GLFW_KEY_F6)) {
+        post([this] { toggle_recording(); });
+    }
+    if (m_input_manager.key_now(GLFW_KEY_F7)) {
+        post([this] { toggle_replay(); });
+    }
+    if (m_input_manager.key_now(GLFW_KEY_F9)) {
+        post([this] { load_snapshot(); });
     }
 }
 
 
-void N_body_sim::create_nodes(std::size_t const n) noexcept
+void N_body_sim::run_simulation(std::stop_token const stop) noexcept
 {
-    std::uniform_int_distribution<std::int32_t> position(-200, 200);
-    std::uniform_real_distribution<float> velo0(0.0001f, 0.0002f);
-    std::uniform_real_distribution<float> mass(5e5, 5e5);
+    while (!stop.stop_requested()) {
+        std::chrono::steady_clock::time_point const step_start{std::chrono::steady_clock::now()};
 
-    m_root = std::make_unique<Oct>(glm::vec3{std::numeric_limits<float>::min()},
-                                   glm::vec3{std::numeric_limits<float>::max()});
+        while (std::optional<std::function<void()>> command = m_commands.try_pop()) {
+            (*command)();
+        }
 
-    float const radius{300.f};
-    float const offset{75.f};
+        update_nodes();
 
-    std::uniform_real_distribution<float> pos0(-1.0f, 1.0f);
-    for (std::size_t j{0}; j < 10; j++) {
-        glm::vec3 const offset{pos0(m_rand_engine) * 200.f, pos0(m_rand_engine) * 200.f,
-                               pos0(m_rand_engine) * 200.f};
-        for (std::size_t i{0}; i < (n * 0.1); i++) {
-            auto entity = m_registry.create();
-            glm::vec3 const p{pos0(m_rand_engine), pos0(m_rand_engine), pos0(m_rand_engine)};
+        m_scenes.back().capture(m_simulation.tree());
+        m_scenes.publish();
 
-            glm::vec3 const p_norm{glm::normalize(p)};
+        if (m_max_step_rate > 0.f) {
+            std::this_thread::sleep_until(
+                step_start
+                + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                    std::chrono::duration<float>{1.f / m_max_step_rate}));
+        }
+    }
+}
 
-            glm::vec3 const perpendicular{0.f, 1.f, 0.f};
-            glm::vec3 const tangent{glm::cross(p_norm, perpendicular)};
-            glm::vec3 const v0{tangent * velo0(m_rand_engine)};
+void N_body_sim::post(std::function<void()> command) noexcept
+{
+    m_commands.push(std::move(command));
+}
 
-            Node node{p_norm * radius * 0.3f + offset, {}, {}, v0, mass(m_rand_engine)};
 
-            float const m{mass(m_rand_engine)};
+void N_body_sim::create_nodes(std::size_t const n) noexcept
+{
+    initial_conditions::clusters(m_simulation.particles(), n, m_rand_engine);
+}
 
-            m_registry.emplace<std::shared_ptr<Node>>(entity, std::make_shared<Node>(node));
-            m_registry.emplace<sal::Instanced>(entity, m_models.at(1), glm::mat4{1.f},
-                                               glm::vec4{1.f, 1.f, 1.f, 0.5f}, false);
-            m_registry.emplace<sal::Shader_program>(entity, m_shaders.at(3));
-            sal::Transform t{node.position, glm::vec3{0.f}, glm::vec3{1.f}};
-            m_registry.emplace<sal::Transform>(entity, t);
-        }
-    }
+
+void N_body_sim::restart() noexcept
+{
+    m_simulation.clear();
+    m_step_count = 0;
+    m_sim_time = 0.0;
+    create_nodes(50000);
 }
 
 
 void N_body_sim::update_nodes() noexcept
 {
-    if (m_should_restart_sim) {
-        m_should_restart_sim = false;
-
-        auto node_view =
-            m_registry
-                .view<std::shared_ptr<Node>, sal::Transform, sal::Instanced, sal::Shader_program>();
-        m_registry.destroy(node_view.begin(), node_view.end());
-        create_nodes(50000);
-    }
-
     std::chrono::high_resolution_clock::time_point sw_start{
         std::chrono::high_resolution_clock::now()};
-    m_root.reset();
-    m_root = std::make_unique<Oct>(glm::vec3{-20000}, glm::vec3{20000});
-    auto node_view = m_registry.view<sal::Transform, std::shared_ptr<Node>>();
-    for (auto [entity, transform, node] : node_view.each()) {
-        m_root->insert(node);
-    }
-
-    for (auto [entity, transform, node] : node_view.each()) {
-        node->force = glm::vec3{0.f};
-        m_root->update_force(node);
-        node->acceleration = node->force / node->mass;
-        node->velocity += node->acceleration * m_sim_timescale;
-        node->position += node->velocity * m_sim_timescale;
 
-        transform.rotation = node->velocity * 10000.f * 360.f;
-        transform.position = node->position;
-        transform.dirty = true;
+    if (m_replay.is_open()) {
+        /// The recorded bodies replace the simulated ones, which are paused and continue from the
+        /// last replayed frame.
+        m_simulation.clear();
+        m_replay.load(m_replay_frame, m_simulation.particles());
+        m_simulation.refresh_tree();
+        m_step_count = m_replay.frame(m_replay_frame).step;
+        m_sim_time = m_replay.frame(m_replay_frame).time;
+        m_replay_frame = (m_replay_frame + 1) % m_replay.frame_count();
+    }
+    else {
+        m_simulation.step(m_sim_timescale);
+        m_step_count++;
+        m_sim_time += m_sim_timescale;
+        log_step();
+
+        if (m_recorder.is_open()) {
+            m_recorder.write(m_simulation.particles(), m_step_count, m_sim_time);
+        }
     }
 
     std::chrono::high_resolution_clock::time_point now{std::chrono::high_resolution_clock::now()};
@@ -274,3 +380,92 @@ void N_body_sim::update_nodes() noexcept
         std::chrono::duration_cast<std::chrono::duration<float>>(now - sw_start).count();
     sal::Log::info("update_nodes_time: {}", time_diff);
 }
+
+void N_body_sim::log_step() const noexcept
+{
+    Simulation::Step_stats const& step{m_simulation.last_step()};
+    Oct const& tree{m_simulation.tree()};
+    Oct::Stats const stats{tree.stats()};
+
+    sal::Log::info("tree_update_time ({} refits, {} builds ({})): {}", step.tree_refits,
+                   step.tree_builds, Oct::str(m_simulation.build_mode()), step.tree_time);
+    sal::Log::info("tree: root width {:.0f}, {} cells, {} leaves, depth {} (leaf mean {:.1f}), "
+                   "leaf size max {} mean {:.2f}",
+                   stats.root_width, stats.cell_count, stats.leaf_count, stats.max_depth,
+                   stats.mean_leaf_depth, stats.max_leaf_size, stats.mean_leaf_size);
+    sal::Log::info("force_time ({} threads, {} {}, {}, {} at {}): {}, interactions/s: {:.3e}",
+                   m_simulation.thread_count(), kernels::str(m_simulation.kernel_isa()),
+                   kernels::str(m_simulation.precision()),
+                   Simulation::str(m_simulation.walk_mode()), Oct::str(tree.multipole_order()),
+                   tree.opening_angle(), step.force_time,
+                   static_cast<double>(step.interactions) / std::max(step.force_time, 1e-9f));
+    sal::Log::info("integrate_time ({} sub-steps, {} force evaluations): {}", step.sub_steps,
+                   step.force_evaluations, step.integrate_time);
+}
+
+
+void N_body_sim::save_snapshot() noexcept
+{
+    /// Written on the writer's thread, the file is closed once the next snapshot is taken.
+    Particles const& particles{m_simulation.particles()};
+    if (!m_snapshot_writer.open(snapshot_file, particles.size())
+        || !m_snapshot_writer.write(particles, m_step_count, m_sim_time)) {
+        sal::Log::warn("Can't write snapshot: {}", snapshot_file);
+        return;
+    }
+    sal::Log::info("Saved {} bodies to {}", particles.size(), snapshot_file);
+}
+
+void N_body_sim::load_snapshot() noexcept
+{
+    m_snapshot_writer.close();
+    m_replay.close();
+
+    snapshot::Reader reader;
+    if (!reader.open(snapshot_file) || (reader.frame_count() == 0)) {
+        sal::Log::warn("Can't read snapshot: {}", snapshot_file);
+        return;
+    }
+
+    std::size_t const frame{reader.frame_count() - 1};
+    m_simulation.clear();
+    reader.load(frame, m_simulation.particles());
+    m_step_count = reader.frame(frame).step;
+    m_sim_time = reader.frame(frame).time;
+
+    sal::Log::info("Loaded {} bodies from {}", reader.body_count(), snapshot_file);
+}
+
+void N_body_sim::toggle_recording() noexcept
+{
+    if (m_recorder.is_open()) {
+        m_recorder.close();
+        sal::Log::info("Recorded {} frames to {}", m_recorder.frames_written(), recording_file);
+        return;
+    }
+
+    if (!m_recorder.open(recording_file, m_simulation.particles().size())) {
+        sal::Log::warn("Can't write recording: {}", recording_file);
+        return;
+    }
+    sal::Log::info("Recording to {}", recording_file);
+}
+
+void N_body_sim::toggle_replay() noexcept
+{
+    if (m_replay.is_open()) {
+        m_replay.close();
+        sal::Log::info("Replay stopped");
+        return;
+    }
+
+    m_recorder.close();
+    if (!m_replay.open(recording_file) || (m_replay.frame_count() == 0)
+        || (m_replay.body_count() != m_simulation.particles().size())) {
+        m_replay.close();
+        sal::Log::warn("Can't replay {} over the current bodies", recording_file);
+        return;
+    }
+    m_replay_frame = 0;
+    sal::Log::info("Replaying {} frames from {}", m_replay.frame_count(), recording_file);
+}
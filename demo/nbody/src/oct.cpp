@@ -4,224 +4,1297 @@
 
 #include "oct.h"
 
-#include "log.h"
-
 #include <algorithm>
+#include <atomic>
+#include <cmath>
+
+namespace {
+
+/// Starting capacity of the cell array, it grows on demand and is then kept between frames.
+constexpr std::size_t initial_cell_capacity{1 << 16};
+
+/// A refitted leaf counts a body as escaped once it is further than this share of the leaf's
+/// width outside of the box.
+constexpr float loose_slack{0.5f};
+
+/// Keeps tree levels with only a few cells on the calling thread.
+constexpr std::size_t min_cells_per_job{256};
+
+/// The parallel build splits the top of the tree until every subtree holds at most 1 /
+/// (subtrees_per_thread * threads) of the bodies, so clustered bodies still spread over the
+/// workers. Smaller subtrees cost more to stitch than building them saves.
+constexpr std::size_t subtrees_per_thread{8};
+constexpr std::size_t min_subtree_size{2048};
+
+/// Subtrees the dual-tree traversal splits the targets into per worker, for the same reason as
+/// subtrees_per_thread.
+constexpr std::size_t dual_tree_tasks_per_thread{8};
+
+/// Queries on the calling thread below this many points.
+constexpr std::size_t min_queries_per_job{64};
+
+/// Relative slack on the distance bounds of neighbour queries. Cells are only skipped or taken
+/// whole when float rounding can't change the answer of testing their bodies one by one.
+constexpr float query_margin{1e-3f};
+
+/// Adds the second moment of a point mass at offset d from the center of mass.
+void add_quadrupole(std::array<double, 6>& q,
+                    double const m,
+                    double const dx,
+                    double const dy,
+                    double const dz) noexcept
+{
+    q[0] += m * dx * dx;
+    q[1] += m * dy * dy;
+    q[2] += m * dz * dz;
+    q[3] += m * dx * dy;
+    q[4] += m * dx * dz;
+    q[5] += m * dy * dz;
+}
+
+} // namespace
+
+void Oct::build(glm::vec3 const front_top_left,
+                glm::vec3 const back_bot_right,
+                Particles const& particles,
+                Build_mode const mode,
+                sal::Job_pool& pool) noexcept
+{
+    reset(front_top_left, back_bot_right);
+
+    switch (mode) {
+    case Build_mode::insertion: {
+        m_next_body.resize(particles.size());
+        for (std::uint32_t i{0}; i < particles.size(); i++) {
+            insert(particles, i);
+        }
+        sort_depth_first();
+        gather_bodies(0);
+        break;
+    }
+    case Build_mode::morton: {
+        sort_by_key(particles, pool);
+        build_subtrees(pool);
+        break;
+    }
+    }
+
+    m_particle_count = particles.size();
+    m_built_leaf_size = m_leaf_size;
+
+    gather_particles(particles, pool);
+    sort_cells_by_depth();
+    compute_moments(pool);
+    fill_walk_cells(pool);
+
+    collect_groups();
+    compute_group_bounds(pool);
+}
+
+Oct::Box Oct::root_cube(Box const& bounds) noexcept
+{
+    if ((bounds.min.x > bounds.max.x) || (bounds.min.y > bounds.max.y)
+        || (bounds.min.z > bounds.max.z)) {
+        return {glm::vec3{-min_root_width / 2.f}, glm::vec3{min_root_width / 2.f}};
+    }
+
+    glm::vec3 const extent{bounds.max - bounds.min};
+    glm::vec3 const center{(bounds.min + bounds.max) / 2.f};
+    float const half_width{std::max({extent.x, extent.y, extent.z, min_root_width})
+                           * (0.5f + root_padding)};
+    return {center - glm::vec3{half_width}, center + glm::vec3{half_width}};
+}
+
+bool Oct::refit(Particles const& particles, sal::Job_pool& pool) noexcept
+{
+    if (m_cells.empty() || particles.size() != m_particle_count
+        || m_leaf_size != m_built_leaf_size) {
+        return false;
+    }
+
+    gather_particles(particles, pool);
+    compute_moments(pool);
+    std::uint64_t const escaped{refit_bounds(pool)};
+    fill_walk_cells(pool);
+
+    compute_group_bounds(pool);
+
+    return static_cast<float>(escaped)
+           <= m_max_escaped_fraction * static_cast<float>(m_order.size());
+}
+
+float Oct::max_escaped_fraction() const noexcept
+{
+    return m_max_escaped_fraction;
+}
+
+void Oct::set_max_escaped_fraction(float const fraction) noexcept
+{
+    m_max_escaped_fraction = std::max(fraction, 0.f);
+}
+
+void Oct::interactions(std::uint32_t const body,
+                       kernels::Interaction_list& list,
+                       kernels::Quadrupole_list& far) const noexcept
+{
+    list.clear();
+    far.clear();
+
+    glm::vec3 const target{position(body)};
+    Cell_index const end{static_cast<Cell_index>(m_walk_cells.size())};
+    Cell_index index{0};
+
+    while (index < end) {
+        Walk_cell const& cell{m_walk_cells[index]};
+        bool const leaf{cell.skip == index + 1};
+
+        /// A leaf of a single body or of the target itself is always summed directly.
+        bool const own{body - cell.first_body < cell.body_count};
+        bool const direct{leaf && ((cell.body_count <= 1) || own)};
+
+        /// Above an angle of 1/sqrt(3) a cell can pass the test from a body inside of it, which
+        /// would then feel its own mass. Nothing inside is further than the radius.
+        float const dist{glm::distance(target, cell.center_of_mass)};
+
+        if (!direct && (dist > m_radii[index]) && (cell.width / dist < m_opening_angle)) {
+            push_far(index, list, far);
+            index = cell.skip;
+        }
+        else if (leaf) {
+            for (std::uint32_t b{cell.first_body}; b < cell.first_body + cell.body_count; b++) {
+                if (b != body) {
+                    list.push(m_x[b], m_y[b], m_z[b], m_mass[b]);
+                }
+            }
+            index = cell.skip;
+        }
+        else {
+            index++;
+        }
+    }
+}
+
+void Oct::interactions(Group const& group,
+                       kernels::Interaction_list& list,
+                       kernels::Quadrupole_list& far) const noexcept
+{
+    list.clear();
+    far.clear();
+
+    walk_group(
+        m_walk_cells, m_radii, group, m_opening_angle,
+        [&](Cell_index const index) { push_far(index, list, far); },
+        [&](Cell_index const index) {
+            Walk_cell const& cell{m_walk_cells[index]};
+            for (std::uint32_t b{cell.first_body}; b < cell.first_body + cell.body_count; b++) {
+                list.push(m_x[b], m_y[b], m_z[b], m_mass[b]);
+            }
+        });
+}
+
+void Oct::interactions(Group const& group,
+                       float const cutoff,
+                       kernels::Interaction_list& list) const noexcept
+{
+    list.clear();
+
+    Cell_index const end{static_cast<Cell_index>(m_walk_cells.size())};
+    Cell_index index{0};
+
+    while (index < end) {
+        Walk_cell const& cell{m_walk_cells[index]};
+
+        glm::vec3 const closest{glm::min(glm::max(cell.center_of_mass, group.min), group.max)};
+        float const dist{glm::distance(closest, cell.center_of_mass)};
+
+        bool const leaf{cell.skip == index + 1};
+
+        if ((cell.body_count == 0) || (dist - m_radii[index] > cutoff)) {
+            index = cell.skip;
+        }
+        else if ((!leaf || cell.body_count > 1) && (dist > m_radii[index])
+                 && (cell.width / dist < m_opening_angle)) {
+            list.push(cell.center_of_mass.x, cell.center_of_mass.y, cell.center_of_mass.z,
+                      cell.mass);
+            index = cell.skip;
+        }
+        else if (leaf) {
+            for (std::uint32_t b{cell.first_body}; b < cell.first_body + cell.body_count; b++) {
+                list.push(m_x[b], m_y[b], m_z[b], m_mass[b]);
+            }
+            index = cell.skip;
+        }
+        else {
+            index++;
+        }
+    }
+}
 
-Oct::Oct(glm::vec3 const front_top_left, glm::vec3 const back_bot_right) noexcept
-    : m_front_top_left(front_top_left), m_back_bottom_right(back_bot_right)
+std::span<Oct::Group const> Oct::groups() const noexcept
 {
-    m_width = back_bot_right.x - m_front_top_left.x;
-    m_height = back_bot_right.y - m_front_top_left.y;
-    m_depth = back_bot_right.z - m_front_top_left.z;
+    return m_groups;
 }
 
+void Oct::within_radius(glm::vec3 const& point,
+                        float const radius,
+                        std::vector<std::uint32_t>& out) const noexcept
+{
+    float const radius_squared{radius * radius};
+    Cell_index const end{static_cast<Cell_index>(m_walk_cells.size())};
+    Cell_index index{0};
+
+    while (index < end) {
+        Walk_cell const& cell{m_walk_cells[index]};
+        float const distance{glm::distance(point, cell.center_of_mass)};
+        float const cell_radius{m_radii[index]};
 
-void Oct::update_force(std::shared_ptr<Node> const& node) noexcept
+        if ((cell.body_count == 0) || (distance - cell_radius > radius * (1.f + query_margin))) {
+            index = cell.skip;
+        }
+        else if (distance + cell_radius < radius * (1.f - query_margin)) {
+            auto const first{m_order.begin() + cell.first_body};
+            out.insert(out.end(), first, first + cell.body_count);
+            index = cell.skip;
+        }
+        else if (cell.skip == index + 1) {
+            for (std::uint32_t b{cell.first_body}; b < cell.first_body + cell.body_count; b++) {
+                glm::vec3 const d{position(b) - point};
+                if (glm::dot(d, d) <= radius_squared) {
+                    out.push_back(m_order[b]);
+                }
+            }
+            index = cell.skip;
+        }
+        else {
+            index++;
+        }
+    }
+}
+
+void Oct::nearest(glm::vec3 const& point,
+                  std::uint32_t const k,
+                  std::vector<Neighbour>& out) const noexcept
 {
-    if (!node) {
+    out.clear();
+    if ((k == 0) || m_walk_cells.empty()) {
         return;
     }
 
-    if ((!m_node) || (m_node == node)) {
+    /// out is a max-heap on the distance until the end, its front is the k-th nearest body.
+    auto const nearer{[](Neighbour const& a, Neighbour const& b) {
+        return a.distance_squared < b.distance_squared;
+    }};
+
+    /// Cells left to visit and the closest any of their bodies can be. Every level of the tree
+    /// leaves at most 7 siblings behind on the stack.
+    struct Pending {
+        Cell_index index{0};
+        float min_distance{0.f};
+    };
+    std::array<Pending, 8 * (max_depth + 2)> stack;
+    std::size_t top{0};
+    stack[top++] = {0, 0.f};
+
+    float bound{std::numeric_limits<float>::max()};
+    while (top > 0) {
+        Pending const pending{stack[--top]};
+        if (pending.min_distance > bound * (1.f + query_margin)) {
+            continue;
+        }
+
+        Walk_cell const& cell{m_walk_cells[pending.index]};
+        if (cell.skip == pending.index + 1) {
+            for (std::uint32_t b{cell.first_body}; b < cell.first_body + cell.body_count; b++) {
+                glm::vec3 const d{position(b) - point};
+                Neighbour const neighbour{m_order[b], glm::dot(d, d)};
+                if (out.size() < k) {
+                    out.push_back(neighbour);
+                    std::push_heap(out.begin(), out.end(), nearer);
+                }
+                else if (neighbour.distance_squared < out.front().distance_squared) {
+                    std::pop_heap(out.begin(), out.end(), nearer);
+                    out.back() = neighbour;
+                    std::push_heap(out.begin(), out.end(), nearer);
+                }
+            }
+            if (out.size() == k) {
+                bound = std::sqrt(out.front().distance_squared);
+            }
+            continue;
+        }
+
+        /// Children follow their parent and each one's skip is the next one. They are inserted
+        /// furthest first, so the nearest child goes on top of the stack.
+        std::array<Pending, 8> children;
+        std::size_t child_count{0};
+        for (Cell_index c{pending.index + 1}; (c < cell.skip) && (child_count < children.size());
+             c = m_walk_cells[c].skip) {
+            Walk_cell const& child{m_walk_cells[c]};
+            if (child.body_count == 0) {
+                continue;
+            }
+
+            Pending const next{
+                c, std::max(0.f, glm::distance(point, child.center_of_mass) - m_radii[c])};
+            std::size_t i{child_count++};
+            for (; (i > 0) && (children[i - 1].min_distance < next.min_distance); i--) {
+                children[i] = children[i - 1];
+            }
+            children[i] = next;
+        }
+        for (std::size_t i{0}; i < child_count; i++) {
+            stack[top++] = children[i];
+        }
+    }
+
+    std::sort_heap(out.begin(), out.end(), nearer);
+}
+
+void Oct::within_radius(sal::Job_pool& pool,
+                        std::span<glm::vec3 const> const points,
+                        float const radius,
+                        std::vector<std::vector<std::uint32_t>>& out) const noexcept
+{
+    out.resize(points.size());
+    sal::parallel_for(
+        pool, points.size(),
+        [&](std::size_t const begin, std::size_t const end) {
+            for (std::size_t i{begin}; i < end; i++) {
+                out[i].clear();
+                within_radius(points[i], radius, out[i]);
+            }
+        },
+        min_queries_per_job);
+}
+
+void Oct::nearest(sal::Job_pool& pool,
+                  std::span<glm::vec3 const> const points,
+                  std::uint32_t const k,
+                  std::vector<std::vector<Neighbour>>& out) const noexcept
+{
+    out.resize(points.size());
+    sal::parallel_for(
+        pool, points.size(),
+        [&](std::size_t const begin, std::size_t const end) {
+            for (std::size_t i{begin}; i < end; i++) {
+                nearest(points[i], k, out[i]);
+            }
+        },
+        min_queries_per_job);
+}
+
+std::uint64_t Oct::dual_tree(sal::Job_pool& pool,
+                             kernels::Kernel const kernel,
+                             std::span<std::uint8_t const> const active,
+                             Particles& particles) noexcept
+{
+    if (m_walk_cells.empty()) {
+        return 0;
+    }
+
+    m_active_prefix.resize(m_order.size() + 1);
+    m_active_prefix[0] = 0;
+    for (std::size_t i{0}; i < m_order.size(); i++) {
+        m_active_prefix[i + 1] = m_active_prefix[i] + active[m_order[i]];
+    }
+
+    /// Each task traverses its subtree against the whole tree, the few cells above the tasks
+    /// only cost their far interactions being taken in once per task.
+    std::size_t const task_size{std::max<std::size_t>(
+        m_group_size, m_order.size() / (pool.thread_count() * dual_tree_tasks_per_thread))};
+
+    m_dual_tree_tasks.clear();
+    Cell_index const end{static_cast<Cell_index>(m_walk_cells.size())};
+    Cell_index index{0};
+    while (index < end) {
+        Walk_cell const& cell{m_walk_cells[index]};
+        if ((cell.body_count <= task_size) || (cell.skip == index + 1)) {
+            if (active_count(index) > 0) {
+                m_dual_tree_tasks.push_back(index);
+            }
+            index = cell.skip;
+        }
+        else {
+            index++;
+        }
+    }
+
+    std::atomic<std::uint64_t> interaction_count{0};
+    sal::parallel_for(pool, m_dual_tree_tasks.size(), [&](std::size_t const begin,
+                                                          std::size_t const end) {
+        Dual_tree_scratch scratch;
+        std::array<Cell_index, 1> const root{0};
+        std::uint64_t chunk_interactions{0};
+
+        for (std::size_t t{begin}; t < end; t++) {
+            chunk_interactions += descend_dual_tree(m_dual_tree_tasks[t], Local{}, root, 0, kernel,
+                                                    active, particles, scratch);
+        }
+
+        interaction_count += chunk_interactions;
+    });
+
+    return interaction_count.load();
+}
+
+std::uint32_t Oct::group_size() const noexcept
+{
+    return m_group_size;
+}
+
+void Oct::set_group_size(std::uint32_t const size) noexcept
+{
+    m_group_size = std::max(size, 1u);
+}
+
+std::uint32_t Oct::leaf_size() const noexcept
+{
+    return m_leaf_size;
+}
+
+void Oct::set_leaf_size(std::uint32_t const size) noexcept
+{
+    m_leaf_size = std::max(size, 1u);
+}
+
+Oct::Multipole_order Oct::multipole_order() const noexcept
+{
+    return m_multipole_order;
+}
+
+void Oct::set_multipole_order(Multipole_order const order) noexcept
+{
+    m_multipole_order = order;
+}
+
+float Oct::opening_angle() const noexcept
+{
+    return m_opening_angle;
+}
+
+void Oct::set_opening_angle(float const angle) noexcept
+{
+    m_opening_angle = std::max(angle, 0.f);
+}
+
+glm::vec3 Oct::position(std::uint32_t const body) const noexcept
+{
+    return {m_x[body], m_y[body], m_z[body]};
+}
+
+float Oct::mass(std::uint32_t const body) const noexcept
+{
+    return m_mass[body];
+}
+
+glm::vec3 const& Oct::center_of_mass() const noexcept
+{
+    static glm::vec3 const origin{0.f};
+    return m_cells.empty() ? origin : m_cells.front().center_of_mass;
+}
+
+std::span<std::uint32_t const> Oct::order() const noexcept
+{
+    return m_order;
+}
+
+std::size_t Oct::cell_count() const noexcept
+{
+    return m_cells.size();
+}
+
+std::span<Oct::Walk_cell const> Oct::walk_cells() const noexcept
+{
+    return m_walk_cells;
+}
+
+std::span<float const> Oct::radii() const noexcept
+{
+    return m_radii;
+}
+
+Oct::Stats Oct::stats() const noexcept
+{
+    Stats stats{};
+    stats.cell_count = m_cells.size();
+    if (!m_cells.empty()) {
+        stats.root_width = m_cells.front().width;
+    }
+
+    std::uint64_t depth_sum{0};
+    std::uint64_t size_sum{0};
+    for (Cell const& cell : m_cells) {
+        stats.max_depth = std::max(stats.max_depth, cell.depth);
+        if (cell.is_external() && cell.body_count > 0) {
+            stats.leaf_count++;
+            stats.max_leaf_size = std::max(stats.max_leaf_size, cell.body_count);
+            depth_sum += cell.depth;
+            size_sum += cell.body_count;
+        }
+    }
+
+    if (stats.leaf_count > 0) {
+        stats.mean_leaf_depth = static_cast<float>(depth_sum) / stats.leaf_count;
+        stats.mean_leaf_size = static_cast<float>(size_sum) / stats.leaf_count;
+    }
+    return stats;
+}
+
+char const* Oct::str(Build_mode const mode) noexcept
+{
+    switch (mode) {
+    case Build_mode::insertion:
+        return "insertion";
+    case Build_mode::morton:
+        return "morton";
+    }
+    return "unknown";
+}
+
+char const* Oct::str(Multipole_order const order) noexcept
+{
+    switch (order) {
+    case Multipole_order::monopole:
+        return "monopole";
+    case Multipole_order::quadrupole:
+        return "quadrupole";
+    }
+    return "unknown";
+}
+
+
+///
+/// Private section:
+///
+bool Oct::Cell::is_external() const noexcept
+{
+    return child_count == 0;
+}
+
+bool Oct::Cell::in_boundary(glm::vec3 const& point) const noexcept
+{
+    return (point.x >= front_top_left.x) && (point.x <= back_bottom_right.x)
+           && (point.y >= front_top_left.y) && (point.y <= back_bottom_right.y)
+           && (point.z >= front_top_left.z) && (point.z <= back_bottom_right.z);
+}
+
+std::size_t Oct::Cell::octant(glm::vec3 const& point) const noexcept
+{
+    glm::vec3 const mid{(front_top_left + back_bottom_right) / 2.f};
+
+    /// Octant numbering follows the children layout documented above.
+    return (mid.z >= point.z ? 0u : 4u) + (mid.x >= point.x ? 0u : 2u)
+           + (mid.y >= point.y ? 0u : 1u);
+}
+
+void Oct::reset(glm::vec3 const front_top_left, glm::vec3 const back_bot_right) noexcept
+{
+    /// clear() keeps the capacity, so steady state rebuilds don't allocate.
+    m_cells.clear();
+    if (m_cells.capacity() == 0) {
+        m_cells.reserve(initial_cell_capacity);
+    }
+    m_order.clear();
+
+    create_cell(front_top_left, back_bot_right);
+}
+
+Oct::Cell_index Oct::create_cell(glm::vec3 const front_top_left,
+                                 glm::vec3 const back_bot_right) noexcept
+{
+    Cell cell{};
+    cell.front_top_left = front_top_left;
+    cell.back_bottom_right = back_bot_right;
+    cell.width = back_bot_right.x - front_top_left.x;
+
+    m_cells.push_back(cell);
+    return static_cast<Cell_index>(m_cells.size() - 1);
+}
+
+Oct::Cell_index Oct::create_child(Cell_index const parent, std::size_t const octant) noexcept
+{
+    return create_child(m_cells, parent, octant);
+}
+
+Oct::Cell_index Oct::create_child(std::vector<Cell>& cells,
+                                  Cell_index const parent,
+                                  std::size_t const octant) noexcept
+{
+    glm::vec3 const ftl{cells[parent].front_top_left};
+    glm::vec3 const bbr{cells[parent].back_bottom_right};
+    glm::vec3 const mid{(ftl + bbr) / 2.f};
+
+    bool const high_x{(octant & 2u) != 0};
+    bool const high_y{(octant & 1u) != 0};
+    bool const high_z{(octant & 4u) != 0};
+
+    Cell child{};
+    child.front_top_left =
+        glm::vec3{high_x ? mid.x : ftl.x, high_y ? mid.y : ftl.y, high_z ? mid.z : ftl.z};
+    child.back_bottom_right =
+        glm::vec3{high_x ? bbr.x : mid.x, high_y ? bbr.y : mid.y, high_z ? bbr.z : mid.z};
+    child.width = child.back_bottom_right.x - child.front_top_left.x;
+    child.depth = cells[parent].depth + 1;
+    cells.push_back(child);
+
+    Cell_index const index{static_cast<Cell_index>(cells.size() - 1)};
+    cells[parent].children[octant] = index;
+    cells[parent].child_count++;
+    return index;
+}
+
+void Oct::insert(Particles const& particles, std::uint32_t const body) noexcept
+{
+    glm::vec3 const position{particles.position(body)};
+
+    if (!m_cells.front().in_boundary(position)) {
         return;
     }
 
-    static const double G = 6.67e-11;
-    static const double eps = 100;
-    static const float thresh = 0.5f;
+    Cell_index current{0};
 
-    static const double smoothing = 0.0;
+    while (true) {
+        Cell& cell{m_cells[current]};
+
+        if (cell.is_external()) {
+            if (cell.body_count < m_leaf_size || cell.depth == max_depth) {
+                m_next_body[body] = cell.first_body;
+                cell.first_body = body;
+                cell.body_count++;
+                return;
+            }
 
+            /// This leaf is full, push its bodies down one level and keep descending. All of them
+            /// may land in the same child, which then splits when the next body reaches it.
+            /// Note: creating a cell may reallocate, so `cell` must not be used after this.
+            std::uint32_t resident{cell.first_body};
+            cell.first_body = no_body;
+            cell.body_count = 0;
 
-    if (is_external()) {
-        glm::vec3 delta{node->position - m_node->position};
-        double const dist{sqrt(delta.x * delta.x + delta.y * delta.y + delta.z * delta.z)};
-        double const F{(G * m_node->mass * node->mass) / (dist * dist + eps * eps)};
-        node->force -= glm::vec3{F * delta.x / (dist + smoothing), F * delta.y / (dist + smoothing),
-                                 F * delta.z / (dist + smoothing)};
+            while (resident != no_body) {
+                std::uint32_t const next{m_next_body[resident]};
+                std::size_t const octant{m_cells[current].octant(particles.position(resident))};
+                Cell_index child{m_cells[current].children[octant]};
+                if (child == no_cell) {
+                    child = create_child(current, octant);
+                }
+
+                m_next_body[resident] = m_cells[child].first_body;
+                m_cells[child].first_body = resident;
+                m_cells[child].body_count++;
+                resident = next;
+            }
+        }
+
+        std::size_t const octant{m_cells[current].octant(position)};
+        Cell_index child{m_cells[current].children[octant]};
+        if (child == no_cell) {
+            child = create_child(current, octant);
+        }
+
+        current = child;
     }
-    else if (m_width
-                 / sqrt((node->position.x - m_center_of_mass.x)
-                            * (node->position.x - m_center_of_mass.x)
-                        + (node->position.y - m_center_of_mass.y)
-                              * (node->position.y - m_center_of_mass.y)
-                        + (node->position.z - m_center_of_mass.z)
-                              * (node->position.z - m_center_of_mass.z))
-             < thresh) {
-        glm::vec3 delta{node->position - m_center_of_mass};
-        double const dist{sqrt(delta.x * delta.x + delta.y * delta.y + delta.z * delta.z)};
-        double const F{(G * m_node->mass * node->mass) / (dist * dist + eps * eps)};
-        node->force -= glm::vec3{F * delta.x / dist, F * delta.y / dist, F * delta.z / dist};
+}
+
+void Oct::gather_bodies(Cell_index const index) noexcept
+{
+    std::uint32_t const first{static_cast<std::uint32_t>(m_order.size())};
+
+    if (m_cells[index].is_external()) {
+        for (std::uint32_t body{m_cells[index].first_body}; body != no_body;
+             body = m_next_body[body]) {
+            m_order.push_back(body);
+        }
     }
     else {
-        for (auto& child : m_children) {
-            if (child) {
-                child->update_force(node);
+        for (Cell_index const child : m_cells[index].children) {
+            if (child != no_cell) {
+                gather_bodies(child);
             }
         }
     }
+
+    m_cells[index].first_body = first;
+    m_cells[index].body_count = static_cast<std::uint32_t>(m_order.size()) - first;
 }
 
-void Oct::insert(std::shared_ptr<Node> const& node) noexcept
+void Oct::sort_depth_first() noexcept
 {
-    if (!node) {
-        return;
+    m_cell_scratch.clear();
+    m_cell_scratch.reserve(m_cells.size());
+    copy_depth_first(0);
+    m_cells.swap(m_cell_scratch);
+}
+
+Oct::Cell_index Oct::copy_depth_first(Cell_index const index) noexcept
+{
+    Cell_index const copy{static_cast<Cell_index>(m_cell_scratch.size())};
+    m_cell_scratch.push_back(m_cells[index]);
+
+    for (std::size_t octant{0}; octant < 8; octant++) {
+        Cell_index const child{m_cells[index].children[octant]};
+        if (child != no_cell) {
+            m_cell_scratch[copy].children[octant] = copy_depth_first(child);
+        }
     }
 
-    if (!in_boundary(node->position)) {
+    m_cell_scratch[copy].skip = static_cast<Cell_index>(m_cell_scratch.size());
+    return copy;
+}
+
+void Oct::sort_by_key(Particles const& particles, sal::Job_pool& pool) noexcept
+{
+    Cell const& root{m_cells.front()};
+    glm::vec3 const min{root.front_top_left};
+    glm::vec3 const size{root.back_bottom_right - root.front_top_left};
+
+    m_keys.resize(particles.size());
+    sal::parallel_for(pool, particles.size(), [&](std::size_t const begin, std::size_t const end) {
+        for (std::size_t i{begin}; i < end; i++) {
+            m_keys[i] = {morton::key(particles.position(i), min, size),
+                         static_cast<std::uint32_t>(i)};
+        }
+    });
+
+    morton::radix_sort(pool, m_keys, m_key_scratch);
+
+    /// Bodies outside of the root sort last, leave them out.
+    auto const valid_end{std::partition_point(
+        m_keys.begin(), m_keys.end(),
+        [](morton::Entry const& entry) -> bool { return entry.key != morton::invalid_key; })};
+    m_keys.erase(valid_end, m_keys.end());
+
+    m_order.resize(m_keys.size());
+    sal::parallel_for(pool, m_keys.size(), [&](std::size_t const begin, std::size_t const end) {
+        for (std::size_t i{begin}; i < end; i++) {
+            m_order[i] = m_keys[i].index;
+        }
+    });
+
+    m_cells.front().first_body = 0;
+    m_cells.front().body_count = static_cast<std::uint32_t>(m_keys.size());
+}
+
+void Oct::split_sorted(std::vector<Cell>& cells,
+                       Cell_index const index,
+                       std::uint32_t const subtree_size) const noexcept
+{
+    std::uint32_t const first{cells[index].first_body};
+    std::uint32_t const count{cells[index].body_count};
+    std::uint32_t const depth{cells[index].depth};
+
+    if (count <= m_leaf_size || depth == max_depth) {
+        cells[index].skip = index + 1;
         return;
     }
 
-    double const total_mass{m_total_mass + node->mass};
-    glm::vec3 const new_center_mass{
-        static_cast<float>((node->position.x * node->mass + m_center_of_mass.x * m_total_mass)
-                           / total_mass),
-        static_cast<float>((node->position.y * node->mass + m_center_of_mass.y * m_total_mass)
-                           / total_mass),
-        static_cast<float>((node->position.z * node->mass + m_center_of_mass.z * m_total_mass)
-                           / total_mass)};
-    m_center_of_mass = new_center_mass;
+    /// The keys of the range share their first `depth` digits, so the children are the runs of
+    /// the next digit. Children are split right after they are created, which lays the cells out
+    /// in depth-first order.
+    auto begin{m_keys.begin() + first};
+    auto const end{begin + count};
+    while (begin != end) {
+        std::uint32_t const octant{morton::digit(begin->key, depth)};
+        auto const run_end{std::partition_point(
+            begin, end, [depth, octant](morton::Entry const& entry) -> bool {
+                return morton::digit(entry.key, depth) == octant;
+            })};
 
-    m_total_mass += node->mass;
+        Cell_index const child{create_child(cells, index, octant)};
+        cells[child].first_body = static_cast<std::uint32_t>(begin - m_keys.begin());
+        cells[child].body_count = static_cast<std::uint32_t>(run_end - begin);
 
-    if (!m_node) {
-        m_node = node;
+        if (cells[child].body_count > m_leaf_size && cells[child].body_count <= subtree_size) {
+            cells[child].skip = no_cell;
+        }
+        else {
+            split_sorted(cells, child, subtree_size);
+        }
+
+        begin = run_end;
+    }
+
+    cells[index].skip = static_cast<Cell_index>(cells.size());
+}
+
+void Oct::build_subtrees(sal::Job_pool& pool) noexcept
+{
+    std::size_t const thread_count{pool.thread_count()};
+    std::size_t const subtree_size{
+        std::max(m_keys.size() / (thread_count * subtrees_per_thread), min_subtree_size)};
+
+    /// A single worker splits in place, stitching would only add a copy.
+    if (thread_count == 1 || m_keys.size() <= subtree_size) {
+        split_sorted(m_cells, 0, 0);
         return;
     }
 
-    /// This Oct already has a node, we need to subdivide.
-    if ((m_front_top_left.z + m_back_bottom_right.z) / 2 >= node->position.z) {
+    split_sorted(m_cells, 0, static_cast<std::uint32_t>(subtree_size));
 
-        if ((m_front_top_left.x + m_back_bottom_right.x) / 2 >= node->position.x) {
-            // Indicates topLeftTree
-            if ((m_front_top_left.y + m_back_bottom_right.y) / 2 >= node->position.y) {
-                if (!m_children.at(0)) {
-                    m_children.at(0) = std::make_shared<Oct>(
-                        Oct(glm::vec3(m_front_top_left.x, m_front_top_left.y, m_front_top_left.z),
-                            glm::vec3((m_front_top_left.x + m_back_bottom_right.x) / 2,
-                                      (m_front_top_left.y + m_back_bottom_right.y) / 2,
-                                      (m_front_top_left.z + m_back_bottom_right.z) / 2)));
-                }
+    /// Cells are created depth-first, so the unsplit ones are found in the order the stitch
+    /// reaches them.
+    m_subtree_roots.clear();
+    for (Cell_index i{1}; i < m_cells.size(); i++) {
+        if (m_cells[i].skip == no_cell) {
+            m_subtree_roots.push_back(i);
+        }
+    }
 
-                m_children.at(0)->insert(node);
+    if (m_arenas.size() < m_subtree_roots.size()) {
+        m_arenas.resize(m_subtree_roots.size());
+    }
+
+    sal::parallel_for(pool, m_subtree_roots.size(), [&](std::size_t const begin,
+                                                         std::size_t const end) {
+        for (std::size_t i{begin}; i < end; i++) {
+            std::vector<Cell>& arena{m_arenas[i]};
+            arena.clear();
+            arena.push_back(m_cells[m_subtree_roots[i]]);
+            split_sorted(arena, 0, 0);
+        }
+    });
+
+    std::size_t cell_count{m_cells.size()};
+    for (std::size_t i{0}; i < m_subtree_roots.size(); i++) {
+        cell_count += m_arenas[i].size() - 1;
+    }
+
+    m_cell_scratch.clear();
+    m_cell_scratch.reserve(cell_count);
+    m_subtree_offsets.resize(m_subtree_roots.size());
+    std::size_t subtree{0};
+    stitch_top(0, subtree);
+
+    /// Arena indices are local to the subtree, shift them to where it landed.
+    sal::parallel_for(pool, m_subtree_roots.size(), [&](std::size_t const begin,
+                                                         std::size_t const end) {
+        for (std::size_t i{begin}; i < end; i++) {
+            std::vector<Cell> const& arena{m_arenas[i]};
+            Cell_index const offset{static_cast<Cell_index>(m_subtree_offsets[i])};
+
+            for (std::size_t c{0}; c < arena.size(); c++) {
+                Cell& cell{m_cell_scratch[offset + c]};
+                cell = arena[c];
+                cell.skip += offset;
+                for (Cell_index& child : cell.children) {
+                    if (child != no_cell) {
+                        child += offset;
+                    }
+                }
             }
-            // Indicates botLeftTree
-            else {
-                if (!m_children.at(1)) {
-                    m_children.at(1) = std::make_shared<Oct>(
-                        glm::vec3(m_front_top_left.x,
-                                  (m_front_top_left.y + m_back_bottom_right.y) / 2,
-                                  m_front_top_left.z),
-                        glm::vec3((m_front_top_left.x + m_back_bottom_right.x) / 2,
-                                  m_back_bottom_right.y,
-                                  (m_front_top_left.z + m_back_bottom_right.z) / 2));
+        }
+    });
+
+    m_cells.swap(m_cell_scratch);
+}
+
+Oct::Cell_index Oct::stitch_top(Cell_index const index, std::size_t& subtree) noexcept
+{
+    Cell_index const copy{static_cast<Cell_index>(m_cell_scratch.size())};
+    m_cell_scratch.push_back(m_cells[index]);
+
+    if (m_cells[index].skip == no_cell) {
+        m_subtree_offsets[subtree] = copy;
+        m_cell_scratch.resize(copy + m_arenas[subtree].size());
+        subtree++;
+        return copy;
+    }
+
+    for (std::size_t octant{0}; octant < 8; octant++) {
+        Cell_index const child{m_cells[index].children[octant]};
+        if (child != no_cell) {
+            m_cell_scratch[copy].children[octant] = stitch_top(child, subtree);
+        }
+    }
+
+    m_cell_scratch[copy].skip = static_cast<Cell_index>(m_cell_scratch.size());
+    return copy;
+}
+
+void Oct::gather_particles(Particles const& particles, sal::Job_pool& pool) noexcept
+{
+    std::size_t const n{m_order.size()};
+    m_x.resize(n);
+    m_y.resize(n);
+    m_z.resize(n);
+    m_mass.resize(n);
+
+    sal::parallel_for(pool, n, [&](std::size_t const begin, std::size_t const end) {
+        for (std::size_t i{begin}; i < end; i++) {
+            std::uint32_t const p{m_order[i]};
+            m_x[i] = particles.x[p];
+            m_y[i] = particles.y[p];
+            m_z[i] = particles.z[p];
+            m_mass[i] = particles.mass[p];
+        }
+    });
+}
+
+void Oct::sort_cells_by_depth() noexcept
+{
+    /// Counting sort the cells by depth.
+    m_depth_offsets.fill(0);
+    for (Cell const& cell : m_cells) {
+        m_depth_offsets[cell.depth + 1]++;
+    }
+    for (std::size_t d{1}; d < m_depth_offsets.size(); d++) {
+        m_depth_offsets[d] += m_depth_offsets[d - 1];
+    }
+
+    m_cells_by_depth.resize(m_cells.size());
+    std::array<std::size_t, max_depth + 2> cursor{m_depth_offsets};
+    for (Cell_index i{0}; i < m_cells.size(); i++) {
+        m_cells_by_depth[cursor[m_cells[i].depth]++] = i;
+    }
+}
+
+template<class Fn>
+void Oct::for_each_level_up(sal::Job_pool& pool, Fn const& fn) noexcept
+{
+    /// Children are always one level deeper than their parent, so finishing a level before
+    /// starting the one above makes every child ready when its parent reads it.
+    for (std::size_t d{max_depth + 1}; d-- > 0;) {
+        std::size_t const level_begin{m_depth_offsets[d]};
+        std::size_t const level_size{m_depth_offsets[d + 1] - level_begin};
+
+        sal::parallel_for(
+            pool, level_size,
+            [&](std::size_t const begin, std::size_t const end) {
+                for (std::size_t i{level_begin + begin}; i < level_begin + end; i++) {
+                    fn(m_cells[m_cells_by_depth[i]]);
                 }
-                m_children.at(1)->insert(node);
+            },
+            min_cells_per_job);
+    }
+}
+
+void Oct::compute_moments(sal::Job_pool& pool) noexcept
+{
+    for_each_level_up(pool, [this](Cell& cell) {
+        double mass{0.0};
+        double x{0.0};
+        double y{0.0};
+        double z{0.0};
+
+        if (cell.is_external()) {
+            for (std::uint32_t b{cell.first_body}; b < cell.first_body + cell.body_count; b++) {
+                mass += m_mass[b];
+                x += static_cast<double>(m_x[b]) * m_mass[b];
+                y += static_cast<double>(m_y[b]) * m_mass[b];
+                z += static_cast<double>(m_z[b]) * m_mass[b];
             }
         }
         else {
-            // Indicates topRightTree
-            if ((m_front_top_left.y + m_back_bottom_right.y) / 2 >= node->position.y) {
-                if (!m_children.at(2)) {
-                    m_children.at(2) = std::make_shared<Oct>(
-                        glm::vec3((m_front_top_left.x + m_back_bottom_right.x) / 2,
-                                  m_front_top_left.y, m_front_top_left.z),
-                        glm::vec3(m_back_bottom_right.x,
-                                  (m_front_top_left.y + m_back_bottom_right.y) / 2,
-                                  (m_front_top_left.z + m_back_bottom_right.z) / 2));
+            for (Cell_index const c : cell.children) {
+                if (c != no_cell) {
+                    Cell const& child{m_cells[c]};
+                    mass += child.total_mass;
+                    x += child.center_of_mass.x * child.total_mass;
+                    y += child.center_of_mass.y * child.total_mass;
+                    z += child.center_of_mass.z * child.total_mass;
                 }
-                m_children.at(2)->insert(node);
             }
+        }
 
-            // Indicates botRightTree
-            else {
-                if (!m_children.at(3)) {
-                    m_children.at(3) = std::make_shared<Oct>(
-                        glm::vec3((m_front_top_left.x + m_back_bottom_right.x) / 2,
-                                  (m_front_top_left.y + m_back_bottom_right.y) / 2,
-                                  m_front_top_left.z),
-                        glm::vec3(m_back_bottom_right.x, m_back_bottom_right.y,
-                                  (m_front_top_left.z + m_back_bottom_right.z) / 2));
-                }
-                m_children.at(3)->insert(node);
+        cell.total_mass = mass;
+        if (mass > 0.0) {
+            cell.center_of_mass =
+                glm::vec3{static_cast<float>(x / mass), static_cast<float>(y / mass),
+                          static_cast<float>(z / mass)};
+        }
+
+        /// Children's spheres are grown to this cell's center of mass, which stays within
+        /// rounding of the true furthest body.
+        cell.radius = 0.f;
+        if (cell.is_external()) {
+            for (std::uint32_t b{cell.first_body}; b < cell.first_body + cell.body_count; b++) {
+                cell.radius =
+                    std::max(cell.radius, glm::distance(position(b), cell.center_of_mass));
             }
         }
-    }
-    else {
-        if ((m_front_top_left.x + m_back_bottom_right.x) / 2 >= node->position.x) {
-            // Indicates topLeftTree
-            if ((m_front_top_left.y + m_back_bottom_right.y) / 2 >= node->position.y) {
-                if (!m_children.at(4)) {
-                    m_children.at(4) = std::make_shared<Oct>(
-                        glm::vec3(m_front_top_left.x, m_front_top_left.y,
-                                  (m_front_top_left.z + m_back_bottom_right.z) / 2),
-                        glm::vec3((m_front_top_left.x + m_back_bottom_right.x) / 2,
-                                  (m_front_top_left.y + m_back_bottom_right.y) / 2,
-                                  m_back_bottom_right.z));
+        else {
+            for (Cell_index const c : cell.children) {
+                if ((c != no_cell) && (m_cells[c].body_count > 0)) {
+                    Cell const& child{m_cells[c]};
+                    cell.radius = std::max(cell.radius,
+                                           glm::distance(child.center_of_mass, cell.center_of_mass)
+                                               + child.radius);
                 }
-
-                m_children.at(4)->insert(node);
             }
+        }
 
-            // Indicates botLeftTree
-            else {
-                if (!m_children.at(5)) {
-                    m_children.at(5) = std::make_shared<Oct>(
-                        glm::vec3(m_front_top_left.x,
-                                  (m_front_top_left.y + m_back_bottom_right.y) / 2,
-                                  (m_front_top_left.z + m_back_bottom_right.z) / 2),
-                        glm::vec3((m_front_top_left.x + m_back_bottom_right.x) / 2,
-                                  m_back_bottom_right.y, m_back_bottom_right.z));
+        if (m_multipole_order == Multipole_order::monopole) {
+            return;
+        }
+
+        /// Children's moments are shifted to this cell's center of mass with the parallel axis
+        /// theorem, so the bodies are only visited once per build.
+        glm::dvec3 const com{cell.center_of_mass};
+        std::array<double, 6> q{};
+        if (cell.is_external()) {
+            for (std::uint32_t b{cell.first_body}; b < cell.first_body + cell.body_count; b++) {
+                add_quadrupole(q, m_mass[b], m_x[b] - com.x, m_y[b] - com.y, m_z[b] - com.z);
+            }
+        }
+        else {
+            for (Cell_index const c : cell.children) {
+                if (c != no_cell) {
+                    Cell const& child{m_cells[c]};
+                    for (std::size_t k{0}; k < q.size(); k++) {
+                        q[k] += child.quadrupole[k];
+                    }
+                    add_quadrupole(q, child.total_mass, child.center_of_mass.x - com.x,
+                                   child.center_of_mass.y - com.y, child.center_of_mass.z - com.z);
                 }
-                m_children.at(5)->insert(node);
+            }
+        }
+        cell.quadrupole = q;
+    });
+}
+
+std::uint64_t Oct::refit_bounds(sal::Job_pool& pool) noexcept
+{
+    std::atomic<std::uint64_t> escaped{0};
+
+    for_each_level_up(pool, [this, &escaped](Cell& cell) {
+        if (cell.body_count == 0) {
+            return;
+        }
+
+        cell.bounds_min = glm::vec3{std::numeric_limits<float>::max()};
+        cell.bounds_max = glm::vec3{std::numeric_limits<float>::lowest()};
+
+        if (cell.is_external()) {
+            /// Small drifts out of the box are cheap, the widened cell only opens a bit sooner.
+            glm::vec3 const slack{loose_slack * (cell.back_bottom_right - cell.front_top_left)};
+            glm::vec3 const loose_min{cell.front_top_left - slack};
+            glm::vec3 const loose_max{cell.back_bottom_right + slack};
+
+            std::uint64_t outside{0};
+            for (std::uint32_t b{cell.first_body}; b < cell.first_body + cell.body_count; b++) {
+                glm::vec3 const p{position(b)};
+                cell.bounds_min = glm::min(cell.bounds_min, p);
+                cell.bounds_max = glm::max(cell.bounds_max, p);
+                outside += (glm::min(glm::max(p, loose_min), loose_max) == p) ? 0 : 1;
+            }
+            if (outside > 0) {
+                escaped += outside;
             }
         }
         else {
-            // Indicates topRightTree
-            if ((m_front_top_left.y + m_back_bottom_right.y) / 2 >= node->position.y) {
-                if (!m_children.at(6)) {
-                    m_children.at(6) = std::make_shared<Oct>(
-                        glm::vec3((m_front_top_left.x + m_back_bottom_right.x) / 2,
-                                  m_front_top_left.y,
-                                  (m_front_top_left.z + m_back_bottom_right.z) / 2),
-                        glm::vec3(m_back_bottom_right.x,
-                                  (m_front_top_left.y + m_back_bottom_right.y) / 2,
-                                  m_back_bottom_right.z));
+            for (Cell_index const c : cell.children) {
+                if (c != no_cell) {
+                    cell.bounds_min = glm::min(cell.bounds_min, m_cells[c].bounds_min);
+                    cell.bounds_max = glm::max(cell.bounds_max, m_cells[c].bounds_max);
                 }
-                m_children.at(6)->insert(node);
             }
+        }
 
-            // Indicates botRightTree
-            else {
-                if (!m_children.at(7)) {
-                    m_children.at(7) = std::make_shared<Oct>(
-                        glm::vec3((m_front_top_left.x + m_back_bottom_right.x) / 2,
-                                  (m_front_top_left.y + m_back_bottom_right.y) / 2,
-                                  (m_front_top_left.z + m_back_bottom_right.z) / 2),
-                        glm::vec3(m_back_bottom_right.x, m_back_bottom_right.y,
-                                  m_back_bottom_right.z));
+        /// The opening criterion compares width to the distance from the center of mass, which
+        /// only holds while every body is within width of it.
+        glm::vec3 const extent{cell.bounds_max - cell.bounds_min};
+        cell.width = std::max({cell.back_bottom_right.x - cell.front_top_left.x, extent.x,
+                               extent.y, extent.z});
+    });
+
+    return escaped.load();
+}
+
+void Oct::fill_walk_cells(sal::Job_pool& pool) noexcept
+{
+    m_walk_cells.resize(m_cells.size());
+    m_quadrupoles.resize((m_multipole_order == Multipole_order::monopole) ? 0 : m_cells.size());
+    m_radii.resize(m_cells.size());
+
+    sal::parallel_for(
+        pool, m_cells.size(),
+        [&](std::size_t const begin, std::size_t const end) {
+            for (std::size_t i{begin}; i < end; i++) {
+                Cell const& cell{m_cells[i]};
+                m_walk_cells[i] = {cell.center_of_mass,
+                                   static_cast<float>(cell.total_mass),
+                                   cell.width,
+                                   cell.first_body,
+                                   cell.body_count,
+                                   cell.skip};
+                m_radii[i] = cell.radius;
+            }
+            for (std::size_t i{begin}; i < std::min(end, m_quadrupoles.size()); i++) {
+                for (std::size_t k{0}; k < 6; k++) {
+                    m_quadrupoles[i][k] = static_cast<float>(m_cells[i].quadrupole[k]);
                 }
-                m_children.at(7)->insert(node);
+            }
+        },
+        min_cells_per_job);
+}
+
+void Oct::push_far(Cell_index const index,
+                   kernels::Interaction_list& list,
+                   kernels::Quadrupole_list& far) const noexcept
+{
+    Walk_cell const& cell{m_walk_cells[index]};
+
+    if (m_quadrupoles.empty()) {
+        list.push(cell.center_of_mass.x, cell.center_of_mass.y, cell.center_of_mass.z, cell.mass);
+    }
+    else {
+        far.push(cell.center_of_mass, cell.mass, m_quadrupoles[index]);
+    }
+}
+
+std::uint64_t Oct::descend_dual_tree(Cell_index const target,
+                                     Local const& local,
+                                     std::span<Cell_index const> const sources,
+                                     std::size_t const level,
+                                     kernels::Kernel const kernel,
+                                     std::span<std::uint8_t const> const active,
+                                     Particles& particles,
+                                     Dual_tree_scratch& scratch) const noexcept
+{
+    Walk_cell const& cell{m_walk_cells[target]};
+    bool const terminal{(cell.body_count <= m_group_size) || (cell.skip == target + 1)};
+    glm::dvec3 const center{cell.center_of_mass};
+
+    Local here{local};
+    std::uint64_t interactions{0};
+
+    std::vector<Cell_index>& next{scratch.sources[level]};
+    next.clear();
+    if (terminal) {
+        scratch.near.clear();
+    }
+
+    scratch.work.assign(sources.begin(), sources.end());
+    while (!scratch.work.empty()) {
+        Cell_index const s{scratch.work.back()};
+        scratch.work.pop_back();
+
+        Walk_cell const& source{m_walk_cells[s]};
+        if (source.body_count == 0) {
+            continue;
+        }
+
+        glm::vec3 const offset{cell.center_of_mass - source.center_of_mass};
+        float const reach{(m_radii[target] + m_radii[s]) / m_opening_angle};
+        if (reach * reach < glm::dot(offset, offset)) {
+            /// Field and gradient of the softened law of kernels::Kernel, see
+            /// kernels::Quadrupole_kernel for g and g2.
+            glm::dvec3 const d{center - glm::dvec3{source.center_of_mass}};
+            double const eps2{static_cast<double>(kernels::eps) * kernels::eps};
+            double const r2{glm::dot(d, d)};
+            double const soft{r2 + eps2};
+            double const g{1.0 / (std::sqrt(r2) * soft)};
+            double const g2{-(3.0 * r2 + eps2) * g * g * g * soft};
+            double const gm{-kernels::G * source.mass};
+
+            here.acceleration += gm * g * d;
+            here.gradient[0] += gm * (g + g2 * d.x * d.x);
+            here.gradient[1] += gm * (g + g2 * d.y * d.y);
+            here.gradient[2] += gm * (g + g2 * d.z * d.z);
+            here.gradient[3] += gm * g2 * d.x * d.y;
+            here.gradient[4] += gm * g2 * d.x * d.z;
+            here.gradient[5] += gm * g2 * d.y * d.z;
+            interactions++;
+        }
+        else if (source.skip == s + 1) {
+            if (terminal) {
+                for (std::uint32_t b{source.first_body}; b < source.first_body + source.body_count;
+                     b++) {
+                    scratch.near.push(m_x[b], m_y[b], m_z[b], m_mass[b]);
+                }
+            }
+            else {
+                next.push_back(s);
             }
         }
+        else if (terminal || (m_radii[s] > m_radii[target])) {
+            for (Cell_index c{s + 1}; c < source.skip; c = m_walk_cells[c].skip) {
+                scratch.work.push_back(c);
+            }
+        }
+        else {
+            next.push_back(s);
+        }
+    }
+
+    /// First order Taylor expansion of the accumulated field.
+    auto const expand{[&here, &center](glm::dvec3 const& x) {
+        glm::dvec3 const dx{x - center};
+        std::array<double, 6> const& g{here.gradient};
+        return here.acceleration
+               + glm::dvec3{g[0] * dx.x + g[3] * dx.y + g[4] * dx.z,
+                            g[3] * dx.x + g[1] * dx.y + g[5] * dx.z,
+                            g[4] * dx.x + g[5] * dx.y + g[2] * dx.z};
+    }};
+
+    if (terminal) {
+        for (std::uint32_t b{cell.first_body}; b < cell.first_body + cell.body_count; b++) {
+            std::uint32_t const p{m_order[b]};
+            if (!active[p]) {
+                continue;
+            }
+
+            glm::vec3 const a{kernel(position(b), scratch.near)
+                              + glm::vec3{expand(glm::dvec3{position(b)})}};
+            particles.ax[p] = a.x;
+            particles.ay[p] = a.y;
+            particles.az[p] = a.z;
+        }
+        return interactions + scratch.near.size() * active_count(target);
+    }
+
+    for (Cell_index c{target + 1}; c < cell.skip; c = m_walk_cells[c].skip) {
+        if (active_count(c) == 0) {
+            continue;
+        }
+
+        Local const child{expand(glm::dvec3{m_walk_cells[c].center_of_mass}), here.gradient};
+        interactions += descend_dual_tree(c, child, next, level + 1, kernel, active, particles,
+                                          scratch);
     }
+    return interactions;
 }
 
-glm::vec3 const& Oct::center_of_mass() noexcept
+std::uint32_t Oct::active_count(Cell_index const index) const noexcept
 {
-    return m_center_of_mass;
+    Walk_cell const& cell{m_walk_cells[index]};
+    return m_active_prefix[cell.first_body + cell.body_count] - m_active_prefix[cell.first_body];
 }
 
-bool Oct::is_external() const noexcept
+void Oct::collect_groups() noexcept
 {
-    return std::none_of(m_children.begin(), m_children.end(),
-                        [](auto const& child) -> bool { return child != nullptr; });
+    m_groups.clear();
+
+    Cell_index const end{static_cast<Cell_index>(m_cells.size())};
+    Cell_index index{0};
+
+    while (index < end) {
+        Cell const& cell{m_cells[index]};
+
+        if (cell.body_count <= m_group_size || cell.is_external()) {
+            if (cell.body_count > 0) {
+                m_groups.push_back({cell.first_body, cell.body_count});
+            }
+            index = cell.skip;
+        }
+        else {
+            index++;
+        }
+    }
 }
 
-bool Oct::in_boundary(glm::vec3 const& point) const noexcept
+void Oct::compute_group_bounds(sal::Job_pool& pool) noexcept
 {
-    return (point.x >= m_front_top_left.x) && (point.x <= m_back_bottom_right.x)
-           && (point.x >= m_front_top_left.y) && (point.x <= m_back_bottom_right.y)
-           && (point.x >= m_front_top_left.z) && (point.x <= m_back_bottom_right.z);
+    sal::parallel_for(pool, m_groups.size(), [&](std::size_t const begin, std::size_t const end) {
+        for (std::size_t g{begin}; g < end; g++) {
+            Group& group{m_groups[g]};
+            group.min = position(group.first_body);
+            group.max = group.min;
+            for (std::uint32_t b{group.first_body + 1}; b < group.first_body + group.body_count;
+                 b++) {
+                group.min = glm::min(group.min, position(b));
+                group.max = glm::max(group.max, position(b));
+            }
+        }
+    });
 }
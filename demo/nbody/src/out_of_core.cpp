@@ -0,0 +1,621 @@
+/*
+ * Copyright (c) https://github.com/kaapomoi 2023.
+ */
+
+#include "out_of_core.h"
+
+#include "morton.h"
+#include "solver.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <limits>
+#include <mutex>
+#include <utility>
+
+namespace {
+
+/// Particles member of every quantity, in the order of Out_of_core's arrays.
+constexpr std::array<Aligned_vector<float> Particles::*, 10> members{
+    &Particles::x,  &Particles::y,  &Particles::z,  &Particles::vx, &Particles::vy,
+    &Particles::vz, &Particles::ax, &Particles::ay, &Particles::az, &Particles::mass};
+
+} // namespace
+
+Out_of_core::Out_of_core(std::size_t const thread_count) noexcept
+    : m_thread_pool{thread_count}
+    , m_kernel_isa{kernels::detect()}
+    , m_kernel{kernels::select(m_kernel_isa)}
+{
+}
+
+Out_of_core::~Out_of_core() noexcept
+{
+    close();
+}
+
+bool Out_of_core::create(std::string const& file,
+                         std::size_t const body_count,
+                         std::size_t const block_size) noexcept
+{
+    close();
+
+    m_block_size = (std::max<std::size_t>(block_size, 1) + block_alignment - 1) / block_alignment
+                   * block_alignment;
+    m_body_count = body_count;
+    m_paths = {file, file + ".scatter"};
+
+    std::size_t const bytes{block_count() * quantity_count * m_block_size * sizeof(float)};
+    for (std::size_t i{0}; i < m_files.size(); i++) {
+        if (!m_files[i].create(m_paths[i], bytes)) {
+            close();
+            return false;
+        }
+    }
+
+    m_current = 0;
+    m_evaluated = false;
+    m_blocks.assign(block_count(), {});
+    return true;
+}
+
+void Out_of_core::close() noexcept
+{
+    for (std::size_t i{0}; i < m_files.size(); i++) {
+        m_files[i].close();
+        if (!m_paths[i].empty()) {
+            std::error_code error;
+            std::filesystem::remove(m_paths[i], error);
+            m_paths[i].clear();
+        }
+    }
+
+    m_body_count = 0;
+    m_blocks.clear();
+    m_block_cells.clear();
+    m_block_radii.clear();
+    m_cells.clear();
+    m_radii.clear();
+}
+
+bool Out_of_core::is_open() const noexcept
+{
+    return m_files[m_current].is_open();
+}
+
+std::size_t Out_of_core::size() const noexcept
+{
+    return m_body_count;
+}
+
+std::size_t Out_of_core::block_size() const noexcept
+{
+    return m_block_size;
+}
+
+void Out_of_core::write(std::size_t const first, Particles const& bodies) noexcept
+{
+    std::size_t const end{std::min(first + bodies.size(), m_body_count)};
+    for (std::size_t body{first}; body < end;) {
+        std::size_t const block{body / m_block_size};
+        std::size_t const offset{body % m_block_size};
+        std::size_t const count{std::min(end - body, m_block_size - offset)};
+
+        for (std::size_t q{0}; q < quantity_count; q++) {
+            auto const source{(bodies.*members[q]).begin() + (body - first)};
+            std::copy_n(source, count, array(m_current, block, Quantity{q}) + offset);
+        }
+        body += count;
+    }
+
+    m_evaluated = false;
+}
+
+void Out_of_core::read(std::size_t const first,
+                       std::size_t const count,
+                       Particles& out) const noexcept
+{
+    std::size_t const end{std::min(first + count, m_body_count)};
+    for (auto const member : members) {
+        (out.*member).resize(end - std::min(first, end));
+    }
+
+    for (std::size_t body{first}; body < end;) {
+        std::size_t const block{body / m_block_size};
+        std::size_t const offset{body % m_block_size};
+        std::size_t const run{std::min(end - body, m_block_size - offset)};
+
+        for (std::size_t q{0}; q < quantity_count; q++) {
+            float const* const source{array(m_current, block, Quantity{q}) + offset};
+            std::copy_n(source, run, (out.*members[q]).begin() + (body - first));
+        }
+        body += run;
+    }
+}
+
+void Out_of_core::step(float const dt) noexcept
+{
+    m_last_step = {};
+    if (!is_open()) {
+        return;
+    }
+
+    /// The first kick needs the accelerations of the starting positions.
+    if (!m_evaluated) {
+        kick_drift(0.f, 0.f);
+        sort();
+        build_resident_tree();
+        evaluate(0.f);
+        m_evaluated = true;
+    }
+
+    kick_drift(dt / 2.f, dt);
+    sort();
+    build_resident_tree();
+    evaluate(dt / 2.f);
+}
+
+Out_of_core::Step_stats const& Out_of_core::last_step() const noexcept
+{
+    return m_last_step;
+}
+
+std::size_t Out_of_core::resident_cell_count() const noexcept
+{
+    return m_cells.size();
+}
+
+std::size_t Out_of_core::thread_count() const noexcept
+{
+    return m_thread_pool.thread_count();
+}
+
+kernels::Isa Out_of_core::kernel_isa() const noexcept
+{
+    return m_kernel_isa;
+}
+
+
+///
+/// Private section:
+///
+std::size_t Out_of_core::block_count() const noexcept
+{
+    return (m_body_count + m_block_size - 1) / m_block_size;
+}
+
+std::size_t Out_of_core::bodies_in(std::size_t const block) const noexcept
+{
+    return std::min(m_block_size, m_body_count - block * m_block_size);
+}
+
+float* Out_of_core::array(std::size_t const file,
+                          std::size_t const block,
+                          Quantity const quantity) const noexcept
+{
+    std::size_t const index{block * quantity_count + static_cast<std::size_t>(quantity)};
+    return reinterpret_cast<float*>(m_files[file].writable_data().data()
+                                    + index * m_block_size * sizeof(float));
+}
+
+void Out_of_core::read_ahead(std::size_t const file, std::size_t const block) const noexcept
+{
+    std::size_t const block_bytes{quantity_count * m_block_size * sizeof(float)};
+    m_files[file].advise((block + 1) * block_bytes, block_bytes,
+                         sal::Mapped_file::Access::will_need);
+}
+
+void Out_of_core::kick_drift(float const kick_dt, float const drift_dt) noexcept
+{
+    std::chrono::high_resolution_clock::time_point const sw_start{
+        std::chrono::high_resolution_clock::now()};
+
+    Bounds const empty{glm::vec3{std::numeric_limits<float>::max()},
+                       glm::vec3{std::numeric_limits<float>::lowest()}};
+    Bounds bounds{empty};
+    std::mutex mutex;
+
+    m_files[m_current].advise(0, m_files[m_current].data().size(),
+                              sal::Mapped_file::Access::sequential);
+
+    for (std::size_t block{0}; block < block_count(); block++) {
+        read_ahead(m_current, block);
+
+        std::array<float*, quantity_count> q;
+        for (std::size_t i{0}; i < quantity_count; i++) {
+            q[i] = array(m_current, block, Quantity{i});
+        }
+
+        sal::parallel_for(
+            m_thread_pool, bodies_in(block),
+            [&](std::size_t const begin, std::size_t const end) {
+                /// Not a copy of bounds, which the other jobs write under the lock.
+                Bounds chunk{empty};
+                for (std::size_t i{begin}; i < end; i++) {
+                    for (std::size_t axis{0}; axis < 3; axis++) {
+                        q[3 + axis][i] += q[6 + axis][i] * kick_dt;
+                        q[axis][i] += q[3 + axis][i] * drift_dt;
+                    }
+
+                    glm::vec3 const position{q[0][i], q[1][i], q[2][i]};
+                    if (std::isfinite(position.x) && std::isfinite(position.y)
+                        && std::isfinite(position.z)) {
+                        chunk.min = glm::min(chunk.min, position);
+                        chunk.max = glm::max(chunk.max, position);
+                    }
+                }
+
+                std::lock_guard<std::mutex> lock{mutex};
+                bounds.min = glm::min(bounds.min, chunk.min);
+                bounds.max = glm::max(bounds.max, chunk.max);
+            },
+            solver::min_bodies_per_job);
+    }
+
+    m_bounds = bounds;
+    m_last_step.integrate_time += solver::seconds_since(sw_start);
+}
+
+void Out_of_core::sort() noexcept
+{
+    std::chrono::high_resolution_clock::time_point const sw_start{
+        std::chrono::high_resolution_clock::now()};
+
+    static constexpr std::uint32_t shift{3 * (morton::bits_per_axis - sort_digits)};
+    /// Bodies outside of the keyed cube, only the non-finite ones, go to one last bucket.
+    static constexpr std::size_t bucket_count{(std::size_t{1} << (3 * sort_digits)) + 1};
+
+    Bounds const root{Oct::root_cube(m_bounds)};
+    glm::vec3 const size{root.max - root.min};
+    m_buckets.resize(m_block_size);
+
+    auto const bucket_block = [&](std::size_t const file, std::size_t const block) {
+        float const* const x{array(file, block, Quantity::x)};
+        float const* const y{array(file, block, Quantity::y)};
+        float const* const z{array(file, block, Quantity::z)};
+        sal::parallel_for(
+            m_thread_pool, bodies_in(block),
+            [&](std::size_t const begin, std::size_t const end) {
+                for (std::size_t i{begin}; i < end; i++) {
+                    std::uint64_t const key{morton::key({x[i], y[i], z[i]}, root.min, size)};
+                    m_buckets[i] = static_cast<std::uint32_t>(
+                        std::min<std::uint64_t>(key >> shift, bucket_count - 1));
+                }
+            },
+            solver::min_bodies_per_job);
+    };
+
+    /// Count the buckets, and find out whether every block already holds its own bodies. The
+    /// order within a block is the one of its own tree, it doesn't matter here.
+    m_bucket_cursors.assign(bucket_count, 0);
+    bool sorted{true};
+    std::uint32_t previous_max{0};
+    for (std::size_t block{0}; block < block_count(); block++) {
+        read_ahead(m_current, block);
+        bucket_block(m_current, block);
+
+        std::uint32_t min{std::numeric_limits<std::uint32_t>::max()};
+        std::uint32_t max{0};
+        for (std::size_t i{0}; i < bodies_in(block); i++) {
+            m_bucket_cursors[m_buckets[i]]++;
+            min = std::min(min, m_buckets[i]);
+            max = std::max(max, m_buckets[i]);
+        }
+        sorted = sorted && (previous_max <= min);
+        previous_max = max;
+    }
+
+    if (sorted) {
+        m_last_step.sort_time += solver::seconds_since(sw_start);
+        return;
+    }
+
+    std::uint64_t offset{0};
+    for (std::uint64_t& cursor : m_bucket_cursors) {
+        offset += std::exchange(cursor, offset);
+    }
+
+    /// Bodies move little between steps, so the destinations mostly advance together with the
+    /// sources and the writes stay close to each other.
+    std::size_t const target{m_current ^ 1};
+    std::uint64_t scattered{0};
+    for (std::size_t block{0}; block < block_count(); block++) {
+        read_ahead(m_current, block);
+        bucket_block(m_current, block);
+
+        std::array<float const*, quantity_count> source;
+        for (std::size_t q{0}; q < quantity_count; q++) {
+            source[q] = array(m_current, block, Quantity{q});
+        }
+
+        for (std::size_t i{0}; i < bodies_in(block); i++) {
+            std::uint64_t const destination{m_bucket_cursors[m_buckets[i]]++};
+            std::size_t const destination_block{destination / m_block_size};
+            std::size_t const destination_offset{destination % m_block_size};
+            for (std::size_t q{0}; q < quantity_count; q++) {
+                array(target, destination_block, Quantity{q})[destination_offset] = source[q][i];
+            }
+            scattered += (destination_block != block);
+        }
+    }
+
+    m_current = target;
+    m_last_step.scattered += scattered;
+    m_last_step.sort_time += solver::seconds_since(sw_start);
+}
+
+void Out_of_core::build_resident_tree() noexcept
+{
+    std::chrono::high_resolution_clock::time_point const sw_start{
+        std::chrono::high_resolution_clock::now()};
+
+    m_block_cells.clear();
+    m_block_radii.clear();
+    for (std::size_t block{0}; block < block_count(); block++) {
+        read_ahead(m_current, block);
+        m_blocks[block].bounds = build_block(block);
+
+        /// Lay the block out in the tree order, bodies left out of the tree go last.
+        std::size_t const n{bodies_in(block)};
+        std::span<std::uint32_t const> const order{m_tree.order()};
+        m_permutation.assign(order.begin(), order.end());
+        if (m_permutation.size() < n) {
+            std::vector<bool> in_tree(n, false);
+            for (std::uint32_t const body : order) {
+                in_tree[body] = true;
+            }
+            for (std::uint32_t body{0}; body < n; body++) {
+                if (!in_tree[body]) {
+                    m_permutation.push_back(body);
+                }
+            }
+        }
+
+        m_scratch.resize(n);
+        for (std::size_t q{0}; q < quantity_count; q++) {
+            float* const values{array(m_current, block, Quantity{q})};
+            std::copy_n(values, n, m_scratch.begin());
+            sal::parallel_for(
+                m_thread_pool, n,
+                [&](std::size_t const begin, std::size_t const end) {
+                    for (std::size_t i{begin}; i < end; i++) {
+                        values[i] = m_scratch[m_permutation[i]];
+                    }
+                },
+                solver::min_bodies_per_job);
+        }
+
+        /// Keep the cells down to resident_leaf_size bodies. Cells that are kept become leaves,
+        /// and the end of a kept subtree is always another kept cell or the end, so the skips
+        /// only need the new indices.
+        std::span<Oct::Walk_cell const> const cells{m_tree.walk_cells()};
+        std::span<float const> const radii{m_tree.radii()};
+        std::uint32_t const first_body{static_cast<std::uint32_t>(block * m_block_size)};
+        m_blocks[block].first_cell = m_block_cells.size();
+        m_cell_remap.resize(cells.size() + 1);
+
+        /// A block of nothing but non-finite bodies has no tree, an empty root stands in for it.
+        if (cells.empty()) {
+            Oct::Walk_cell empty{};
+            empty.first_body = first_body;
+            empty.skip = 1;
+            m_block_cells.push_back(empty);
+            m_block_radii.push_back(0.f);
+        }
+
+        Oct::Cell_index index{0};
+        while (index < cells.size()) {
+            Oct::Walk_cell cell{cells[index]};
+            m_cell_remap[index] =
+                static_cast<Oct::Cell_index>(m_block_cells.size() - m_blocks[block].first_cell);
+            cell.first_body += first_body;
+            m_block_cells.push_back(cell);
+            m_block_radii.push_back(radii[index]);
+
+            index = (cell.body_count <= resident_leaf_size) ? cell.skip : index + 1;
+        }
+        m_cell_remap[cells.size()] =
+            static_cast<Oct::Cell_index>(m_block_cells.size() - m_blocks[block].first_cell);
+
+        m_blocks[block].cell_count = m_block_cells.size() - m_blocks[block].first_cell;
+        for (std::size_t c{m_blocks[block].first_cell}; c < m_block_cells.size(); c++) {
+            m_block_cells[c].skip = m_cell_remap[m_block_cells[c].skip];
+        }
+    }
+
+    m_cells.clear();
+    m_radii.clear();
+    if (block_count() > 0) {
+        join_blocks(0, block_count());
+    }
+
+    m_last_step.tree_time += solver::seconds_since(sw_start);
+}
+
+void Out_of_core::join_blocks(std::size_t const first, std::size_t const last) noexcept
+{
+    if (last - first == 1) {
+        Block const& block{m_blocks[first]};
+        Oct::Cell_index const base{static_cast<Oct::Cell_index>(m_cells.size())};
+        for (std::size_t c{block.first_cell}; c < block.first_cell + block.cell_count; c++) {
+            m_cells.push_back(m_block_cells[c]);
+            m_cells.back().skip += base;
+            m_radii.push_back(m_block_radii[c]);
+        }
+        return;
+    }
+
+    std::size_t const index{m_cells.size()};
+    m_cells.emplace_back();
+    m_radii.emplace_back();
+
+    std::size_t const middle{first + (last - first) / 2};
+    join_blocks(first, middle);
+    join_blocks(middle, last);
+
+    /// Moments and box of the blocks' roots.
+    Oct::Walk_cell cell{};
+    glm::vec3 weighted{0.f};
+    Bounds bounds{m_blocks[first].bounds};
+    for (std::size_t b{first}; b < last; b++) {
+        Oct::Walk_cell const& root{m_block_cells[m_blocks[b].first_cell]};
+        weighted += root.center_of_mass * root.mass;
+        cell.mass += root.mass;
+        cell.body_count += root.body_count;
+        bounds.min = glm::min(bounds.min, m_blocks[b].bounds.min);
+        bounds.max = glm::max(bounds.max, m_blocks[b].bounds.max);
+    }
+
+    glm::vec3 const extent{bounds.max - bounds.min};
+    cell.center_of_mass =
+        (cell.mass > 0.f) ? weighted / cell.mass : (bounds.min + bounds.max) / 2.f;
+    cell.width = std::max({extent.x, extent.y, extent.z});
+    cell.first_body = static_cast<std::uint32_t>(first * m_block_size);
+    cell.skip = static_cast<Oct::Cell_index>(m_cells.size());
+    m_cells[index] = cell;
+
+    /// No body of a block is further from the joined center of mass than the block's root.
+    float radius{0.f};
+    for (std::size_t b{first}; b < last; b++) {
+        std::size_t const root{m_blocks[b].first_cell};
+        float const reach{glm::distance(cell.center_of_mass, m_block_cells[root].center_of_mass)
+                          + m_block_radii[root]};
+        radius = std::max(radius, reach);
+    }
+    m_radii[index] = radius;
+}
+
+void Out_of_core::evaluate(float const kick_dt) noexcept
+{
+    std::atomic<std::uint64_t> interaction_count{0};
+
+    for (std::size_t block{0}; block < block_count(); block++) {
+        std::chrono::high_resolution_clock::time_point const sw_start{
+            std::chrono::high_resolution_clock::now()};
+
+        read_ahead(m_current, block);
+        build_block(block);
+
+        std::chrono::high_resolution_clock::time_point const tree_end{
+            std::chrono::high_resolution_clock::now()};
+
+        std::size_t const n{bodies_in(block)};
+        std::span<std::uint32_t const> const order{m_tree.order()};
+        std::span<Oct::Group const> const groups{m_tree.groups()};
+        float* const ax{array(m_current, block, Quantity::ax)};
+        float* const ay{array(m_current, block, Quantity::ay)};
+        float* const az{array(m_current, block, Quantity::az)};
+
+        /// Bodies that fell outside of the tree feel nothing.
+        if (order.size() != n) {
+            std::fill_n(ax, n, 0.f);
+            std::fill_n(ay, n, 0.f);
+            std::fill_n(az, n, 0.f);
+        }
+
+        sal::parallel_for(
+            m_thread_pool, groups.size(),
+            [&](std::size_t const begin, std::size_t const end) {
+                kernels::Interaction_list list;
+                list.reserve(solver::interaction_list_capacity);
+                std::uint64_t chunk_interactions{0};
+
+                for (std::size_t g{begin}; g < end; g++) {
+                    Oct::Group const& group{groups[g]};
+                    interactions(group, list);
+                    chunk_interactions += list.size() * group.body_count;
+
+                    for (std::uint32_t body{group.first_body};
+                         body < group.first_body + group.body_count; body++) {
+                        std::uint32_t const p{order[body]};
+                        glm::vec3 const a{m_kernel(m_tree.position(body), list)};
+                        ax[p] = a.x;
+                        ay[p] = a.y;
+                        az[p] = a.z;
+                    }
+                }
+
+                interaction_count += chunk_interactions;
+            },
+            solver::min_groups_per_job);
+
+        std::chrono::high_resolution_clock::time_point const force_end{
+            std::chrono::high_resolution_clock::now()};
+
+        float* const vx{array(m_current, block, Quantity::vx)};
+        float* const vy{array(m_current, block, Quantity::vy)};
+        float* const vz{array(m_current, block, Quantity::vz)};
+        sal::parallel_for(
+            m_thread_pool, n,
+            [&](std::size_t const begin, std::size_t const end) {
+                for (std::size_t i{begin}; i < end; i++) {
+                    vx[i] += ax[i] * kick_dt;
+                    vy[i] += ay[i] * kick_dt;
+                    vz[i] += az[i] * kick_dt;
+                }
+            },
+            solver::min_bodies_per_job);
+
+        m_last_step.tree_time +=
+            std::chrono::duration_cast<std::chrono::duration<float>>(tree_end - sw_start).count();
+        m_last_step.force_time +=
+            std::chrono::duration_cast<std::chrono::duration<float>>(force_end - tree_end).count();
+        m_last_step.integrate_time += solver::seconds_since(force_end);
+    }
+
+    m_last_step.interactions += interaction_count.load();
+}
+
+void Out_of_core::interactions(Oct::Group const& group,
+                               kernels::Interaction_list& list) const noexcept
+{
+    list.clear();
+
+    Oct::walk_group(
+        m_cells, m_radii, group, Oct::default_opening_angle,
+        [&](Oct::Cell_index const index) {
+            Oct::Walk_cell const& cell{m_cells[index]};
+            list.push(cell.center_of_mass.x, cell.center_of_mass.y, cell.center_of_mass.z,
+                      cell.mass);
+        },
+        [&](Oct::Cell_index const index) {
+            /// A resident leaf never spans two blocks.
+            Oct::Walk_cell const& cell{m_cells[index]};
+            std::size_t const block{cell.first_body / m_block_size};
+            std::size_t const offset{cell.first_body % m_block_size};
+            float const* const x{array(m_current, block, Quantity::x) + offset};
+            float const* const y{array(m_current, block, Quantity::y) + offset};
+            float const* const z{array(m_current, block, Quantity::z) + offset};
+            float const* const mass{array(m_current, block, Quantity::mass) + offset};
+            for (std::uint32_t b{0}; b < cell.body_count; b++) {
+                list.push(x[b], y[b], z[b], mass[b]);
+            }
+        });
+}
+
+Out_of_core::Bounds Out_of_core::build_block(std::size_t const block) noexcept
+{
+    std::size_t const n{bodies_in(block)};
+    for (Quantity const quantity : {Quantity::x, Quantity::y, Quantity::z, Quantity::mass}) {
+        float const* const values{array(m_current, block, quantity)};
+        auto& target{m_block.*members[static_cast<std::size_t>(quantity)]};
+        target.assign(values, values + n);
+    }
+
+    Bounds bounds{glm::vec3{std::numeric_limits<float>::max()},
+                  glm::vec3{std::numeric_limits<float>::lowest()}};
+    for (std::size_t i{0}; i < n; i++) {
+        glm::vec3 const position{m_block.position(i)};
+        if (std::isfinite(position.x) && std::isfinite(position.y) && std::isfinite(position.z)) {
+            bounds.min = glm::min(bounds.min, position);
+            bounds.max = glm::max(bounds.max, position);
+        }
+    }
+
+    Bounds const root{Oct::root_cube(bounds)};
+    m_tree.build(root.min, root.max, m_block, Oct::Build_mode::morton, m_thread_pool);
+    return root;
+}
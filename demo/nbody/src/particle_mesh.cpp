@@ -0,0 +1,329 @@
+/*
+ * Copyright (c) https://github.com/kaapomoi 2023.
+ */
+
+#include "particle_mesh.h"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <numbers>
+
+namespace {
+
+/// A plane of the mesh is already worth a job of its own.
+constexpr std::size_t min_planes_per_job{1};
+
+/// Keeps the mesh of a lone body, or of bodies on top of each other, from having no size.
+constexpr float min_width{1.f};
+
+} // namespace
+
+Particle_mesh::Particle_mesh() noexcept : m_plan{2 * default_mesh_size}
+{
+    for (std::size_t i{0}; i <= kernels::Split_table::size; i++) {
+        m_split.factor[i] = static_cast<float>(short_range_factor(
+            cutoff_splits * static_cast<double>(i)
+            / static_cast<double>(kernels::Split_table::size)));
+    }
+}
+
+std::size_t Particle_mesh::mesh_size() const noexcept
+{
+    return m_size;
+}
+
+void Particle_mesh::set_mesh_size(std::size_t const size) noexcept
+{
+    std::size_t const rounded{std::bit_ceil(std::max(size, min_mesh_size))};
+    if (rounded == m_size) {
+        return;
+    }
+
+    m_size = rounded;
+    m_plan = fft::Plan{2 * m_size};
+    m_fitted_width = 0.f;
+}
+
+void Particle_mesh::solve(Particles const& particles,
+                          glm::vec3 const& min,
+                          glm::vec3 const& max,
+                          sal::Job_pool& pool) noexcept
+{
+    /// The cube spans at most nodes margin to m_size - margin - 1, so that the last cell of the
+    /// interpolation and the difference stencil around it both stay on the mesh. The spacing is
+    /// only refitted when the bodies outgrow the mesh or shrink to half of it.
+    float const width{std::max({max.x - min.x, max.y - min.y, max.z - min.z, min_width})};
+    if ((width > m_fitted_width) || (width < 0.5f * m_fitted_width)) {
+        m_fitted_width = width * (1.f + fit_slack);
+        m_spacing = m_fitted_width / static_cast<float>(m_size - 2 * margin - 1);
+        m_split.scale = static_cast<float>(kernels::Split_table::size) / cutoff();
+        transform_green(pool);
+    }
+    m_origin = min - glm::vec3{static_cast<float>(margin) * m_spacing};
+
+    deposit(particles, pool);
+    fft::transform(m_plan, m_padded, fft::Direction::forward, m_size, pool);
+
+    sal::parallel_for(
+        pool, m_padded.size(),
+        [&](std::size_t const begin, std::size_t const end) {
+            for (std::size_t i{begin}; i < end; i++) {
+                m_padded[i] *= m_green[i];
+            }
+        },
+        m_size * m_size);
+
+    fft::transform(m_plan, m_padded, fft::Direction::inverse, m_size, pool);
+    differentiate(pool);
+}
+
+glm::vec3 Particle_mesh::acceleration(glm::vec3 const& position) const noexcept
+{
+    std::array<std::size_t, 3> n{};
+    glm::vec3 w{0.f};
+    if (m_acceleration[0].empty() || !locate(position, n, w)) {
+        return glm::vec3{0.f};
+    }
+
+    glm::vec3 a{0.f};
+    for (std::size_t corner{0}; corner < 8; corner++) {
+        std::size_t const dx{corner & 1u};
+        std::size_t const dy{(corner >> 1) & 1u};
+        std::size_t const dz{(corner >> 2) & 1u};
+        float const weight{(dx ? w.x : 1.f - w.x) * (dy ? w.y : 1.f - w.y)
+                           * (dz ? w.z : 1.f - w.z)};
+
+        std::size_t const i{node(n[0] + dx, n[1] + dy, n[2] + dz)};
+        a += weight * glm::vec3{m_acceleration[0][i], m_acceleration[1][i], m_acceleration[2][i]};
+    }
+    return a;
+}
+
+kernels::Split_table const& Particle_mesh::split() const noexcept
+{
+    return m_split;
+}
+
+float Particle_mesh::split_scale() const noexcept
+{
+    return split_cells * m_spacing;
+}
+
+float Particle_mesh::cutoff() const noexcept
+{
+    return cutoff_splits * split_scale();
+}
+
+
+///
+/// Private section:
+///
+void Particle_mesh::deposit(Particles const& particles, sal::Job_pool& pool) noexcept
+{
+    std::size_t const n{m_size};
+    std::size_t const padded{2 * n};
+
+    /// Each worker deposits a contiguous share of the bodies on a mesh of its own, the meshes are
+    /// then summed node by node, so no two threads ever add to the same node.
+    std::size_t const workers{pool.thread_count()};
+    m_deposits.resize(workers);
+
+    sal::parallel_for(pool, workers, [&](std::size_t const begin, std::size_t const end) {
+        for (std::size_t w{begin}; w < end; w++) {
+            std::vector<double>& mesh{m_deposits[w]};
+            mesh.assign(n * n * n, 0.0);
+
+            std::size_t const first{particles.size() * w / workers};
+            std::size_t const last{particles.size() * (w + 1) / workers};
+            for (std::size_t p{first}; p < last; p++) {
+                std::array<std::size_t, 3> c{};
+                glm::vec3 weight{0.f};
+                if (!locate({particles.x[p], particles.y[p], particles.z[p]}, c, weight)) {
+                    continue;
+                }
+
+                double const mass{particles.mass[p]};
+                for (std::size_t corner{0}; corner < 8; corner++) {
+                    std::size_t const dx{corner & 1u};
+                    std::size_t const dy{(corner >> 1) & 1u};
+                    std::size_t const dz{(corner >> 2) & 1u};
+                    double const share{(dx ? weight.x : 1.f - weight.x)
+                                       * (dy ? weight.y : 1.f - weight.y)
+                                       * (dz ? weight.z : 1.f - weight.z)};
+                    mesh[node(c[0] + dx, c[1] + dy, c[2] + dz)] += share * mass;
+                }
+            }
+        }
+    });
+
+    m_padded.resize(padded * padded * padded);
+    sal::parallel_for(
+        pool, padded,
+        [&](std::size_t const begin, std::size_t const end) {
+            for (std::size_t z{begin}; z < end; z++) {
+                for (std::size_t y{0}; y < padded; y++) {
+                    for (std::size_t x{0}; x < padded; x++) {
+                        double mass{0.0};
+                        if ((x < n) && (y < n) && (z < n)) {
+                            for (std::vector<double> const& mesh : m_deposits) {
+                                mass += mesh[node(x, y, z)];
+                            }
+                        }
+                        m_padded[(z * padded + y) * padded + x] = mass;
+                    }
+                }
+            }
+        },
+        min_planes_per_job);
+}
+
+void Particle_mesh::differentiate(sal::Job_pool& pool) noexcept
+{
+    std::size_t const n{m_size};
+    std::size_t const padded{2 * n};
+    for (std::vector<float>& mesh : m_acceleration) {
+        mesh.assign(n * n * n, 0.f);
+    }
+
+    auto const potential{[this, padded](std::size_t const x, std::size_t const y,
+                                        std::size_t const z) {
+        return m_padded[(z * padded + y) * padded + x].real();
+    }};
+
+    /// Fourth order central differences, a = -(8 * (p[1] - p[-1]) - (p[2] - p[-2])) / (12 * h).
+    double const scale{-1.0 / (12.0 * m_spacing)};
+    sal::parallel_for(
+        pool, n - 2 * margin,
+        [&](std::size_t const begin, std::size_t const end) {
+            for (std::size_t z{margin + begin}; z < margin + end; z++) {
+                for (std::size_t y{margin}; y < n - margin; y++) {
+                    for (std::size_t x{margin}; x < n - margin; x++) {
+                        std::size_t const i{node(x, y, z)};
+                        m_acceleration[0][i] = static_cast<float>(
+                            scale
+                            * (8.0 * (potential(x + 1, y, z) - potential(x - 1, y, z))
+                               - (potential(x + 2, y, z) - potential(x - 2, y, z))));
+                        m_acceleration[1][i] = static_cast<float>(
+                            scale
+                            * (8.0 * (potential(x, y + 1, z) - potential(x, y - 1, z))
+                               - (potential(x, y + 2, z) - potential(x, y - 2, z))));
+                        m_acceleration[2][i] = static_cast<float>(
+                            scale
+                            * (8.0 * (potential(x, y, z + 1) - potential(x, y, z - 1))
+                               - (potential(x, y, z + 2) - potential(x, y, z - 2))));
+                    }
+                }
+            }
+        },
+        min_planes_per_job);
+}
+
+void Particle_mesh::transform_green(sal::Job_pool& pool) noexcept
+{
+    std::size_t const padded{2 * m_size};
+    std::size_t const count{padded * padded * padded};
+    m_padded.resize(count);
+
+    /// The long-range potential is the integral of the long-range force from r out, sampled from
+    /// the furthest offset on the mesh inwards. Past it the short-range factor is nothing and the
+    /// rest of the integral of the softened force, 1 / (r^2 + eps^2), has a closed form.
+    double const eps{kernels::eps};
+    double const split{split_scale()};
+    double const reach{std::sqrt(3.0) * static_cast<double>(m_size) * m_spacing};
+    double const step{reach / static_cast<double>(potential_table_size)};
+    auto const force{[eps, split](double const r) {
+        return (1.0 - short_range_factor(r / split)) / (r * r + eps * eps);
+    }};
+
+    std::vector<double> potential(potential_table_size + 1);
+    double integral{(0.5 * std::numbers::pi - std::atan(reach / eps)) / eps};
+    potential[potential_table_size] = -kernels::G * integral;
+    for (std::size_t i{potential_table_size}; i > 0; i--) {
+        double const r{static_cast<double>(i) * step};
+        integral += 0.5 * step * (force(r) + force(r - step));
+        potential[i - 1] = -kernels::G * integral;
+    }
+
+    /// Offsets past half of the padded mesh wrap around to negative ones, which is what makes the
+    /// convolution isolated.
+    sal::parallel_for(
+        pool, padded,
+        [&](std::size_t const begin, std::size_t const end) {
+            for (std::size_t z{begin}; z < end; z++) {
+                for (std::size_t y{0}; y < padded; y++) {
+                    for (std::size_t x{0}; x < padded; x++) {
+                        glm::dvec3 const offset{static_cast<double>(std::min(x, padded - x)),
+                                                static_cast<double>(std::min(y, padded - y)),
+                                                static_cast<double>(std::min(z, padded - z))};
+                        double const t{std::min(glm::length(offset) * m_spacing / step,
+                                                static_cast<double>(potential_table_size))};
+                        std::size_t const k{std::min(static_cast<std::size_t>(t),
+                                                     potential_table_size - 1)};
+                        double const f{t - static_cast<double>(k)};
+                        m_padded[(z * padded + y) * padded + x] =
+                            potential[k] + f * (potential[k + 1] - potential[k]);
+                    }
+                }
+            }
+        },
+        min_planes_per_job);
+
+    fft::transform(m_plan, m_padded, fft::Direction::forward, padded, pool);
+
+    /// The inverse transform isn't scaled, the Green's function carries its 1 / n^3. It also
+    /// divides out the smoothing of the cloud-in-cell deposit and interpolation, sinc^2 of the
+    /// wavenumber along each axis for each of the two.
+    std::vector<double> sharpen(padded);
+    for (std::size_t k{0}; k < padded; k++) {
+        double const x{std::numbers::pi * static_cast<double>(std::min(k, padded - k))
+                       / static_cast<double>(padded)};
+        double const sinc{(k == 0) ? 1.0 : std::sin(x) / x};
+        sharpen[k] = 1.0 / std::pow(sinc, 4);
+    }
+
+    m_green.resize(count);
+    double const inv_count{1.0 / static_cast<double>(count)};
+    for (std::size_t z{0}; z < padded; z++) {
+        for (std::size_t y{0}; y < padded; y++) {
+            for (std::size_t x{0}; x < padded; x++) {
+                std::size_t const i{(z * padded + y) * padded + x};
+                m_green[i] = m_padded[i].real() * inv_count * sharpen[x] * sharpen[y] * sharpen[z];
+            }
+        }
+    }
+}
+
+bool Particle_mesh::locate(glm::vec3 const& position,
+                           std::array<std::size_t, 3>& node,
+                           glm::vec3& weight) const noexcept
+{
+    glm::vec3 const u{(position - m_origin) / m_spacing};
+
+    /// Half a cell of slack for rounding at the faces of the cube.
+    float const low{static_cast<float>(margin) - 0.5f};
+    float const high{static_cast<float>(m_size - margin) - 0.5f};
+    for (std::size_t axis{0}; axis < 3; axis++) {
+        if (!(u[axis] >= low && u[axis] <= high)) {
+            return false;
+        }
+
+        float const lower{std::clamp(std::floor(u[axis]), static_cast<float>(margin),
+                                     static_cast<float>(m_size - margin - 2))};
+        node[axis] = static_cast<std::size_t>(lower);
+        weight[axis] = std::clamp(u[axis] - lower, 0.f, 1.f);
+    }
+    return true;
+}
+
+double Particle_mesh::short_range_factor(double const u) noexcept
+{
+    return std::erfc(0.5 * u) + u / std::sqrt(std::numbers::pi) * std::exp(-0.25 * u * u);
+}
+
+std::size_t Particle_mesh::node(std::size_t const x,
+                                std::size_t const y,
+                                std::size_t const z) const noexcept
+{
+    return (z * m_size + y) * m_size + x;
+}
@@ -0,0 +1,37 @@
+/*
+ * Copyright (c) https://github.com/kaapomoi 2023.
+ */
+
+#include "particles.h"
+
+void Particles::reserve(std::size_t const n) noexcept
+{
+    for (auto* array : {&x, &y, &z, &vx, &vy, &vz, &ax, &ay, &az, &mass}) {
+        array->reserve(n);
+    }
+}
+
+void Particles::clear() noexcept
+{
+    for (auto* array : {&x, &y, &z, &vx, &vy, &vz, &ax, &ay, &az, &mass}) {
+        array->clear();
+    }
+}
+
+std::uint32_t Particles::add(glm::vec3 const position,
+                             glm::vec3 const velocity,
+                             float const m) noexcept
+{
+    x.push_back(position.x);
+    y.push_back(position.y);
+    z.push_back(position.z);
+    vx.push_back(velocity.x);
+    vy.push_back(velocity.y);
+    vz.push_back(velocity.z);
+    ax.push_back(0.f);
+    ay.push_back(0.f);
+    az.push_back(0.f);
+    mass.push_back(m);
+
+    return static_cast<std::uint32_t>(x.size() - 1);
+}
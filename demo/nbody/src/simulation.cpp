@@ -0,0 +1,576 @@
+/*
+ * Copyright (c) https://github.com/kaapomoi 2023.
+ */
+
+#include "simulation.h"
+
+#include "solver.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <mutex>
+
+namespace {
+
+/// Quadrupole cells are accepted at a wider angle for about the same force error as monopoles at
+/// the default one.
+constexpr float quadrupole_opening_angle{0.8f};
+
+/// A body's timestep is at most timestep_accuracy * sqrt(eps / |a|), the time it takes to fall
+/// through a fraction of the softening length.
+constexpr float timestep_accuracy{0.025f};
+
+/// Bodies step at dt / 2^level, level <= max_timestep_level.
+constexpr std::uint8_t max_timestep_level{6};
+
+} // namespace
+
+Simulation::Simulation(std::size_t const thread_count) noexcept
+    : m_thread_pool{thread_count}
+    , m_kernel_isa{kernels::detect()}
+    , m_kernel{kernels::select(m_kernel_isa, m_precision)}
+    , m_quadrupole_kernel{kernels::select_quadrupole(m_kernel_isa, m_precision)}
+    , m_short_range_kernel{kernels::select_short_range(m_kernel_isa, m_precision)}
+{
+    set_multipole_order(Oct::Multipole_order::quadrupole);
+}
+
+void Simulation::step(float const dt) noexcept
+{
+    m_last_step = {};
+
+    auto const evaluate_active = [this](std::size_t const active_count) {
+        std::chrono::high_resolution_clock::time_point const sw_start{
+            std::chrono::high_resolution_clock::now()};
+
+        if (update_tree()) {
+            m_last_step.tree_refits++;
+        }
+        else {
+            m_last_step.tree_builds++;
+        }
+
+        std::chrono::high_resolution_clock::time_point const tree_end{
+            std::chrono::high_resolution_clock::now()};
+
+        m_last_step.interactions += compute_accelerations();
+        m_last_step.force_evaluations += active_count;
+
+        std::chrono::high_resolution_clock::time_point const force_end{
+            std::chrono::high_resolution_clock::now()};
+
+        m_last_step.tree_time +=
+            std::chrono::duration_cast<std::chrono::duration<float>>(tree_end - sw_start).count();
+        m_last_step.force_time +=
+            std::chrono::duration_cast<std::chrono::duration<float>>(force_end - tree_end).count();
+    };
+
+    /// Kicks and drifts, timed separately from the force evaluations they surround.
+    auto const integrate = [this](auto const& advance) {
+        std::chrono::high_resolution_clock::time_point const sw_start{
+            std::chrono::high_resolution_clock::now()};
+
+        advance();
+
+        m_last_step.integrate_time +=
+            std::chrono::duration_cast<std::chrono::duration<float>>(
+                std::chrono::high_resolution_clock::now() - sw_start)
+                .count();
+    };
+
+    /// New bodies have no acceleration to start their first kick with.
+    if (m_levels.size() != m_particles.size()) {
+        m_levels.assign(m_particles.size(), 0);
+        m_active.assign(m_particles.size(), 1);
+        evaluate_active(m_particles.size());
+    }
+
+    /// Every body finishes its step at the end of this one, so the levels can change here.
+    integrate([this, dt]() { assign_levels(dt); });
+
+    std::uint32_t const ticks{1u << m_finest_level};
+    float const tick_dt{dt / static_cast<float>(ticks)};
+    m_last_step.sub_steps = ticks;
+
+    for (std::uint32_t tick{0}; tick < ticks; tick++) {
+        std::size_t active_count{0};
+        integrate([&]() {
+            mark_active(tick, ticks);
+            kick(dt);
+            drift(tick_dt);
+            active_count = mark_active(tick + 1, ticks);
+        });
+
+        if (active_count > 0) {
+            evaluate_active(active_count);
+            integrate([this, dt]() { kick(dt); });
+        }
+    }
+}
+
+void Simulation::clear() noexcept
+{
+    m_particles.clear();
+    m_levels.clear();
+    m_active.clear();
+}
+
+void Simulation::refresh_tree() noexcept
+{
+    update_tree();
+}
+
+Particles& Simulation::particles() noexcept
+{
+    return m_particles;
+}
+
+Particles const& Simulation::particles() const noexcept
+{
+    return m_particles;
+}
+
+Oct const& Simulation::tree() const noexcept
+{
+    return m_tree;
+}
+
+Oct::Build_mode Simulation::build_mode() const noexcept
+{
+    return m_build_mode;
+}
+
+void Simulation::set_build_mode(Oct::Build_mode const mode) noexcept
+{
+    m_build_mode = mode;
+}
+
+std::uint32_t Simulation::leaf_size() const noexcept
+{
+    return m_tree.leaf_size();
+}
+
+void Simulation::set_leaf_size(std::uint32_t const size) noexcept
+{
+    m_tree.set_leaf_size(size);
+}
+
+std::size_t Simulation::mesh_size() const noexcept
+{
+    return m_mesh.mesh_size();
+}
+
+void Simulation::set_mesh_size(std::size_t const size) noexcept
+{
+    m_mesh.set_mesh_size(size);
+}
+
+std::size_t Simulation::thread_count() const noexcept
+{
+    return m_thread_pool.thread_count();
+}
+
+Simulation::Walk_mode Simulation::walk_mode() const noexcept
+{
+    return m_walk_mode;
+}
+
+void Simulation::set_walk_mode(Walk_mode const mode) noexcept
+{
+    m_walk_mode = mode;
+    m_tree.set_opening_angle(tuned_opening_angle());
+}
+
+Simulation::Tree_update Simulation::tree_update() const noexcept
+{
+    return m_tree_update;
+}
+
+void Simulation::set_tree_update(Tree_update const update) noexcept
+{
+    m_tree_update = update;
+}
+
+Oct::Multipole_order Simulation::multipole_order() const noexcept
+{
+    return m_tree.multipole_order();
+}
+
+void Simulation::set_multipole_order(Oct::Multipole_order const order) noexcept
+{
+    m_tree.set_multipole_order(order);
+    m_tree.set_opening_angle(tuned_opening_angle());
+}
+
+float Simulation::opening_angle() const noexcept
+{
+    return m_tree.opening_angle();
+}
+
+void Simulation::set_opening_angle(float const angle) noexcept
+{
+    m_tree.set_opening_angle(angle);
+}
+
+Simulation::Step_stats const& Simulation::last_step() const noexcept
+{
+    return m_last_step;
+}
+
+kernels::Isa Simulation::kernel_isa() const noexcept
+{
+    return m_kernel_isa;
+}
+
+kernels::Precision Simulation::precision() const noexcept
+{
+    return m_precision;
+}
+
+void Simulation::set_precision(kernels::Precision const precision) noexcept
+{
+    m_precision = precision;
+    m_kernel = kernels::select(m_kernel_isa, m_precision);
+    m_quadrupole_kernel = kernels::select_quadrupole(m_kernel_isa, m_precision);
+    m_short_range_kernel = kernels::select_short_range(m_kernel_isa, m_precision);
+}
+
+char const* Simulation::str(Walk_mode const mode) noexcept
+{
+    switch (mode) {
+    case Walk_mode::per_body:
+        return "per_body";
+    case Walk_mode::group:
+        return "group";
+    case Walk_mode::dual_tree:
+        return "dual_tree";
+    case Walk_mode::tree_pm:
+        return "tree_pm";
+    }
+    return "unknown";
+}
+
+char const* Simulation::str(Tree_update const update) noexcept
+{
+    switch (update) {
+    case Tree_update::rebuild:
+        return "rebuild";
+    case Tree_update::refit:
+        return "refit";
+    }
+    return "unknown";
+}
+
+
+///
+/// Private section:
+///
+bool Simulation::update_tree() noexcept
+{
+    if (m_tree_update == Tree_update::refit && m_tree.refit(m_particles, m_thread_pool)) {
+        return true;
+    }
+
+    Bounds const root{root_bounds()};
+    m_tree.build(root.min, root.max, m_particles, m_build_mode, m_thread_pool);
+    return false;
+}
+
+float Simulation::tuned_opening_angle() const noexcept
+{
+    bool const quadrupoles{(m_walk_mode != Walk_mode::dual_tree)
+                           && (m_walk_mode != Walk_mode::tree_pm)
+                           && (m_tree.multipole_order() == Oct::Multipole_order::quadrupole)};
+    return quadrupoles ? quadrupole_opening_angle : Oct::default_opening_angle;
+}
+
+Simulation::Bounds Simulation::root_bounds() noexcept
+{
+    Particles const& p{m_particles};
+    Bounds const empty{glm::vec3{std::numeric_limits<float>::max()},
+                       glm::vec3{std::numeric_limits<float>::lowest()}};
+    Bounds bounds{empty};
+    std::mutex mutex;
+
+    sal::parallel_for(
+        m_thread_pool, p.size(),
+        [&](std::size_t const begin, std::size_t const end) {
+            /// Not a copy of bounds, which the other jobs write under the lock.
+            Bounds chunk{empty};
+            for (std::size_t i{begin}; i < end; i++) {
+                glm::vec3 const position{p.position(i)};
+                if (std::isfinite(position.x) && std::isfinite(position.y)
+                    && std::isfinite(position.z)) {
+                    chunk.min = glm::min(chunk.min, position);
+                    chunk.max = glm::max(chunk.max, position);
+                }
+            }
+
+            std::lock_guard<std::mutex> lock{mutex};
+            bounds.min = glm::min(bounds.min, chunk.min);
+            bounds.max = glm::max(bounds.max, chunk.max);
+        },
+        solver::min_bodies_per_job);
+
+    return Oct::root_cube(bounds);
+}
+
+std::uint64_t Simulation::compute_accelerations() noexcept
+{
+    /// Bodies that fell outside of the tree feel nothing.
+    if (m_tree.order().size() != m_particles.size()) {
+        for (std::size_t i{0}; i < m_particles.size(); i++) {
+            if (m_active[i]) {
+                m_particles.ax[i] = 0.f;
+                m_particles.ay[i] = 0.f;
+                m_particles.az[i] = 0.f;
+            }
+        }
+    }
+
+    switch (m_walk_mode) {
+    case Walk_mode::per_body:
+        return walk_per_body();
+    case Walk_mode::group:
+        return walk_groups();
+    case Walk_mode::dual_tree:
+        return m_tree.dual_tree(m_thread_pool, m_kernel, m_active, m_particles);
+    case Walk_mode::tree_pm:
+        return walk_tree_pm();
+    }
+    return 0;
+}
+
+glm::vec3 Simulation::evaluate(glm::vec3 const& target,
+                               kernels::Interaction_list const& list,
+                               kernels::Quadrupole_list const& far) const noexcept
+{
+    glm::vec3 a{m_kernel(target, list)};
+    if (far.size() > 0) {
+        a += m_quadrupole_kernel(target, far);
+    }
+    return a;
+}
+
+std::uint64_t Simulation::walk_per_body() noexcept
+{
+    std::span<std::uint32_t const> const order{m_tree.order()};
+    std::atomic<std::uint64_t> interaction_count{0};
+
+    /// The tree is read-only from here on. Walk it in tree order so that neighbouring bodies,
+    /// which open the same cells, end up on the same worker.
+    sal::parallel_for(
+        m_thread_pool, order.size(),
+        [&](std::size_t const begin, std::size_t const end) {
+            kernels::Interaction_list list;
+            kernels::Quadrupole_list far;
+            list.reserve(solver::interaction_list_capacity);
+            far.reserve(solver::interaction_list_capacity);
+            std::uint64_t chunk_interactions{0};
+
+            for (std::size_t i{begin}; i < end; i++) {
+                std::uint32_t const p{order[i]};
+                if (!m_active[p]) {
+                    continue;
+                }
+
+                std::uint32_t const body{static_cast<std::uint32_t>(i)};
+                m_tree.interactions(body, list, far);
+                glm::vec3 const a{evaluate(m_tree.position(body), list, far)};
+                chunk_interactions += list.size() + far.size();
+
+                m_particles.ax[p] = a.x;
+                m_particles.ay[p] = a.y;
+                m_particles.az[p] = a.z;
+            }
+
+            interaction_count += chunk_interactions;
+        },
+        solver::min_bodies_per_job);
+
+    return interaction_count.load();
+}
+
+std::uint64_t Simulation::walk_groups() noexcept
+{
+    std::span<std::uint32_t const> const order{m_tree.order()};
+    std::span<Oct::Group const> const groups{m_tree.groups()};
+    std::atomic<std::uint64_t> interaction_count{0};
+
+    sal::parallel_for(
+        m_thread_pool, groups.size(),
+        [&](std::size_t const begin, std::size_t const end) {
+            kernels::Interaction_list list;
+            kernels::Quadrupole_list far;
+            list.reserve(solver::interaction_list_capacity);
+            far.reserve(solver::interaction_list_capacity);
+            std::uint64_t chunk_interactions{0};
+
+            for (std::size_t g{begin}; g < end; g++) {
+                Oct::Group const& group{groups[g]};
+
+                std::uint32_t active_count{0};
+                for (std::uint32_t body{group.first_body};
+                     body < group.first_body + group.body_count; body++) {
+                    active_count += m_active[order[body]];
+                }
+                if (active_count == 0) {
+                    continue;
+                }
+
+                m_tree.interactions(group, list, far);
+                chunk_interactions += (list.size() + far.size()) * active_count;
+
+                for (std::uint32_t body{group.first_body};
+                     body < group.first_body + group.body_count; body++) {
+                    std::uint32_t const p{order[body]};
+                    if (!m_active[p]) {
+                        continue;
+                    }
+
+                    glm::vec3 const a{evaluate(m_tree.position(body), list, far)};
+                    m_particles.ax[p] = a.x;
+                    m_particles.ay[p] = a.y;
+                    m_particles.az[p] = a.z;
+                }
+            }
+
+            interaction_count += chunk_interactions;
+        },
+        solver::min_groups_per_job);
+
+    return interaction_count.load();
+}
+
+std::uint64_t Simulation::walk_tree_pm() noexcept
+{
+    /// Every body feeds the long-range field, not just the ones that finish a sub-step.
+    Bounds const bounds{root_bounds()};
+    m_mesh.solve(m_particles, bounds.min, bounds.max, m_thread_pool);
+
+    std::span<std::uint32_t const> const order{m_tree.order()};
+    std::span<Oct::Group const> const groups{m_tree.groups()};
+    float const cutoff{m_mesh.cutoff()};
+    kernels::Split_table const& split{m_mesh.split()};
+    std::atomic<std::uint64_t> interaction_count{0};
+
+    sal::parallel_for(
+        m_thread_pool, groups.size(),
+        [&](std::size_t const begin, std::size_t const end) {
+            kernels::Interaction_list list;
+            list.reserve(solver::interaction_list_capacity);
+            std::uint64_t chunk_interactions{0};
+
+            for (std::size_t g{begin}; g < end; g++) {
+                Oct::Group const& group{groups[g]};
+
+                std::uint32_t active_count{0};
+                for (std::uint32_t body{group.first_body};
+                     body < group.first_body + group.body_count; body++) {
+                    active_count += m_active[order[body]];
+                }
+                if (active_count == 0) {
+                    continue;
+                }
+
+                m_tree.interactions(group, cutoff, list);
+                chunk_interactions += list.size() * active_count;
+
+                for (std::uint32_t body{group.first_body};
+                     body < group.first_body + group.body_count; body++) {
+                    std::uint32_t const p{order[body]};
+                    if (!m_active[p]) {
+                        continue;
+                    }
+
+                    glm::vec3 const position{m_tree.position(body)};
+                    glm::vec3 const a{m_short_range_kernel(position, list, split)
+                                      + m_mesh.acceleration(position)};
+                    m_particles.ax[p] = a.x;
+                    m_particles.ay[p] = a.y;
+                    m_particles.az[p] = a.z;
+                }
+            }
+
+            interaction_count += chunk_interactions;
+        },
+        solver::min_groups_per_job);
+
+    return interaction_count.load();
+}
+
+void Simulation::assign_levels(float const dt) noexcept
+{
+    Particles const& p{m_particles};
+
+    sal::parallel_for(
+        m_thread_pool, p.size(),
+        [&](std::size_t const begin, std::size_t const end) {
+            for (std::size_t i{begin}; i < end; i++) {
+                float const a{std::sqrt(p.ax[i] * p.ax[i] + p.ay[i] * p.ay[i]
+                                        + p.az[i] * p.az[i])};
+                float const wanted{(a > 0.f) ? timestep_accuracy * std::sqrt(kernels::eps / a)
+                                             : std::numeric_limits<float>::max()};
+
+                std::uint8_t level{0};
+                while (level < max_timestep_level
+                       && dt / static_cast<float>(1u << level) > wanted) {
+                    level++;
+                }
+                m_levels[i] = level;
+            }
+        },
+        solver::min_bodies_per_job);
+
+    m_finest_level =
+        m_levels.empty() ? 0 : *std::max_element(m_levels.begin(), m_levels.end());
+}
+
+std::size_t Simulation::mark_active(std::uint32_t const tick, std::uint32_t const ticks) noexcept
+{
+    std::size_t active_count{0};
+    for (std::size_t i{0}; i < m_levels.size(); i++) {
+        std::uint32_t const ticks_per_step{ticks >> m_levels[i]};
+        m_active[i] = (tick % ticks_per_step == 0) ? 1 : 0;
+        active_count += m_active[i];
+    }
+    return active_count;
+}
+
+void Simulation::kick(float const dt) noexcept
+{
+    Particles& p{m_particles};
+
+    sal::parallel_for(
+        m_thread_pool, p.size(),
+        [&](std::size_t const begin, std::size_t const end) {
+            for (std::size_t i{begin}; i < end; i++) {
+                if (m_active[i]) {
+                    float const half_step{0.5f * dt / static_cast<float>(1u << m_levels[i])};
+                    p.vx[i] += p.ax[i] * half_step;
+                    p.vy[i] += p.ay[i] * half_step;
+                    p.vz[i] += p.az[i] * half_step;
+                }
+            }
+        },
+        solver::min_bodies_per_job);
+}
+
+void Simulation::drift(float const dt) noexcept
+{
+    Particles& p{m_particles};
+
+    sal::parallel_for(
+        m_thread_pool, p.size(),
+        [&](std::size_t const begin, std::size_t const end) {
+            for (std::size_t i{begin}; i < end; i++) {
+                p.x[i] += p.vx[i] * dt;
+                p.y[i] += p.vy[i] * dt;
+                p.z[i] += p.vz[i] * dt;
+            }
+        },
+        solver::min_bodies_per_job);
+}
@@ -0,0 +1,225 @@
+/*
+ * Copyright (c) https://github.com/kaapomoi 2023.
+ */
+
+#include "snapshot.h"
+
+#include <algorithm>
+#include <cstring>
+#include <optional>
+
+namespace snapshot {
+
+namespace {
+
+/// Frame order of the blocks.
+std::array<Aligned_vector<float> const*, block_count> blocks(Particles const& particles) noexcept
+{
+    return {&particles.x,  &particles.y,  &particles.z,   &particles.vx,
+            &particles.vy, &particles.vz, &particles.mass};
+}
+
+std::array<Aligned_vector<float>*, block_count> blocks(Particles& particles) noexcept
+{
+    return {&particles.x,  &particles.y,  &particles.z,   &particles.vx,
+            &particles.vy, &particles.vz, &particles.mass};
+}
+
+} // namespace
+
+
+Writer::~Writer() noexcept
+{
+    close();
+}
+
+bool Writer::open(std::string const& file, std::size_t const body_count) noexcept
+{
+    close();
+
+    m_file = std::fopen(file.c_str(), "wb");
+    if (m_file == nullptr) {
+        return false;
+    }
+
+    m_header = Header{};
+    m_header.body_count = body_count;
+    m_header.frame_size = frame_size(body_count);
+    if (std::fwrite(&m_header, sizeof(Header), 1, m_file) != 1) {
+        std::fclose(m_file);
+        m_file = nullptr;
+        return false;
+    }
+
+    m_frames_written.store(0);
+    m_queue = std::make_unique<sal::Ts_queue<Buffer>>();
+    m_thread = std::jthread{&Writer::execute_writer, this};
+    return true;
+}
+
+void Writer::close() noexcept
+{
+    if (m_file == nullptr) {
+        return;
+    }
+
+    /// The writer drains the queue before it sees the cancel.
+    m_queue->cancel_all();
+    m_thread.join();
+    m_queue.reset();
+
+    std::fclose(m_file);
+    m_file = nullptr;
+}
+
+bool Writer::is_open() const noexcept
+{
+    return m_file != nullptr;
+}
+
+bool Writer::write(Particles const& particles,
+                   std::uint64_t const step,
+                   double const time) noexcept
+{
+    if ((m_file == nullptr) || (particles.size() != m_header.body_count)) {
+        return false;
+    }
+
+    std::size_t const bytes{particles.size() * sizeof(float)};
+    std::size_t const stride{block_size(particles.size())};
+
+    Buffer buffer{std::make_shared<std::vector<std::byte>>(m_header.frame_size)};
+    std::byte* const data{buffer->data()};
+
+    Frame_header const header{step, time};
+    std::memcpy(data, &header, sizeof(Frame_header));
+
+    std::byte* block{data + sizeof(Frame_header)};
+    for (Aligned_vector<float> const* const array : blocks(particles)) {
+        std::memcpy(block, array->data(), bytes);
+        block += stride;
+    }
+
+    m_queue->push(std::move(buffer));
+    return true;
+}
+
+std::uint64_t Writer::frames_written() const noexcept
+{
+    return m_frames_written.load();
+}
+
+
+bool Reader::open(std::string const& file) noexcept
+{
+    close();
+
+    if (!m_file.open(file)) {
+        return false;
+    }
+
+    std::span<std::byte const> const data{m_file.data()};
+    if (data.size() < sizeof(Header)) {
+        close();
+        return false;
+    }
+    std::memcpy(&m_header, data.data(), sizeof(Header));
+
+    if ((m_header.magic != magic) || (m_header.version != version)
+        || (m_header.block_count != block_count)
+        || (m_header.frame_size != frame_size(m_header.body_count))) {
+        close();
+        return false;
+    }
+
+    std::uint64_t const complete_frames{(data.size() - sizeof(Header)) / m_header.frame_size};
+    m_header.frame_count = std::min(m_header.frame_count, complete_frames);
+    return true;
+}
+
+void Reader::close() noexcept
+{
+    m_file.close();
+    m_header = Header{};
+}
+
+bool Reader::is_open() const noexcept
+{
+    return m_file.is_open();
+}
+
+std::size_t Reader::body_count() const noexcept
+{
+    return m_header.body_count;
+}
+
+std::size_t Reader::frame_count() const noexcept
+{
+    return m_header.frame_count;
+}
+
+Frame Reader::frame(std::size_t const index) const noexcept
+{
+    std::byte const* const data{m_file.data().data() + sizeof(Header)
+                                + index * m_header.frame_size};
+
+    Frame_header header{};
+    std::memcpy(&header, data, sizeof(Frame_header));
+
+    std::size_t const n{m_header.body_count};
+    std::size_t const stride{block_size(n)};
+    auto const block{[&](std::size_t const i) -> std::span<float const> {
+        return {reinterpret_cast<float const*>(data + sizeof(Frame_header) + i * stride), n};
+    }};
+
+    return {header.step, header.time, block(0), block(1), block(2), block(3),
+            block(4),    block(5),    block(6)};
+}
+
+void Reader::load(std::size_t const index, Particles& particles) const noexcept
+{
+    Frame const f{frame(index)};
+    std::array<std::span<float const>, block_count> const sources{f.x,  f.y,  f.z,   f.vx,
+                                                                  f.vy, f.vz, f.mass};
+
+    std::array<Aligned_vector<float>*, block_count> const arrays{blocks(particles)};
+    for (std::size_t i{0}; i < block_count; i++) {
+        arrays[i]->assign(sources[i].begin(), sources[i].end());
+    }
+
+    std::size_t const n{body_count()};
+    particles.ax.assign(n, 0.f);
+    particles.ay.assign(n, 0.f);
+    particles.az.assign(n, 0.f);
+}
+
+
+///
+/// Private section:
+///
+void Writer::execute_writer() noexcept
+{
+    bool failed{false};
+    while (std::optional<Buffer> buffer = m_queue->pop()) {
+        if (failed) {
+            continue;
+        }
+
+        std::vector<std::byte> const& frame{**buffer};
+        if (std::fwrite(frame.data(), 1, frame.size(), m_file) != frame.size()) {
+            failed = true;
+            continue;
+        }
+
+        /// Publish the frame in the header so readers never see a partial one.
+        m_header.frame_count++;
+        failed = (std::fseek(m_file, 0, SEEK_SET) != 0)
+                 || (std::fwrite(&m_header, sizeof(Header), 1, m_file) != 1)
+                 || (std::fseek(m_file, 0, SEEK_END) != 0) || (std::fflush(m_file) != 0);
+        if (!failed) {
+            m_frames_written.fetch_add(1);
+        }
+    }
+}
+
+} // namespace snapshot
@@ -0,0 +1,21 @@
+#version 460 core
+
+// Shared start of the billboard vertex shaders, the loader puts it in front of impostor_vert.glsl
+// and particle_vert.glsl.
+
+uniform mat4 view;
+uniform mat4 projection;
+
+// Corners of the billboard as a triangle strip, expanded from gl_VertexID so the quad needs no
+// vertex buffer of its own.
+const vec2 corners[4] = vec2[](vec2(-1.0, -1.0), vec2(1.0, -1.0), vec2(-1.0, 1.0), vec2(1.0, 1.0));
+
+// Clip position of this vertex's corner, offset is the corner in units of the radius.
+vec4 billboard(vec3 center, float radius, out vec2 offset)
+{
+    offset = corners[gl_VertexID];
+
+    // Offsetting in view space keeps the billboard facing the camera.
+    vec4 view_center = view * vec4(center, 1.0);
+    return projection * (view_center + vec4(offset * radius, 0.0, 0.0));
+}
@@ -0,0 +1,18 @@
+#version 460 core
+
+in vec2 vs_offset;
+in vec4 vs_color;
+
+out vec4 fs_color;
+
+void main()
+{
+    float r2 = dot(vs_offset, vs_offset);
+    if (r2 > 1.0) {
+        discard;
+    }
+
+    // Bright core fading out to the edge, like the cluster of bodies it stands in for.
+    float falloff = exp(-4.0 * r2) * (1.0 - r2);
+    fs_color = vec4(vs_color.rgb, vs_color.a * falloff);
+}
@@ -0,0 +1,13 @@
+// Compiled after billboard.glsl, which has the #version and billboard().
+
+layout (location = 0) in vec4 in_center_radius;
+layout (location = 1) in vec4 in_color;
+
+out vec2 vs_offset;
+out vec4 vs_color;
+
+void main()
+{
+    vs_color = in_color;
+    gl_Position = billboard(in_center_radius.xyz, in_center_radius.w, vs_offset);
+}
@@ -0,0 +1,18 @@
+#version 460 core
+
+in vec2 vs_offset;
+in vec4 vs_color;
+
+out vec4 fs_color;
+
+void main()
+{
+    float r2 = dot(vs_offset, vs_offset);
+    if (r2 > 1.0) {
+        discard;
+    }
+
+    // Shaded like a sphere lit from the camera, so overlapping bodies stay apart.
+    float facing = sqrt(1.0 - r2);
+    fs_color = vec4(vs_color.rgb * (0.25 + 0.75 * facing), vs_color.a);
+}
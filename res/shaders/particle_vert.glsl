@@ -0,0 +1,15 @@
+// Compiled after billboard.glsl, which has the #version and billboard().
+
+layout (location = 0) in vec3 in_position;
+layout (location = 1) in vec4 in_color;
+
+out vec2 vs_offset;
+out vec4 vs_color;
+
+uniform float radius;
+
+void main()
+{
+    vs_color = in_color;
+    gl_Position = billboard(in_position, radius, vs_offset);
+}
@@ -43,6 +43,10 @@ protected:
     virtual void set_render_model_uniforms(Shader_program& shader) noexcept = 0;
     virtual void set_user_uniforms_before_render() noexcept = 0;
 
+    /// Draws what the user renders on its own, after the models and instances and before the
+    /// text. Does nothing by default.
+    virtual void render_user() noexcept;
+
 
     void register_keys(std::initializer_list<std::int32_t> keys,
                        std::initializer_list<std::int32_t> mouse_buttons) noexcept;
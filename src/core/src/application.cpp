@@ -87,6 +87,7 @@ void Application::update() noexcept
 
     render_models();
     render_instanced();
+    render_user();
     render_text();
 
     glfwSwapBuffers(m_window.get());
@@ -96,6 +97,8 @@ void Application::update() noexcept
     m_frame_counter++;
 }
 
+void Application::render_user() noexcept {}
+
 void Application::render_models() noexcept
 {
     std::chrono::high_resolution_clock::time_point sw_start{
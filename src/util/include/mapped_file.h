@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) https://github.com/kaapomoi 2023.
+ */
+
+#ifndef SALMIAC_MAPPED_FILE_H
+#define SALMIAC_MAPPED_FILE_H
+
+#include <cstddef>
+#include <span>
+#include <string>
+
+namespace sal {
+
+///
+/// \brief Memory mapping of a whole file, read-only unless it was created with create().
+///
+/// The pages are loaded by the OS as they are touched, so opening even a large file is cheap and
+/// its contents can be used in place without reading or parsing them first. Mapped pages belong
+/// to the page cache, so a mapping larger than memory is paged in and out instead of running the
+/// process out of memory.
+///
+class Mapped_file {
+public:
+    /// How a range of the mapping is about to be used, see advise().
+    enum class Access : std::size_t {
+        /// The OS default, some readahead around every fault.
+        normal = 0,
+        /// Read front to back, pages can be read well ahead and dropped soon after.
+        sequential = 1,
+        /// Read soon, start reading it in now.
+        will_need = 2
+    };
+
+    Mapped_file() = default;
+    ~Mapped_file() noexcept;
+
+    Mapped_file(Mapped_file const&) = delete;
+    Mapped_file& operator=(Mapped_file const&) = delete;
+
+    Mapped_file(Mapped_file&& other) noexcept;
+    Mapped_file& operator=(Mapped_file&& other) noexcept;
+
+    /// \return false if the file can't be opened or mapped, the mapping is left empty then.
+    bool open(std::string const& file) noexcept;
+
+    ///
+    /// \brief Creates or truncates the file to the given size and maps it for writing.
+    ///
+    /// Writes reach the file through the page cache, the file reads as zeros until written.
+    ///
+    /// \return false if the file can't be created or mapped, the mapping is left empty then.
+    ///
+    bool create(std::string const& file, std::size_t const size) noexcept;
+
+    void close() noexcept;
+
+    bool is_open() const noexcept;
+
+    std::span<std::byte const> data() const noexcept;
+
+    /// Empty unless the mapping was created with create().
+    std::span<std::byte> writable_data() const noexcept;
+
+    ///
+    /// \brief Tells the OS how the pages overlapping the range are about to be used.
+    ///
+    /// \note Only a hint, it is ignored where the OS has no matching one.
+    ///
+    void advise(std::size_t const offset,
+                std::size_t const size,
+                Access const access) const noexcept;
+
+private:
+    void* m_address{nullptr};
+    std::size_t m_size{0};
+    bool m_writable{false};
+#if defined(_WIN32)
+    void* m_file_handle{nullptr};
+    void* m_mapping_handle{nullptr};
+#endif
+};
+
+} // namespace sal
+
+#endif //SALMIAC_MAPPED_FILE_H
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) https://github.com/kaapomoi 2023.
+ */
+
+#ifndef SALMIAC_PARALLEL_FOR_H
+#define SALMIAC_PARALLEL_FOR_H
+
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <functional>
+#include <latch>
+
+namespace sal {
+
+typedef Thread_pool<std::function<void()>> Job_pool;
+
+///
+/// \brief Splits [0, n) into contiguous chunks, runs body(begin, end) for each chunk on the pool
+/// and returns once every chunk is done.
+///
+/// \note Chunks are never smaller than min_chunk_size. If that leaves a single chunk, the body
+/// runs on the calling thread.
+/// \note Must not be called from inside a job of the same pool, the waiting job would hold a
+/// worker hostage.
+///
+template<class Body>
+void parallel_for(Job_pool& pool,
+                  std::size_t const n,
+                  Body const& body,
+                  std::size_t const min_chunk_size = 1) noexcept
+{
+    static constexpr std::size_t chunks_per_thread{4};
+
+    if (n == 0) {
+        return;
+    }
+
+    std::size_t const chunk_floor{std::max<std::size_t>(min_chunk_size, 1)};
+    std::size_t const max_chunks{(n + chunk_floor - 1) / chunk_floor};
+    std::size_t const chunk_count{std::min(pool.thread_count() * chunks_per_thread, max_chunks)};
+
+    if (chunk_count <= 1) {
+        body(std::size_t{0}, n);
+        return;
+    }
+
+    std::size_t const chunk_size{(n + chunk_count - 1) / chunk_count};
+    std::latch done{static_cast<std::ptrdiff_t>(chunk_count)};
+
+    for (std::size_t c{0}; c < chunk_count; c++) {
+        std::size_t const begin{std::min(c * chunk_size, n)};
+        std::size_t const end{std::min(begin + chunk_size, n)};
+        pool.insert([&body, &done, begin, end]() -> void {
+            if (begin < end) {
+                body(begin, end);
+            }
+            done.count_down();
+        });
+    }
+
+    done.wait();
+}
+
+} // namespace sal
+
+#endif //SALMIAC_PARALLEL_FOR_H
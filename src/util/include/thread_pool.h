@@ -8,7 +8,10 @@
 
 #include "ts_queue.h"
 
+#include <algorithm>
+#include <atomic>
 #include <thread>
+#include <vector>
 
 namespace sal {
 
@@ -31,8 +34,13 @@ public:
         }
     }
 
+    /// \note Workers block on the job queue, they have to be cancelled before they can be joined.
+    ~Thread_pool() noexcept { cancel_all(); }
+
     void insert(F&& f) noexcept { m_job_queue.push(std::move(f)); }
 
+    std::size_t thread_count() const noexcept { return m_threads.size(); }
+
     void cancel_all() noexcept
     {
         m_should_close.store(true);
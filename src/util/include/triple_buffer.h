@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) https://github.com/kaapomoi 2023.
+ */
+
+#ifndef SALMIAC_TRIPLE_BUFFER_H
+#define SALMIAC_TRIPLE_BUFFER_H
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+namespace sal {
+
+///
+/// \brief Hands the latest value from one writer thread to one reader thread without locks.
+///
+/// The writer fills back() and publishes it, the reader takes the latest published value with
+/// acquire() and reads it through front(). Publishing swaps the back buffer with the middle one
+/// and acquiring swaps the front buffer with it, both with a single atomic exchange. Neither side
+/// ever waits for the other: values the reader was too slow to take are overwritten.
+///
+template<class T>
+class Triple_buffer {
+public:
+    Triple_buffer() = default;
+
+    Triple_buffer(Triple_buffer const&) = delete;
+    Triple_buffer& operator=(Triple_buffer const&) = delete;
+
+    /// Writer side, only the writer may touch it.
+    T& back() noexcept { return m_buffers[m_back]; }
+
+    ///
+    /// \brief Makes back() the latest value and hands the writer a free buffer.
+    ///
+    /// \note The new back() holds an older value, not a copy of the published one.
+    ///
+    void publish() noexcept
+    {
+        std::uint8_t const previous{m_middle.exchange(m_back | fresh, std::memory_order_acq_rel)};
+        m_back = previous & index_mask;
+    }
+
+    ///
+    /// \brief Moves the latest published value to front().
+    ///
+    /// \return false if nothing was published since the last call, front() is unchanged then
+    ///
+    bool acquire() noexcept
+    {
+        if ((m_middle.load(std::memory_order_relaxed) & fresh) == 0) {
+            return false;
+        }
+        std::uint8_t const previous{m_middle.exchange(m_front, std::memory_order_acq_rel)};
+        m_front = previous & index_mask;
+        return true;
+    }
+
+    /// Reader side, only the reader may touch it.
+    T const& front() const noexcept { return m_buffers[m_front]; }
+
+private:
+    static constexpr std::uint8_t index_mask{0x3};
+    /// Set in the middle index while it holds a value the reader hasn't taken.
+    static constexpr std::uint8_t fresh{0x4};
+
+    std::array<T, 3> m_buffers{};
+
+    /// Each index is owned by one side, the shared one sits on a cache line of its own.
+    alignas(64) std::uint8_t m_back{0};
+    alignas(64) std::atomic_uint8_t m_middle{1};
+    alignas(64) std::uint8_t m_front{2};
+};
+
+} // namespace sal
+
+#endif //SALMIAC_TRIPLE_BUFFER_H
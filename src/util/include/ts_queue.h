@@ -5,6 +5,8 @@
 #ifndef SALMIAC_TS_QUEUE_H
 #define SALMIAC_TS_QUEUE_H
 
+#include <atomic>
+#include <condition_variable>
 #include <mutex>
 #include <optional>
 #include <queue>
@@ -41,6 +43,19 @@ public:
         return retval;
     }
 
+    /// Doesn't wait, returns nothing if the queue is empty.
+    std::optional<T> try_pop() noexcept
+    {
+        std::lock_guard<std::mutex> lck(m_mutex);
+        if (m_queue.empty()) {
+            return {};
+        }
+
+        T retval{std::move(m_queue.front())};
+        m_queue.pop();
+        return retval;
+    }
+
     void cancel_all() noexcept
     {
         m_cancel_requested.store(true);
@@ -0,0 +1,239 @@
+/*
+ * Copyright (c) https://github.com/kaapomoi 2023.
+ */
+
+#include "mapped_file.h"
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <utility>
+
+namespace sal {
+
+Mapped_file::~Mapped_file() noexcept
+{
+    close();
+}
+
+Mapped_file::Mapped_file(Mapped_file&& other) noexcept
+{
+    *this = std::move(other);
+}
+
+Mapped_file& Mapped_file::operator=(Mapped_file&& other) noexcept
+{
+    if (this != &other) {
+        close();
+        m_address = std::exchange(other.m_address, nullptr);
+        m_size = std::exchange(other.m_size, 0);
+        m_writable = std::exchange(other.m_writable, false);
+#if defined(_WIN32)
+        m_file_handle = std::exchange(other.m_file_handle, nullptr);
+        m_mapping_handle = std::exchange(other.m_mapping_handle, nullptr);
+#endif
+    }
+    return *this;
+}
+
+bool Mapped_file::open(std::string const& file) noexcept
+{
+    close();
+
+#if defined(_WIN32)
+    HANDLE const handle{CreateFileA(file.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                                    OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr)};
+    if (handle == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    m_file_handle = handle;
+
+    LARGE_INTEGER size{};
+    if (!GetFileSizeEx(handle, &size) || size.QuadPart == 0) {
+        close();
+        return false;
+    }
+
+    m_mapping_handle = CreateFileMappingA(handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (m_mapping_handle == nullptr) {
+        close();
+        return false;
+    }
+
+    m_address = MapViewOfFile(m_mapping_handle, FILE_MAP_READ, 0, 0, 0);
+    if (m_address == nullptr) {
+        close();
+        return false;
+    }
+    m_size = static_cast<std::size_t>(size.QuadPart);
+#else
+    int const fd{::open(file.c_str(), O_RDONLY)};
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat info {};
+    if (fstat(fd, &info) != 0 || info.st_size == 0) {
+        ::close(fd);
+        return false;
+    }
+
+    void* const address{
+        mmap(nullptr, static_cast<std::size_t>(info.st_size), PROT_READ, MAP_SHARED, fd, 0)};
+    /// The mapping keeps its own reference to the file.
+    ::close(fd);
+
+    if (address == MAP_FAILED) {
+        return false;
+    }
+    m_address = address;
+    m_size = static_cast<std::size_t>(info.st_size);
+#endif
+
+    return true;
+}
+
+bool Mapped_file::create(std::string const& file, std::size_t const size) noexcept
+{
+    close();
+
+    if (size == 0) {
+        return false;
+    }
+
+#if defined(_WIN32)
+    HANDLE const handle{CreateFileA(file.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr,
+                                    CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr)};
+    if (handle == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    m_file_handle = handle;
+
+    LARGE_INTEGER file_size{};
+    file_size.QuadPart = static_cast<LONGLONG>(size);
+    m_mapping_handle = CreateFileMappingA(handle, nullptr, PAGE_READWRITE,
+                                          static_cast<DWORD>(file_size.HighPart),
+                                          file_size.LowPart, nullptr);
+    if (m_mapping_handle == nullptr) {
+        close();
+        return false;
+    }
+
+    m_address = MapViewOfFile(m_mapping_handle, FILE_MAP_WRITE, 0, 0, 0);
+    if (m_address == nullptr) {
+        close();
+        return false;
+    }
+#else
+    int const fd{::open(file.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644)};
+    if (fd < 0) {
+        return false;
+    }
+
+    if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+        ::close(fd);
+        return false;
+    }
+
+    void* const address{mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)};
+    ::close(fd);
+
+    if (address == MAP_FAILED) {
+        return false;
+    }
+    m_address = address;
+#endif
+
+    m_size = size;
+    m_writable = true;
+    return true;
+}
+
+void Mapped_file::close() noexcept
+{
+#if defined(_WIN32)
+    if (m_address != nullptr) {
+        UnmapViewOfFile(m_address);
+    }
+    if (m_mapping_handle != nullptr) {
+        CloseHandle(m_mapping_handle);
+    }
+    if (m_file_handle != nullptr) {
+        CloseHandle(m_file_handle);
+    }
+    m_mapping_handle = nullptr;
+    m_file_handle = nullptr;
+#else
+    if (m_address != nullptr) {
+        munmap(m_address, m_size);
+    }
+#endif
+    m_address = nullptr;
+    m_size = 0;
+    m_writable = false;
+}
+
+bool Mapped_file::is_open() const noexcept
+{
+    return m_address != nullptr;
+}
+
+std::span<std::byte const> Mapped_file::data() const noexcept
+{
+    return {static_cast<std::byte const*>(m_address), m_size};
+}
+
+std::span<std::byte> Mapped_file::writable_data() const noexcept
+{
+    if (!m_writable) {
+        return {};
+    }
+    return {static_cast<std::byte*>(m_address), m_size};
+}
+
+void Mapped_file::advise(std::size_t const offset,
+                         std::size_t const size,
+                         Access const access) const noexcept
+{
+    if (offset >= m_size) {
+        return;
+    }
+    std::size_t const end{std::min(offset + size, m_size)};
+
+#if defined(_WIN32)
+    /// Windows only has a prefetch, the other hints are left to its own readahead.
+    if (access == Access::will_need) {
+        WIN32_MEMORY_RANGE_ENTRY range{static_cast<std::byte*>(m_address) + offset, end - offset};
+        PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+    }
+#else
+    /// madvise() takes whole pages, round the start down to one.
+    static std::size_t const page_size{static_cast<std::size_t>(sysconf(_SC_PAGESIZE))};
+    std::size_t const start{offset / page_size * page_size};
+
+    int advice{MADV_NORMAL};
+    switch (access) {
+    case Access::normal:
+        advice = MADV_NORMAL;
+        break;
+    case Access::sequential:
+        advice = MADV_SEQUENTIAL;
+        break;
+    case Access::will_need:
+        advice = MADV_WILLNEED;
+        break;
+    }
+    madvise(static_cast<std::byte*>(m_address) + start, end - start, advice);
+#endif
+}
+
+} // namespace sal